@@ -0,0 +1,712 @@
+/*
+ * Benchmarks the daemon's registry, polling and notification paths against a
+ * fleet simulated by the mock libjabra (mock/jabramock.c).
+ *
+ * Usage: jabra-bench <device count> [cycles]
+ *
+ * Prints one JSON object per line so results can be diffed across commits.
+ * The hot restart benchmark runs last and really execs this binary again,
+ * once per round (see benchHandoff()).
+ * Allocations are counted by wrapping malloc & friends at link time
+ * (-Wl,--wrap=...), so only allocations made by daemon code (this file,
+ * jabra.c and its modules) are counted, not those made by libjabra or libc
+ * internally.
+ * Exits with status 2 if polling allocated anything after warm-up.
+ */
+#define JABRA_NO_MAIN
+#include "../jabra.c"
+#include "jabramock.h"
+#include <sys/resource.h>
+#include <stdatomic.h>
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+// minimum number of measured cycles and minimum time spent measuring
+#define MIN_CYCLES 20
+#define MIN_MEASURE_MICROS 1000000L
+#define MAX_CYCLES 2000
+
+// hot restarts measured, every one is an exec() of this binary. What the rounds measured so far
+// travels in HANDOFF_ENV: script path, rounds, restart and resync time (sum and max), devices lost.
+#define HANDOFF_ROUNDS 5
+#define HANDOFF_ENV "JABRA_BENCH_HANDOFF"
+
+// battery history: minutes of samples recorded per headset
+#define HISTORY_MINUTES (7*24*60)
+
+// battery health: days simulated per headset, a battery status every 5 minutes while in use
+#define HEALTH_DAYS 90
+#define HEALTH_SAMPLE_SECONDS 300
+#define HEALTH_QUERIES 1000
+
+static atomic_ulong allocationCount;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+char *__real_strdup(const char *s);
+
+void *__wrap_malloc(size_t size)
+{
+    atomic_fetch_add(&allocationCount,1);
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size)
+{
+    atomic_fetch_add(&allocationCount,1);
+    return __real_calloc(count,size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add(&allocationCount,1);
+    return __real_realloc(ptr,size);
+}
+
+char *__wrap_strdup(const char *s)
+{
+    atomic_fetch_add(&allocationCount,1);
+    return __real_strdup(s);
+}
+
+static long micros(struct timespec *start, struct timespec *end)
+{
+    return (end->tv_sec - start->tv_sec)*1000000L + (end->tv_nsec - start->tv_nsec)/1000;
+}
+
+static long cpuMicros()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_utime.tv_sec*1000000L + usage.ru_utime.tv_usec + usage.ru_stime.tv_sec*1000000L + usage.ru_stime.tv_usec;
+}
+
+static long peakRssKb()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF,&usage);
+    return usage.ru_maxrss;
+}
+
+static int compareLong(const void *a, const void *b)
+{
+    long x = *(const long*) a, y = *(const long*) b;
+    return x < y ? -1 : x > y;
+}
+
+static long percentile(long *sorted, int count, int percent)
+{
+    int index = (count * percent) / 100;
+    return sorted[ index >= count ? count-1 : index ];
+}
+
+// stands in for the notification thread, throws away everything queued
+static void drainNotifications()
+{
+    pthread_mutex_lock(&notificationMutex);
+    notificationQueueHead = 0;
+    notificationQueueCount = 0;
+    pthread_mutex_unlock(&notificationMutex);
+}
+
+// makes every device due so the next pollDueDevices() polls all of them
+static void makeAllDevicesDue()
+{
+    lockDeviceList();
+    for ( int i = 0 ; i < deviceCount ; i++ ) {
+        scheduleDevice( deviceArray[i], 0 );
+    }
+    unlockDeviceList();
+}
+
+// one poll cycle of the main loop, minus the event loop: starts the batch and waits for the workers
+static void pollDueDevices()
+{
+    if ( ! startBatteryCheck(0) ) {
+        return;
+    }
+    int waitMillis;
+    while ( (waitMillis = advanceBatteryCheck()) >= 0 )
+    {
+        struct timespec wakeAt;
+        clock_gettime(CLOCK_MONOTONIC,&wakeAt);
+        wakeAt.tv_sec += waitMillis / 1000 + 1;
+        pthread_mutex_lock(&poolMutex);
+        if ( poolFinishedJobs < poolJobCount ) {
+            pthread_cond_timedwait(&poolJobDone,&poolMutex,&wakeAt);
+        }
+        pthread_mutex_unlock(&poolMutex);
+    }
+}
+
+static void sumLevels(void *context, const historysample *samples, int count)
+{
+    uint64_t *sum = context;
+    for ( int i = 0 ; i < count ; i++ ) {
+        *sum += samples[i].level;
+    }
+}
+
+// a week of minute-level samples per headset (one series per headset, at most HISTORY_MAX_SERIES),
+// taken with up to 'jitter' seconds of jitter while draining and charging
+static void benchHistory(int devices, int jitter)
+{
+    char path[] = "/tmp/jabra-bench-history-XXXXXX";
+    int fd = mkstemp(path);
+    if ( fd < 0 ) {
+        fprintf(stderr,"Failed to create history file\n");
+        exit(1);
+    }
+    close(fd);
+    openHistoryFile(path);
+    if ( ! historyFile ) {
+        fprintf(stderr,"Failed to open history file\n");
+        exit(1);
+    }
+
+    int headsets = devices < HISTORY_MAX_SERIES ? devices : HISTORY_MAX_SERIES;
+    mydeviceentry *entries = calloc(headsets,sizeof(mydeviceentry));
+    for ( int i = 0 ; i < headsets ; i++ ) {
+        snprintf(entries[i].serial,sizeof(entries[i].serial),"BENCH-%d",i);
+        entries[i].lastLevel = 100 - i % 100;
+    }
+    unsigned int seed = 42;
+    int64_t start = 1700000000;
+
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC,&begin);
+    lockDeviceList();
+    for ( int minute = 0 ; minute < HISTORY_MINUTES ; minute++ ) {
+        for ( int i = 0 ; i < headsets ; i++ ) {
+            mydeviceentry *entry = &entries[i];
+            // drains a percent every 5 to 9 minutes, charges 3 percent a minute once it got to 5 %
+            if ( entry->lastCharging ) {
+                entry->lastLevel = entry->lastLevel + 3 >= 100 ? 100 : entry->lastLevel + 3;
+                entry->lastCharging = entry->lastLevel < 100;
+            } else if ( minute % (5 + i % 5) == 0 ) {
+                entry->lastLevel--;
+                entry->lastCharging = entry->lastLevel <= 5;
+            }
+            recordHistorySample(entry->serial, &entry->historySeries, start + minute*60 + (jitter ? (int) (rand_r(&seed) % (2*jitter+1)) - jitter : 0), entry->lastLevel, entry->lastCharging);
+        }
+    }
+    unlockDeviceList();
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long appendMicros = micros(&begin,&end);
+    uint64_t samples = (uint64_t) headsets * HISTORY_MINUTES;
+    size_t bytes = HISTORY_HEADER_SIZE + (size_t) historyFile->chunkCount * sizeof(historychunk);
+
+    uint64_t sum = 0, scanned = 0;
+    clock_gettime(CLOCK_MONOTONIC,&begin);
+    for ( int i = 0 ; i < headsets ; i++ ) {
+        scanned += scanHistory(entries[i].historySeries-1,sumLevels,&sum);
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long scanMicros = micros(&begin,&end);
+    if ( scanned != samples ) {
+        fprintf(stderr,"FAILED: recorded %llu battery samples, read back %llu\n",(unsigned long long) samples,(unsigned long long) scanned);
+        exit(2);
+    }
+
+    double bytesPerSample = (double) bytes / samples;
+    printf("{\"bench\":\"history\",\"commit\":\"%s\",\"headsets\":%d,\"jitter_s\":%d,\"samples\":%llu,\"file_kb\":%zu,\"bytes_per_sample\":%.2f,"
+           "\"year_of_minutes_kb_per_headset\":%.0f,\"append_ns_per_sample\":%.1f,\"scan_ns_per_sample\":%.2f,\"scan_mb_per_s\":%.0f,\"level_sum\":%llu}\n",
+           BENCH_COMMIT, headsets, jitter, (unsigned long long) samples, bytes / 1024, bytesPerSample, bytesPerSample * 365*24*60 / 1024,
+           appendMicros * 1000.0 / samples, scanMicros * 1000.0 / samples, scanMicros ? (double) bytes / scanMicros : 0, (unsigned long long) sum);
+
+    closeHistoryFile();
+    unlink(path);
+    free(entries);
+}
+
+// One notification decision pass over the structure of arrays, per kernel: a quarter of the devices a few
+// percent off the last notified level, a third of the devices with earbuds and a cradle, an eighth with a remote control and
+// some odd --component-step/main battery steps. All kernels have to come up with the same mask.
+static void benchDecision(int devices)
+{
+    devicelevels levels = { 0 };
+    if ( ! resizeDeviceLevels(&levels,devices,0) ) {
+        fprintf(stderr,"Failed to allocate device levels\n");
+        exit(1);
+    }
+    int savedThresholds[JABRA_STATUS_COMPONENTS];
+    memcpy(savedThresholds,componentThresholds,sizeof(savedThresholds));
+    componentThresholds[LEFT] = 3;
+    componentThresholds[REMOTE_CONTROL] = 10;
+
+    srand(4711);
+    for ( int i = 0 ; i < devices ; i++ ) {
+        int step = i % 16 == 0 ? 1 + rand() % 100 : 5;
+        uint8_t notified = rand() % 101;
+        int level = rand() % 4 ? notified : notified + rand() % 9 - 4;
+        levels.level[i] = level < 0 ? 0 : level > 100 ? 100 : level;
+        levels.notifiedLevel[i] = notified;
+        int charging = rand() % 4 == 0;
+        int notifiedCharging = rand() % 50 == 0 ? ! charging : charging;
+        levels.flags[i] = (rand() % 100 ? LEVELS_HAS_STATUS : 0) | (charging ? LEVELS_CHARGING : 0) | (rand() % 200 ? LEVELS_NOTIFIED : 0) |
+                          (notifiedCharging ? LEVELS_NOTIFIED_CHARGING : 0) | (rand() % 500 == 0 ? LEVELS_FORCED : 0) |
+                          (levels.level[i] % step == 0 ? LEVELS_MULTIPLE : 0);
+        levels.step[i] = step;
+        for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+            int reported = ( i % 3 == 0 && ( c == LEFT || c == RIGHT || c == CRADLE_BATTERY ) ) || ( i % 8 == 0 && c == REMOTE_CONTROL );
+            uint8_t componentNotified = rand() % 101;
+            int componentLevel = rand() % 4 ? componentNotified : componentNotified + rand() % 7 - 3;
+            levels.componentLevel[c][i] = reported ? (componentLevel < 0 ? 0 : componentLevel > 100 ? 100 : componentLevel) : JABRA_STATUS_LEVEL_UNKNOWN;
+            levels.componentNotifiedLevel[c][i] = reported && rand() % 20 ? componentNotified : JABRA_STATUS_LEVEL_UNKNOWN;
+            if ( reported && levels.componentLevel[c][i] % componentStep(c) == 0 ) {
+                levels.componentMultiple[i] |= 1 << c;
+            }
+        }
+    }
+    levels.components = 1 << LEFT | 1 << RIGHT | 1 << CRADLE_BATTERY | 1 << REMOTE_CONTROL;
+
+    struct { const char *name; notificationkernel kernel; } kernels[] = {
+        { "scalar", needsNotificationScalar },
+#if defined(__x86_64__)
+        { "sse2", needsNotificationSse2 },
+        { "avx2", __builtin_cpu_supports("avx2") ? needsNotificationAvx2 : 0 },
+#endif
+    };
+    int count = (devices + LEVELS_BLOCK - 1) / LEVELS_BLOCK * LEVELS_BLOCK;
+    uint32_t *expected = calloc(count / 32,sizeof(uint32_t));
+    needsNotificationScalar(&levels,count,expected);
+    for ( size_t k = 0 ; k < sizeof(kernels) / sizeof(kernels[0]) ; k++ ) {
+        if ( ! kernels[k].kernel ) {
+            continue;
+        }
+        // warm-up, then as many passes as fit into a tenth of MIN_MEASURE_MICROS
+        memset(levels.mask,0,count / 8);
+        kernels[k].kernel(&levels,count,levels.mask);
+        if ( memcmp(levels.mask,expected,count / 8) != 0 ) {
+            fprintf(stderr,"FAILED: %s kernel disagrees with deviceNeedsNotification()\n",kernels[k].name);
+            exit(2);
+        }
+        long passes = 0, notify = 0, elapsed = 0;
+        struct timespec begin, end;
+        clock_gettime(CLOCK_MONOTONIC,&begin);
+        do {
+            for ( int round = 0 ; round < 100 ; round++ ) {
+                kernels[k].kernel(&levels,count,levels.mask);
+                // what notifyChangedDevices() does with the mask
+                for ( int block = 0 ; block < count / 32 ; block++ ) {
+                    for ( uint32_t bits = levels.mask[block] ; bits ; bits &= bits - 1 ) {
+                        notify += __builtin_ctz(bits) + 1;
+                    }
+                }
+            }
+            passes += 100;
+            clock_gettime(CLOCK_MONOTONIC,&end);
+            elapsed = micros(&begin,&end);
+        } while ( elapsed < MIN_MEASURE_MICROS / 10 );
+
+        int needing = 0;
+        for ( int block = 0 ; block < count / 32 ; block++ ) {
+            needing += __builtin_popcount(expected[block]);
+        }
+        printf("{\"bench\":\"decision\",\"commit\":\"%s\",\"devices\":%d,\"kernel\":\"%s\",\"selected\":%s,\"needing_notification\":%d,"
+               "\"pass_us\":%.2f,\"ns_per_device\":%.2f,\"checksum\":%ld}\n",
+               BENCH_COMMIT, devices, kernels[k].name, kernels[k].kernel == needsNotification ? "true" : "false", needing,
+               (double) elapsed / passes, elapsed * 1000.0 / passes / devices, notify / passes);
+    }
+
+    memcpy(componentThresholds,savedThresholds,sizeof(savedThresholds));
+    free(expected);
+    free(levels.memory);
+}
+
+// a quarter of a year of working days per headset. Every day starts full
+// and drains for 8 hours at a rate that grows as the battery fades, headset i down to 100 - i % 50 percent
+// of its capacity by the end. Measures the health accounting and the "worst 20" fleet query.
+static void benchHealth(int devices)
+{
+    char path[] = "/tmp/jabra-bench-state-XXXXXX";
+    int fd = mkstemp(path);
+    if ( fd < 0 ) {
+        fprintf(stderr,"Failed to create state file\n");
+        exit(1);
+    }
+    close(fd);
+    openStateFile(path);
+    if ( ! stateFile ) {
+        fprintf(stderr,"Failed to open state file\n");
+        exit(1);
+    }
+
+    int headsets = devices;
+    staterecord **records = calloc(headsets,sizeof(staterecord*));
+    lockDeviceList();
+    uint32_t initialSlots = stateFile->slotCount;
+    // records move while the table grows, the pointers get taken once all are in
+    for ( int pass = 0 ; pass < 2 ; pass++ ) {
+        for ( int i = 0 ; i < headsets ; i++ ) {
+            char serial[MAX_SERIAL_LENGTH];
+            snprintf(serial,sizeof(serial),"BENCH-%d",i);
+            records[i] = getOrCreateStateRecord(serial);
+            if ( ! records[i] ) {
+                // what the main loop would have done by now
+                unlockDeviceList();
+                growStateFile();
+                lockDeviceList();
+                records[i] = getOrCreateStateRecord(serial);
+            }
+        }
+    }
+    uint32_t slots = stateFile->slotCount;
+    unlockDeviceList();
+    if ( (int) stateFile->usedSlots != headsets ) {
+        fprintf(stderr,"FAILED: %d headsets, %u records in the state file\n",headsets,stateFile->usedSlots);
+        exit(2);
+    }
+
+    uint64_t samples = 0;
+    int64_t start = 1700000000000LL;
+    struct timespec begin, end;
+    clock_gettime(CLOCK_MONOTONIC,&begin);
+    lockDeviceList();
+    for ( int day = 0 ; day < HEALTH_DAYS ; day++ ) {
+        for ( int i = 0 ; i < headsets ; i++ ) {
+            staterecord *record = records[i];
+            double capacity = 1 - (i % 50) / 100.0 * day / (HEALTH_DAYS-1);
+            double ratePerSample = 10.0 / capacity * HEALTH_SAMPLE_SECONDS / 3600;
+            int64_t time = start + day * 86400000LL;
+            for ( int sample = 0 ; sample <= 8*3600 / HEALTH_SAMPLE_SECONDS ; sample++ ) {
+                uint8_t level = (uint8_t) (100 - sample * ratePerSample + 0.5);
+                updateBatteryHealth(record, time, level, 0);
+                // what saveDeviceState() would do
+                record->flags |= STATE_HAS_BATTERY;
+                record->lastLevel = level;
+                record->lastCharging = 0;
+                record->lastStatusAtMillis = time;
+                time += HEALTH_SAMPLE_SECONDS * 1000;
+                samples++;
+            }
+            // on the charger overnight
+            updateBatteryHealth(record, time, 100, 1);
+            record->lastLevel = 100;
+            record->lastCharging = 1;
+            record->lastStatusAtMillis = time;
+            samples++;
+        }
+    }
+    unlockDeviceList();
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long updateMicros = micros(&begin,&end);
+
+    staterecord worst[20];
+    int count = 0, tracked = 0;
+    clock_gettime(CLOCK_MONOTONIC,&begin);
+    for ( int i = 0 ; i < HEALTH_QUERIES ; i++ ) {
+        lockDeviceList();
+        count = findWorstHealth(worst,20,&tracked);
+        unlockDeviceList();
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long queryMicros = micros(&begin,&end);
+    if ( tracked != headsets || count != (headsets < 20 ? headsets : 20) ) {
+        fprintf(stderr,"FAILED: %d headsets, %d with a health estimate, %d in the worst list\n",headsets,tracked,count);
+        exit(2);
+    }
+
+    printf("{\"bench\":\"health\",\"commit\":\"%s\",\"headsets\":%d,\"state_slots\":\"%u->%u\",\"samples\":%llu,\"update_ns_per_sample\":%.1f,"
+           "\"worst20_query_us\":%.1f,\"worst_health\":%.1f,\"worst_expected\":%.1f,\"worst_cycles\":%.2f}\n",
+           BENCH_COMMIT, headsets, initialSlots, slots, (unsigned long long) samples, updateMicros * 1000.0 / samples,
+           (double) queryMicros / HEALTH_QUERIES, worst[0].healthPermille / 10.0, 100.0 - (headsets < 50 ? headsets-1 : 49),
+           worst[0].dischargedPercent / 100.0);
+
+    free(records);
+    closeStateFile();
+    unlink(path);
+}
+
+static long microsSinceHandoff()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return micros(&handoffStartedAt,&now);
+}
+
+// whether the SDK reported every device again since it got initialized
+static int allDevicesResynced()
+{
+    lockDeviceList();
+    int resynced = 1;
+    for ( int i = 0 ; i < deviceCount && resynced ; i++ ) {
+        resynced = deviceArray[i]->sdkGeneration == sdkGeneration;
+    }
+    unlockDeviceList();
+    return resynced;
+}
+
+static void initializeMock()
+{
+    Jabra_SetAppID("bench");
+    if ( initializeLibrary(removeStaleDevices,deviceAttached,deviceRemoved) != Return_Ok ) {
+        fprintf(stderr,"Failed to initialize mock library\n");
+        exit(1);
+    }
+    libraryInitialized = 1;
+    Jabra_RegisterBatteryStatusUpdateCallbackV2(batteryStatusChanged);
+}
+
+// starts the next hot restart, returns only if it failed
+static void handOffRound(const char *script, int round, long restartSum, long restartMax, long resyncSum, long resyncMax, int lost)
+{
+    char state[PATH_MAX+128];
+    snprintf(state,sizeof(state),"%s %d %ld %ld %ld %ld %d",script,round,restartSum,restartMax,resyncSum,resyncMax,lost);
+    setenv(HANDOFF_ENV,state,1);
+    handOffState();
+    fprintf(stderr,"FAILED: hot restart did not exec %s\n",selfPath);
+    exit(1);
+}
+
+// Hot restart with a fleet that pushes battery events: hands the state to a fresh image of this
+// binary (restart_us: until the state is adopted) which then initializes the SDK again
+// (resync_us: until the SDK reported every device again). Battery events that came in while
+// handing off are missed, devices that didn't make it across are lost.
+static void benchHandoff(int devices)
+{
+    char script[] = "/tmp/jabra-bench-XXXXXX";
+    int fd = mkstemp(script);
+    if ( fd < 0 ) {
+        fprintf(stderr,"Failed to create fleet script\n");
+        exit(1);
+    }
+    FILE *out = fdopen(fd,"w");
+    fprintf(out,"speed 600\nseed 42\nfleet %d first-id=1 name=\"Bench Headset\" product=0x2e91 level=random drain=1 events=1\n",devices);
+    fclose(out);
+    setenv("JABRA_MOCK_SCRIPT",script,1);
+
+    useBatteryEvents = 1;
+    initializeMock();
+    for ( int attached = 0 ; attached < devices ; usleep(10000) ) {
+        lockDeviceList();
+        attached = deviceCount;
+        unlockDeviceList();
+    }
+    handOffRound(script,0,0,0,0,0,0);
+}
+
+// one round of benchHandoff() in the image that got exec'd
+static void benchHandoffRound(int devices, int fd)
+{
+    char script[PATH_MAX];
+    int round;
+    long restartSum, restartMax, resyncSum, resyncMax;
+    int lost;
+    const char *state = getenv(HANDOFF_ENV);
+    if ( ! state || sscanf(state,"%s %d %ld %ld %ld %ld %d",script,&round,&restartSum,&restartMax,&resyncSum,&resyncMax,&lost) != 7 ) {
+        fprintf(stderr,"FAILED: %s is not set\n",HANDOFF_ENV);
+        exit(1);
+    }
+
+    useBatteryEvents = 1;
+    if ( ! adoptState(fd) ) {
+        fprintf(stderr,"FAILED: no state to adopt after hot restart\n");
+        exit(1);
+    }
+    long restartMicros = lastHandoffMicros;
+    int adopted = deviceCount;
+
+    sdkGeneration++;
+    initializeMock();
+    while ( ! allDevicesResynced() ) {
+        usleep(1000);
+    }
+    long resyncMicros = microsSinceHandoff();
+
+    round++;
+    restartSum += restartMicros;
+    resyncSum += resyncMicros;
+    restartMax = restartMicros > restartMax ? restartMicros : restartMax;
+    resyncMax = resyncMicros > resyncMax ? resyncMicros : resyncMax;
+    lost += devices - adopted;
+    if ( round < HANDOFF_ROUNDS ) {
+        handOffRound(script,round,restartSum,restartMax,resyncSum,resyncMax,lost);
+    }
+
+    Jabra_Uninitialize();
+    unlink(script);
+    unsetenv(HANDOFF_ENV);
+    printf("{\"bench\":\"hot_restart\",\"commit\":\"%s\",\"devices\":%d,\"rounds\":%d,\"restart_us_avg\":%ld,\"restart_us_max\":%ld,"
+           "\"resync_us_avg\":%ld,\"resync_us_max\":%ld,\"missed_events\":%lu,\"devices_lost\":%d}\n",
+           BENCH_COMMIT, devices, round, restartSum / round, restartMax, resyncSum / round, resyncMax,
+           (unsigned long) atomic_load(&handoffDroppedEvents), lost);
+    if ( lost > 0 ) {
+        fprintf(stderr,"FAILED: %d devices lost across %d hot restarts\n",lost,round);
+        exit(2);
+    }
+}
+
+static void benchRegistry(int devices)
+{
+    Jabra_DeviceInfo info;
+    memset(&info,0,sizeof(info));
+    info.deviceName = "Bench Headset";
+    // a fleet of one product, as in practice, so features get probed once and not per device
+    info.productID = 0x2e91;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for ( int i = 0 ; i < devices ; i++ ) {
+        info.deviceID = i+1;
+        addDevice(&info, capabilitiesOf(&info));
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long attachMicros = micros(&start,&end);
+
+    clock_gettime(CLOCK_MONOTONIC,&start);
+    for ( int i = 0 ; i < devices ; i++ ) {
+        delDevice(i+1);
+    }
+    clock_gettime(CLOCK_MONOTONIC,&end);
+    long detachMicros = micros(&start,&end);
+    drainNotifications();
+
+    printf("{\"bench\":\"registry\",\"commit\":\"%s\",\"devices\":%d,\"attach_ns_per_op\":%ld,\"detach_ns_per_op\":%ld}\n",
+           BENCH_COMMIT, devices, attachMicros*1000/devices, detachMicros*1000/devices);
+}
+
+static int writeFleetScript(char *path, int devices)
+{
+    int fd = mkstemp(path);
+    if ( fd < 0 ) {
+        return 0;
+    }
+    FILE *out = fdopen(fd,"w");
+    // levels move quickly enough that some devices cross a notification threshold every cycle
+    fprintf(out,"speed 600\nseed 42\nfleet %d first-id=1 name=\"Bench Headset\" product=0x2e91 level=random drain=1\n",devices);
+    fclose(out);
+    return 1;
+}
+
+static void benchPolling(int devices, int requestedCycles)
+{
+    char script[] = "/tmp/jabra-bench-XXXXXX";
+    if ( ! writeFleetScript(script,devices) ) {
+        fprintf(stderr,"Failed to create fleet script\n");
+        exit(1);
+    }
+    setenv("JABRA_MOCK_SCRIPT",script,1);
+
+    Jabra_SetAppID("bench");
+    if ( ! Jabra_InitializeV2(0,deviceAttached,deviceRemoved,0,0,false,0) ) {
+        fprintf(stderr,"Failed to initialize mock library\n");
+        exit(1);
+    }
+    unlink(script);
+
+    // wait for the mock to attach the whole fleet
+    for ( int attached = 0 ; attached < devices ; usleep(10000) ) {
+        lockDeviceList();
+        attached = deviceCount;
+        unlockDeviceList();
+    }
+
+    // warm-up: first poll notifies every device and grows all buffers
+    for ( int i = 0 ; i < 2 ; i++ ) {
+        makeAllDevicesDue();
+        pollDueDevices();
+        drainNotifications();
+    }
+
+    jabramock_stats statsBefore, statsAfter;
+    JabraMock_GetStats(&statsBefore);
+
+    long *cycleMicros = calloc(MAX_CYCLES,sizeof(long));
+    long totalMicros = 0;
+    long totalCpuMicros = 0;
+    unsigned long totalAllocations = 0;
+    uint64_t totalNotifications = 0;
+    int cycles = 0;
+    while ( cycles < MAX_CYCLES && ( requestedCycles > 0 ? cycles < requestedCycles : ( cycles < MIN_CYCLES || totalMicros < MIN_MEASURE_MICROS ) ) )
+    {
+        makeAllDevicesDue();
+        uint64_t enqueuedBefore = notificationMetrics.enqueued;
+
+        struct timespec start, end;
+        unsigned long allocationsBefore = atomic_load(&allocationCount);
+        long cpuBefore = cpuMicros();
+        clock_gettime(CLOCK_MONOTONIC,&start);
+
+        pollDueDevices();
+
+        clock_gettime(CLOCK_MONOTONIC,&end);
+        totalCpuMicros += cpuMicros() - cpuBefore;
+        totalAllocations += atomic_load(&allocationCount) - allocationsBefore;
+        totalNotifications += notificationMetrics.enqueued - enqueuedBefore;
+        cycleMicros[cycles] = micros(&start,&end);
+        totalMicros += cycleMicros[cycles];
+        cycles++;
+
+        drainNotifications();
+    }
+    JabraMock_GetStats(&statsAfter);
+
+    qsort(cycleMicros,cycles,sizeof(long),compareLong);
+    printf("{\"bench\":\"poll_cycle\",\"commit\":\"%s\",\"devices\":%d,\"workers\":%d,\"cycles\":%d,"
+           "\"p50_us\":%ld,\"p99_us\":%ld,\"max_us\":%ld,\"cpu_us_per_cycle\":%ld,\"allocs_per_cycle\":%.2f,"
+           "\"sdk_queries_per_cycle\":%.2f,\"notifications_per_cycle\":%.2f,\"peak_rss_kb\":%ld}\n",
+           BENCH_COMMIT, devices, pollWorkerCount, cycles,
+           percentile(cycleMicros,cycles,50), percentile(cycleMicros,cycles,99), cycleMicros[cycles-1],
+           totalCpuMicros / cycles, (double) totalAllocations / cycles,
+           (double) (statsAfter.batteryQueries - statsBefore.batteryQueries) / cycles,
+           (double) totalNotifications / cycles, peakRssKb());
+    free(cycleMicros);
+
+    Jabra_Uninitialize();
+
+    // steady-state polling must not allocate, see ensurePollScratch() and allocateSnapshot()
+    if ( totalAllocations > 0 ) {
+        fprintf(stderr,"FAILED: %lu allocations during %d steady-state poll cycles with %d devices\n",totalAllocations,cycles,devices);
+        exit(2);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // hot restart rounds get started with the same arguments plus --adopt-state <fd>
+    savedArgc = argc;
+    savedArgs = argv;
+    resolveLinkTarget("/proc/self/exe",selfPath,sizeof(selfPath));
+    int adoptFd = -1;
+    if ( argc > 2 && strcmp(argv[argc-2],"--adopt-state") == 0 ) {
+        adoptFd = atoi(argv[argc-1]);
+        argc -= 2;
+    }
+
+    if ( argc < 2 || atoi(argv[1]) < 1 || atoi(argv[1]) > USHRT_MAX ) {
+        fprintf(stderr,"Usage: %s <device count> [cycles]\n",argv[0]);
+        return 1;
+    }
+    int devices = atoi(argv[1]);
+    int cycles = argc > 2 ? atoi(argv[2]) : 0;
+
+    // keep the mock's failures and our own logging out of the way
+    openlog("jabra-bench", LOG_PID, LOG_USER);
+    setlogmask(LOG_UPTO(LOG_ERR));
+    runAsDaemon = 1;
+    useBatteryEvents = 0;
+
+    pthread_mutex_init(&deviceListMutex,NULL);
+    pthread_mutex_init(&notificationMutex,NULL);
+    pthread_cond_init(&notificationAvailable,NULL);
+    startPollWorkers();
+    initGuardedCalls();
+    selectNotificationKernel();
+
+    if ( adoptFd != -1 ) {
+        benchHandoffRound(devices,adoptFd);
+        return 0;
+    }
+    benchRegistry(devices);
+    benchPolling(devices,cycles);
+    benchHistory(devices,1);
+    benchHistory(devices,0);
+    benchHealth(devices);
+    benchDecision(devices);
+    benchHandoff(devices);
+    return 0;
+}
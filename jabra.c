@@ -1,4 +1,12 @@
+// memfd_create()
+#define _GNU_SOURCE
 #include <Common.h>
+#include "jabrastatus.h"
+#include "jabracontrol.h"
+#include "jabrac.h"
+#include "jabrastate.h"
+#include "jabrahistory.h"
+#include "jabrahost.h"
 #include "stdlib.h"
 #include "stdio.h"
 #include <libnotify/notify.h>
@@ -12,52 +20,605 @@
 #include <errno.h>
 #include <stdint.h>
 #include <time.h>
+#include <math.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdarg.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+#include <poll.h>
 
 #define PID_LOCK_FILE "/var/lock/jabrac.lock"
 
+#define JABRA_APP_ID "fb56-2b8723b1-9b05-4b1c-a3b6-960b79b75f03"
+
+// how often devices get polled anyway when the SDK pushes battery updates,
+// catches updates the SDK might have dropped
+#define RECONCILE_INTERVAL_SECONDS (15*60)
+
+// devices (by serial number) of a product that must have answered Not_Supported before the whole
+// product is taken to have no battery
+#define NO_BATTERY_CONFIRMATIONS 3
+
+// number of slots in the polling timer wheel, one slot per second (must be a power of two).
+// One revolution covers the reconcile interval and the default interval of a well charged device.
+#define WHEEL_SLOTS 2048
+
+// devices below this level (or charging) get polled more often
+#define LOW_BATTERY_PERCENTAGE 20
+// devices at or above this level that are not charging get polled less often
+#define HIGH_BATTERY_PERCENTAGE 80
+
+// number of threads querying devices concurrently
+#define DEFAULT_POLL_WORKERS 4
+#define MAX_POLL_WORKERS 64
+// how long a single battery query may take before its result gets discarded
+#define DEFAULT_POLL_TIMEOUT_MILLIS 5000
+
+// consecutive failed battery queries after which a device's circuit breaker opens
+#define BREAKER_FAILURE_THRESHOLD 3
+// how long an open breaker waits before letting a probe through, doubled whenever the probe fails
+#define BREAKER_INITIAL_BACKOFF_SECONDS 30
+#define BREAKER_MAX_BACKOFF_SECONDS (60*60)
+
+// max. number of SDK calls stuck past their deadline, beyond this guarded calls fail right away
+#define MAX_QUARANTINED_CALLS 16
+// SDK call latency histograms have one bucket per power of two microseconds
+#define SDK_LATENCY_BUCKETS 32
+
+// max. number of devices 'health' lists
+#define HEALTH_MAX_REPLY_DEVICES 100
+
+// max. number of samples the control socket's 'history' returns
+#define HISTORY_MAX_REPLY_SAMPLES 1000
+
+// time-to-empty/full estimates: samples lose weight with this time constant
+#define ESTIMATOR_TIME_CONSTANT_SECONDS (2*60*60)
+// an estimate needs this many samples since the battery last changed direction
+#define ESTIMATOR_MIN_SAMPLES 3
+// and at least this much time between the samples it is based on
+#define ESTIMATOR_MIN_SPAN_SECONDS 60
+
+// max. number of notifications waiting to be shown, further ones get dropped
+#define NOTIFICATION_QUEUE_SIZE 64
+#define MAX_NOTIFICATION_LENGTH 200
+
+// max. number of control socket clients connected at the same time
+#define MAX_CONTROL_CLIENTS 32
+// max. number of events handled per epoll_wait()
+#define MAX_EVENTS 16
+
+// hot restart (reexec): state handed over to the new binary in a memfd, see handOffState()
+#define HANDOFF_MAGIC 0x4f48424a /* "JBHO" */
+#define HANDOFF_VERSION 5
+// how long a hot restart waits for the notification daemon to accept the notification being shown
+#define HANDOFF_NOTIFICATION_WAIT_MILLIS 2000
+
+// Online linear regression of battery level over time with exponentially decaying weights.
+// The sums are kept relative to the latest sample, each sample updates them in O(1).
+typedef struct estimator {
+    double weight;
+    double sumT;
+    double sumTT;
+    double sumLevel;
+    double sumTLevel;
+    int64_t lastTimeMillis;
+    // time of the first sample since the last reset
+    int64_t firstTimeMillis;
+    uint16_t samples;
+    uint8_t lastLevel;
+    // +1 charging, -1 discharging, 0 not known yet. The regression starts over whenever it changes.
+    int8_t direction;
+} estimator;
+
+// devicelevels.flags
+#define LEVELS_HAS_STATUS        0x01
+#define LEVELS_CHARGING          0x02
+#define LEVELS_NOTIFIED          0x04
+#define LEVELS_NOTIFIED_CHARGING 0x08
+#define LEVELS_FORCED            0x10
+// level is a multiple of step
+#define LEVELS_MULTIPLE          0x20
+// devicelevels arrays hold a multiple of this many devices (the AVX2 kernel's stride), unused ones have flags 0
+#define LEVELS_BLOCK 32
+
+// what notifyChangedDevices() looks at, as a structure of arrays parallel to deviceArray.
+// Written by syncDeviceLevels() whenever a device's state changes.
+typedef struct devicelevels {
+    // one block holding all of the arrays, LEVELS_BLOCK-aligned
+    void *memory;
+    int capacity;
+    uint8_t *level;
+    uint8_t *notifiedLevel;
+    uint8_t *flags;
+    // notification step of the device's main battery
+    uint8_t *step;
+    // per BatteryComponent, JABRA_STATUS_LEVEL_UNKNOWN if not reported (not notified yet, or the main battery)
+    uint8_t *componentLevel[JABRA_STATUS_COMPONENTS];
+    uint8_t *componentNotifiedLevel[JABRA_STATUS_COMPONENTS];
+    // bit c set if componentLevel[c] is a multiple of componentStep(c), saves the kernels a division
+    uint8_t *componentMultiple;
+    // BatteryComponent bits any device ever reported as an extra unit, the kernels skip the others
+    uint32_t components;
+    // kernel output, bit i % 32 of mask[i / 32] set if device i needs a notification
+    uint32_t *mask;
+} devicelevels;
+
+// per-device circuit breaker for failing battery queries, half-open means the next poll is a probe
+typedef enum breakerstate {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+} breakerstate;
+
+typedef struct sdkcallstats {
+    uint64_t calls;
+    // calls that missed their deadline
+    uint64_t timedOut;
+    // calls that missed their deadline and still haven't returned
+    int stuck;
+    // bucket i counts calls that took less than 2^i microseconds (and at least 2^(i-1))
+    uint64_t latencyHistogram[SDK_LATENCY_BUCKETS];
+} sdkcallstats;
+
+// An SDK call running on a thread of its own so the caller can give up on it.
+// Whoever comes last (caller or thread) frees it.
+typedef struct guardedcall {
+    sdkfunction function;
+    Jabra_ReturnCode rc;
+    // device callbacks for SDK_INITIALIZE
+    void (*firstScanDone)(void);
+    void (*deviceAttached)(Jabra_DeviceInfo deviceInfo);
+    void (*deviceRemoved)(unsigned short deviceID);
+    // callback for SDK_REGISTER_BATTERY_CALLBACK
+    void (*batteryStatusChanged)(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus);
+    int done;
+    // caller gave up waiting, the thread cleans up
+    int abandoned;
+} guardedcall;
+
 typedef struct mydeviceentry {
-    struct mydeviceentry *next;
     unsigned short deviceID;
+    // value of deviceGenerations[deviceID] when this device got attached
+    uint32_t generation;
+    // position inside deviceArray
+    int index;
     char *deviceName;
+    unsigned short productID;
+    // empty if the device didn't report one, nothing gets persisted then
+    char serial[MAX_SERIAL_LENGTH];
     uint8_t notifiedAtLeastOnce;
     uint8_t lastNotifyCharging;
     uint8_t lastNotifyPercentage;
+    // notify about the next battery status even if nothing changed (control socket 'refresh')
+    uint8_t forceNotify;
+    // the latest battery status gets notified no matter what, see notifyChangedDevices()
+    uint8_t notifyForced;
+    // CAP_* bits, devices known to have no battery never get polled
+    uint8_t capabilities;
+    breakerstate breaker;
+    // failed battery queries in a row
+    int consecutiveFailures;
+    // backoff the breaker opened with most recently
+    int breakerBackoffSeconds;
+    Jabra_ReturnCode lastError;
+    // most recent battery state, used to pick the polling interval
+    uint8_t hasBatteryStatus;
+    uint8_t lastLevel;
+    uint8_t lastCharging;
+    // the SDK pushed a battery event for this device, polling only has to reconcile then
+    uint8_t pushesEvents;
+    // level per BatteryComponent, JABRA_STATUS_LEVEL_UNKNOWN if not reported
+    uint8_t componentLevels[JABRA_STATUS_COMPONENTS];
+    // level per BatteryComponent the last notification was about, JABRA_STATUS_LEVEL_UNKNOWN if none yet.
+    // The main battery's is lastNotifyPercentage.
+    uint8_t componentNotifiedLevels[JABRA_STATUS_COMPONENTS];
+    // wall clock time of the most recent battery status
+    int64_t lastStatusAtMillis;
+    // time-to-empty/full per BatteryComponent, see updateEstimates()
+    estimator estimators[JABRA_STATUS_COMPONENTS];
+    // JABRA_STATUS_MINUTES_UNKNOWN if there is no estimate, bit i of componentFilling set if component i is charging
+    uint16_t componentMinutes[JABRA_STATUS_COMPONENTS];
+    uint8_t componentFilling;
+    // component the main battery level belongs to
+    uint8_t mainComponent;
+    // copies of the state record's battery health
+    uint16_t healthPermille;
+    uint32_t dischargedPercent;
+    // value of sdkGeneration when the SDK last reported the device
+    uint32_t sdkGeneration;
+    // series in the history file + 1, 0 until the first sample got recorded
+    uint16_t historySeries;
+    // timer wheel linkage, wheelSlot is -1 while not scheduled
+    struct mydeviceentry *wheelNext;
+    struct mydeviceentry *wheelPrev;
+    int wheelSlot;
+    time_t nextPollAt;
 } mydeviceentry;
 
+// the most recent samples of a series, collected by collectHistory() for 'jabractl history'
+typedef struct historyreply {
+    historysample samples[HISTORY_MAX_REPLY_SAMPLES];
+    int wanted;
+    uint64_t seen;
+} historyreply;
+
+// immutable copy of a device's state, part of a devicesnapshot
+typedef struct devicestate {
+    unsigned short deviceID;
+    uint32_t generation;
+    char name[MAX_DEVICE_NAME_LENGTH];
+    char serial[MAX_SERIAL_LENGTH];
+    uint16_t productID;
+    uint8_t capabilities;
+    breakerstate breaker;
+    int consecutiveFailures;
+    Jabra_ReturnCode lastError;
+    // SDK calls to this device stuck past their deadline, the device counts as unhealthy while > 0
+    uint8_t stuckCalls;
+    uint8_t hasBatteryStatus;
+    uint8_t level;
+    uint8_t charging;
+    uint8_t componentLevels[JABRA_STATUS_COMPONENTS];
+    uint16_t componentMinutes[JABRA_STATUS_COMPONENTS];
+    uint8_t componentFilling;
+    uint8_t mainComponent;
+    uint16_t healthPermille;
+    uint32_t dischargedPercent;
+    int64_t lastStatusAtMillis;
+    time_t nextPollAt;
+} devicestate;
+
+// Immutable view of all attached devices. Readers get one through acquireSnapshot()
+// without ever blocking, writers publish a fresh copy after changing the device list.
+typedef struct devicesnapshot {
+    atomic_int refCount;
+    // incremented with every published snapshot
+    uint64_t version;
+    int count;
+    // number of devices that fit, snapshots get recycled
+    int capacity;
+    // next in retiredSnapshots
+    struct devicesnapshot *nextRetired;
+    devicestate devices[];
+} devicesnapshot;
+
+typedef enum notificationkind {
+    // one-off notification not tied to any device
+    NOTIFY_TRANSIENT,
+    // create or update the device's notification in place
+    NOTIFY_DEVICE,
+    // device got detached, drop its notification
+    NOTIFY_RELEASE
+} notificationkind;
+
+// a preformatted notification waiting for the notification thread
+typedef struct notificationmsg {
+    notificationkind kind;
+    devicehandle device;
+    char text[MAX_NOTIFICATION_LENGTH];
+    struct timespec enqueuedAt;
+} notificationmsg;
+
+// a connection to the control socket, buffers are reused for every command
+typedef struct controlclient {
+    int fd;
+    char input[JABRA_CONTROL_MAX_COMMAND_LENGTH];
+    int inputLength;
+    char *output;
+    size_t outputLength;
+    size_t outputSent;
+    size_t outputCapacity;
+} controlclient;
+
+typedef struct notificationmetrics {
+    uint64_t enqueued;
+    uint64_t dispatched;
+    uint64_t dropped;
+    uint64_t failed;
+    int queueDepth;
+    int maxQueueDepth;
+    // time from enqueueing a notification until the notification daemon accepted it
+    long lastLatencyMicros;
+    long maxLatencyMicros;
+    uint64_t totalLatencyMicros;
+} notificationmetrics;
+
+// a device as handed over to the new binary on a hot restart
+typedef struct handoffdevice {
+    uint16_t deviceID;
+    uint16_t productID;
+    uint32_t generation;
+    uint32_t sdkGeneration;
+    char name[MAX_DEVICE_NAME_LENGTH];
+    char serial[MAX_SERIAL_LENGTH];
+    // id the notification daemon knows the device's notification by, 0 if it has none
+    int32_t notificationId;
+    uint8_t notifiedAtLeastOnce;
+    uint8_t lastNotifyCharging;
+    uint8_t lastNotifyPercentage;
+    uint8_t forceNotify;
+    uint8_t capabilities;
+    uint8_t hasBatteryStatus;
+    uint8_t lastLevel;
+    uint8_t lastCharging;
+    uint8_t pushesEvents;
+    uint8_t componentLevels[JABRA_STATUS_COMPONENTS];
+    uint8_t componentNotifiedLevels[JABRA_STATUS_COMPONENTS];
+    int64_t lastStatusAtMillis;
+    estimator estimators[JABRA_STATUS_COMPONENTS];
+    uint16_t componentMinutes[JABRA_STATUS_COMPONENTS];
+    uint8_t componentFilling;
+    uint8_t mainComponent;
+    uint16_t healthPermille;
+    uint32_t dischargedPercent;
+    int32_t breaker;
+    int32_t consecutiveFailures;
+    int32_t breakerBackoffSeconds;
+    int32_t lastError;
+    // CLOCK_MONOTONIC seconds, which carry over exec(). -1 if not scheduled.
+    int64_t nextPollAt;
+} handoffdevice;
+
+// start of the hot restart memfd, followed by the devices and the queued notifications (notificationmsg)
+typedef struct handoffheader {
+    uint32_t magic;
+    uint32_t version;
+    // struct sizes the old binary was built with, the new one only adopts state it has the same idea of
+    uint32_t headerSize;
+    uint32_t deviceSize;
+    uint32_t notificationSize;
+    uint32_t deviceCount;
+    uint32_t notificationCount;
+    int32_t pollingIntervalSeconds;
+    // listening control socket, -1 if there is none
+    int32_t controlSocketFd;
+    char controlSocketName[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    // split mode: the SDK host keeps running across the restart, hostPid is 0 if there is none
+    int32_t hostPid;
+    int32_t hostSegmentFd;
+    int32_t hostEventFd;
+    int32_t hostRequestFd;
+    uint32_t hostPollBatch;
+    uint32_t sdkGeneration;
+    uint64_t hostRestarts;
+    uint64_t hostMessages;
+    // metrics keep counting across hot restarts
+    uint64_t loopWakeups;
+    uint64_t idleWakeups;
+    uint64_t handoffCount;
+    uint64_t droppedEvents;
+    notificationmetrics notificationMetrics;
+    uint64_t returnCodeCounts[NUMBER_OF_JABRA_RETURNCODES+1];
+    // CLOCK_MONOTONIC, when the old binary started handing off
+    struct timespec startedAt;
+} handoffheader;
 
-static void lockDeviceList();
-static void unlockDeviceList();
 static void freeDeviceEntry(mydeviceentry *entry);
+static devicesnapshot *acquireSnapshot();
+static void releaseSnapshot(devicesnapshot *snapshot);
+static void removeStatusSegment();
+static void removeControlSocket();
+static void deviceAttached(Jabra_DeviceInfo deviceInfo);
+static void deviceRemoved(unsigned short deviceID);
 
 static volatile int libraryInitialized;
-static int verbose=0;
-static int runAsDaemon=0;
+int verbose=0;
+int runAsDaemon=0;
 
-static volatile int inMainLoop = 0;
-static volatile int shutdown = 0;
+volatile int shutdownRequested = 0;
 static volatile int finalReturnCode=0;
 
 static int pollingIntervalSeconds = 5*60;
 
+// hashed timer wheel holding all devices, bucketed by nextPollAt
+static mydeviceentry *timerWheel[WHEEL_SLOTS];
+// last second for which due devices have been collected
+static time_t wheelLastTick;
+// number of devices in the timer wheel, the main loop doesn't wake up on its own while this is 0
+static int scheduledDeviceCount;
+// lower bound of nextPollAt of the devices scheduled more than one revolution ahead, -1 if there are none,
+// 0 if it has to be looked up again
+static time_t farPollEarliest = -1;
+
 static int notificationThreshold = 5;
+// per BatteryComponent notification step (--component-step), 0 means notificationThreshold
+static int componentThresholds[JABRA_STATUS_COMPONENTS];
+// how notifications and --component-step name the BatteryComponent values
+static const char *componentNames[JABRA_STATUS_COMPONENTS] = {
+    "unknown", "main", "combined", "right", "left", "cradle", "remote", "other"
+};
+
+// whether battery changes are pushed by the SDK (Jabra_RegisterBatteryStatusUpdateCallbackV2)
+// so that devices pushing them only need a slow reconciliation sweep
+int useBatteryEvents = 1;
 
 static volatile int weCreatedLockFile = 0;
 
-static volatile mydeviceentry *devices=0;
+// direct-indexed by device ID, NULL if no such device is attached
+static mydeviceentry *deviceSlots[DEVICE_ID_RANGE];
+// incremented every time a device ID gets attached
+static uint32_t deviceGenerations[DEVICE_ID_RANGE];
+// all attached devices, densely packed for iteration
+static mydeviceentry **deviceArray;
+static int deviceCount;
+static int deviceCapacity;
+// set whenever the device list changed since the last snapshot got published
+int snapshotDirty;
+// notification state of the devices in deviceArray, same index
+static devicelevels deviceLevels;
+
+// most recently published snapshot, always non-NULL once the main loop is running
+static _Atomic(devicesnapshot*) currentSnapshot;
+// readers announce themselves in the counter selected by the lowest bit of snapshotEpoch
+static atomic_uint snapshotEpoch;
+static atomic_int snapshotReaders[2];
+static uint64_t snapshotVersion;
+// replaced snapshots readers might still be about to take a reference on, reclaimSnapshots()
+// waits them out. Protected by deviceListMutex.
+static devicesnapshot *retiredSnapshots;
+// retired snapshot kept for reuse by the next publishSnapshot(), protected by deviceListMutex
+static devicesnapshot *spareSnapshot;
+
+// NULL to use the default location (see jabracontrol_socket_path())
+static char *controlSocketPath;
+// path the control socket got bound to, empty if there is none
+static char controlSocketName[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int controlSocketFd = -1;
+static controlclient controlClients[MAX_CONTROL_CLIENTS];
+
+// shared memory segment mirroring the current snapshot for local readers, NULL if not available
+static jabrastatus_segment *statusSegment;
+static char statusSegmentName[64];
+
+pthread_mutex_t deviceListMutex;
+
+// main loop, everything it waits for is a file descriptor registered with epollFd
+static int epollFd = -1;
+// drives polling, armed for the next device that is due
+static int timerFd = -1;
+// SIGTERM, SIGINT, SIGHUP, SIGUSR1, SIGUSR2 and SIGCHLD, blocked in all threads
+int signalFd = -1;
+// written to by wakeup(), e.g. from SDK callbacks
+static int wakeupFd = -1;
+// set by wakeup(1), makes the main loop notify about every device
+static atomic_int forcedWakeupPending;
+
+// main loop wake-ups in total and while no device needed polling (timer disarmed),
+// the latter not counting control socket traffic. Only touched by the main loop.
+static uint64_t loopWakeups;
+static uint64_t idleWakeups;
+
+// bounded queue feeding the notification thread, protected by notificationMutex
+static pthread_mutex_t notificationMutex;
+static pthread_cond_t notificationAvailable;
+static notificationmsg notificationQueue[NOTIFICATION_QUEUE_SIZE];
+static int notificationQueueHead;
+static int notificationQueueCount;
+static int notificationQueueOverflowing;
+static notificationmetrics notificationMetrics;
+
+// one notification per device that gets updated in place, only touched by the notification thread.
+// Generation tells whether the notification still belongs to the device currently using that ID.
+static NotifyNotification *deviceNotifications[DEVICE_ID_RANGE];
+static uint32_t deviceNotificationGenerations[DEVICE_ID_RANGE];
+// notification ids taken over on a hot restart, a device's next notification replaces the one
+// the previous binary showed if the device is still the same. Only touched by the notification thread.
+static int32_t adoptedNotificationIds[DEVICE_ID_RANGE];
+static uint32_t adoptedNotificationGenerations[DEVICE_ID_RANGE];
+// hot restart: the notification thread leaves the queue alone while paused and signals
+// notificationIdle once it's done with the notification it is showing. Protected by notificationMutex.
+static int notificationsPaused;
+static int notificationDispatching;
+static pthread_cond_t notificationIdle;
+
+// split mode (--split): the SDK lives in a helper process of its own, the SDK host.
+// Set in the daemon, the SDK host itself runs with sdkHostMode instead.
+int splitMode;
+static int sdkHostMode;
+// incremented whenever the SDK starts over with devices we still know (SDK host restarted, hot restart),
+// devices remember which generation reported them last
+uint32_t sdkGeneration;
+// hot restart: the binary to exec and the arguments we got started with. The path gets resolved
+// at startup, /proc/self/exe keeps pointing to the old binary once a package update replaced it.
+static char selfPath[PATH_MAX];
+static int savedArgc;
+static char **savedArgs;
+// set by SIGUSR2 or the control socket's 'reexec', the main loop hands off once it's done with its events
+static int reexecRequested;
+// set while handing off, SDK callbacks get ignored from then on
+static atomic_int handingOff;
+static uint64_t handoffCount;
+// when the previous binary started handing off and how long it took until we had adopted its state
+static struct timespec handoffStartedAt;
+static long lastHandoffMicros;
+// battery events ignored because they came in while handing off
+static atomic_ulong handoffDroppedEvents;
+
+// names of all SDK return codes, indexed by Jabra_ReturnCode
+#define DEFINE_CODE(a,b) #a,
+static const char *returnCodeNames[NUMBER_OF_JABRA_RETURNCODES] = {
+#include "returncodes.inc"
+};
+#undef DEFINE_CODE
+
+static const char *breakerStateNames[] = { "closed", "open", "half_open" };
+
+// battery query results by return code, the last counter collects codes this build doesn't know about.
+// Protected by deviceListMutex.
+static uint64_t returnCodeCounts[NUMBER_OF_JABRA_RETURNCODES+1];
+
+// seed for backoff jitter, only used by the main loop
+static unsigned int jitterSeed;
+
+static const char *sdkFunctionNames[SDK_FUNCTION_COUNT] = {
+    "Jabra_InitializeV2",
+    "Jabra_Uninitialize",
+    "Jabra_GetBatteryStatusV2",
+    "Jabra_GetSupportedFeatures",
+    "Jabra_GetRemoteControlBatteryStatus",
+    "Jabra_SetAppID",
+    "Jabra_RegisterBatteryStatusUpdateCallbackV2"
+};
 
-static pthread_mutex_t deviceListMutex;
+static pthread_mutex_t sdkStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static sdkcallstats sdkStats[SDK_FUNCTION_COUNT];
 
-static volatile int wakeUpFromSleep = 0;
-static volatile int forcedWakeUpFromSleep = 0;
+// SDK calls per device ID stuck past their deadline, no further calls get made to such a device
+atomic_uchar deviceStuckCalls[DEVICE_ID_RANGE];
 
-static pthread_cond_t sleep_condition;
-static pthread_mutex_t sleep_mutex;
+// guarded calls wait for their thread on this
+static pthread_mutex_t guardMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t guardCallDone;
+// threads of guarded calls that got abandoned and still haven't returned, protected by guardMutex
+static int guardCallsAbandoned;
+
+// scratch space for startBatteryCheck(), grown as needed and only used by the main loop
+static polljob *pollScratchJobs;
+static devicehandle *pollScratchHandles;
+static int pollScratchCapacity;
+
+// number of healthy poll workers the pool is kept at
+int pollWorkerCount = DEFAULT_POLL_WORKERS;
+int pollTimeoutMillis = DEFAULT_POLL_TIMEOUT_MILLIS;
+
+// worker pool state, all protected by poolMutex
+static pthread_mutex_t poolMutex;
+// signalled when a new batch is available
+static pthread_cond_t poolWorkAvailable;
+// signalled whenever a job of the current batch finishes, the last one to finish also wakes up the main loop
+static pthread_cond_t poolJobDone;
+static polljob *poolJobs;
+static int poolJobCount;
+static int poolNextJob;
+static int poolFinishedJobs;
+// incremented whenever a batch is retired so late workers can tell their job is gone
+static uint32_t poolBatchNumber;
+// workers currently inside an SDK call that already missed its deadline
+static int poolStuckWorkers;
+// all poll worker threads including stuck ones
+static int poolWorkerThreads;
 
 static int resolveLinkTarget(char *link, char *targetBuffer, size_t targetBufferSize)
 {
     char exePath[PATH_MAX];
 
-    if ( readlink(link,exePath,sizeof(exePath) ) > 0 ) {
+    // readlink() doesn't terminate the string
+    ssize_t length = readlink(link,exePath,sizeof(exePath)-1);
+    if ( length > 0 ) {
+        exePath[length] = 0;
         char *path = realpath(exePath,NULL);
         if ( path ) {
           size_t len = strlen(path);
@@ -139,92 +700,287 @@ static void deleteLockFile()
   }
 }
 
-// return: whether the wakup was forced by a SIGHUP or not
-static int sleepInterruptibly(int seconds)
+// wakes up the main loop, safe to call from any thread. 'forced' makes it re-poll and notify about every device.
+void wakeup(int forced)
 {
-    struct timespec time_to_wait;
-    clock_gettime(CLOCK_MONOTONIC,&time_to_wait);
-    time_to_wait.tv_sec += seconds;
-
-    int forcedWakeup;
+    if ( forced ) {
+        atomic_store(&forcedWakeupPending,1);
+    }
+    if ( wakeupFd != -1 ) {
+        uint64_t one = 1;
+        // EAGAIN means the counter is about to overflow, the main loop has plenty to wake up for then
+        if ( write(wakeupFd,&one,sizeof(one)) < 0 && errno != EAGAIN ) {
+            syslog(LOG_ERR,"Failed to wake up main loop: %s",strerror(errno));
+        }
+    }
+}
 
-    pthread_mutex_lock(&sleep_mutex);
-    while ( ! shutdown && ! wakeUpFromSleep ) {
-      int rc = pthread_cond_timedwait(&sleep_condition, &sleep_mutex, &time_to_wait);
-      if ( rc == ETIMEDOUT ) {
-          break;
-      }
-      if ( rc == EINVAL ) {
-        if ( runAsDaemon ) {
-            syslog(LOG_WARNING,"timedwait() failed");
-        } else {
-            printf("ERROR: timedwait() failed");
+// queues a notification for the notification thread, never blocks on the notification daemon.
+// The message gets formatted right into the queue slot.
+static void enqueueNotification(notificationkind kind, const devicehandle *device, const char *format, ...)
+{
+    pthread_mutex_lock(&notificationMutex);
+    if ( notificationQueueCount == NOTIFICATION_QUEUE_SIZE )
+    {
+        // only log the first drop of an overflow, a burst of attaches would flood syslog otherwise
+        int firstDrop = ! notificationQueueOverflowing;
+        notificationQueueOverflowing = 1;
+        notificationMetrics.dropped++;
+        pthread_mutex_unlock(&notificationMutex);
+        if ( firstDrop ) {
+            syslog(LOG_WARNING,"Notification queue full, dropping notifications");
         }
-      }
+        return;
+    }
+    notificationQueueOverflowing = 0;
+
+    notificationmsg *slot = &notificationQueue[(notificationQueueHead + notificationQueueCount) % NOTIFICATION_QUEUE_SIZE];
+    slot->kind = kind;
+    if ( device ) {
+        slot->device = *device;
+    }
+    va_list args;
+    va_start(args,format);
+    vsnprintf(slot->text,sizeof(slot->text),format,args);
+    va_end(args);
+    clock_gettime(CLOCK_MONOTONIC,&slot->enqueuedAt);
+
+    notificationQueueCount++;
+    if ( kind != NOTIFY_RELEASE ) {
+        notificationMetrics.enqueued++;
+    }
+    notificationMetrics.queueDepth = notificationQueueCount;
+    if ( notificationQueueCount > notificationMetrics.maxQueueDepth ) {
+        notificationMetrics.maxQueueDepth = notificationQueueCount;
+    }
+    pthread_cond_signal(&notificationAvailable);
+    pthread_mutex_unlock(&notificationMutex);
+}
+
+static void showNotification(const char *msg)
+{
+    enqueueNotification(NOTIFY_TRANSIENT,0,"%s",msg);
+}
+
+static void releaseDeviceNotification(mydeviceentry *entry)
+{
+    devicehandle handle = { entry->deviceID, entry->generation };
+    enqueueNotification(NOTIFY_RELEASE,&handle,"");
+}
+
+// only called on the notification thread
+static void dropDeviceNotification(unsigned short deviceID)
+{
+    if ( deviceNotifications[deviceID] ) {
+        g_object_unref( G_OBJECT( deviceNotifications[deviceID] ) );
+        deviceNotifications[deviceID] = 0;
     }
-    syslog(LOG_DEBUG,"background thread woke up from pthread_cond_timedwait()");
-    forcedWakeup = forcedWakeUpFromSleep;
-    forcedWakeUpFromSleep = 0;
-    wakeUpFromSleep = 0;
-    pthread_mutex_unlock(&sleep_mutex);
-    return forcedWakeup;
 }
 
-static void wakeup(int forced)
+// only called on the notification thread
+static NotifyNotification *getDeviceNotification(devicehandle *device, const char *text)
 {
-    syslog(LOG_DEBUG,"About to wake background thread");
-    pthread_mutex_lock(&sleep_mutex);
-    wakeUpFromSleep = 1;
-    forcedWakeUpFromSleep = forced;
-    pthread_cond_broadcast(&sleep_condition);
-    pthread_mutex_unlock(&sleep_mutex);
-    syslog(LOG_DEBUG,"Woke up background thread");
+    unsigned short id = device->deviceID;
+    if ( deviceNotifications[id] && deviceNotificationGenerations[id] != device->generation ) {
+        // left over from a device that previously used this ID
+        dropDeviceNotification(id);
+    }
+    if ( deviceNotifications[id] ) {
+        notify_notification_update(deviceNotifications[id],"jabrac",text,0);
+    } else {
+        deviceNotifications[id] = notify_notification_new("jabrac",text,0);
+        deviceNotificationGenerations[id] = device->generation;
+        notify_notification_set_timeout(deviceNotifications[id], 3000); // show for 3 seconds
+        // replaces the notification the previous binary showed for this device
+        if ( adoptedNotificationIds[id] && adoptedNotificationGenerations[id] == device->generation ) {
+            g_object_set(G_OBJECT(deviceNotifications[id]),"id",adoptedNotificationIds[id],NULL);
+        }
+        adoptedNotificationIds[id] = 0;
+    }
+    return deviceNotifications[id];
 }
 
-static void showNotification(char *msg)
+static void dispatchNotification(notificationmsg *msg)
 {
-    NotifyNotification* n = notify_notification_new ("jabrac", msg,0);
-    notify_notification_set_timeout(n, 3000); // show for 3 seconds
+    if ( msg->kind == NOTIFY_RELEASE )
+    {
+        if ( deviceNotificationGenerations[msg->device.deviceID] == msg->device.generation ) {
+            dropDeviceNotification(msg->device.deviceID);
+        }
+        return;
+    }
+
+    NotifyNotification* n;
+    if ( msg->kind == NOTIFY_DEVICE ) {
+        n = getDeviceNotification(&msg->device,msg->text);
+    } else {
+        n = notify_notification_new ("jabrac", msg->text,0);
+        notify_notification_set_timeout(n, 3000); // show for 3 seconds
+    }
     GError *error = NULL;
 
-    if ( ! notify_notification_show(n, &error) )
+    int success = notify_notification_show(n, &error);
+    if ( ! success )
     {
-        syslog(LOG_ERR,"Failed to show notification %s because of error %s",msg, error->message);
+        syslog(LOG_ERR,"Failed to show notification %s because of error %s",msg->text, error->message);
+        g_error_free(error);
+    }
+    if ( msg->kind == NOTIFY_TRANSIENT ) {
+        g_object_unref( G_OBJECT(n) );
     }
     if ( ! runAsDaemon ) {
-      printf("%s\n",msg);
+      printf("%s\n",msg->text);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    long latencyMicros = (now.tv_sec - msg->enqueuedAt.tv_sec)*1000000 + (now.tv_nsec - msg->enqueuedAt.tv_nsec)/1000;
+
+    pthread_mutex_lock(&notificationMutex);
+    notificationMetrics.dispatched++;
+    if ( ! success ) {
+        notificationMetrics.failed++;
     }
+    notificationMetrics.lastLatencyMicros = latencyMicros;
+    notificationMetrics.totalLatencyMicros += latencyMicros;
+    if ( latencyMicros > notificationMetrics.maxLatencyMicros ) {
+        notificationMetrics.maxLatencyMicros = latencyMicros;
+    }
+    pthread_mutex_unlock(&notificationMutex);
 }
 
-static void cleanupAndExit()
+static void *notificationThread(void *arg)
 {
-      lockDeviceList();
+    notificationmsg msg;
+
+    pthread_mutex_lock(&notificationMutex);
+    while ( ! shutdownRequested )
+    {
+        if ( notificationQueueCount == 0 || notificationsPaused ) {
+            pthread_cond_wait(&notificationAvailable,&notificationMutex);
+            continue;
+        }
+        msg = notificationQueue[notificationQueueHead];
+        notificationQueueHead = (notificationQueueHead+1) % NOTIFICATION_QUEUE_SIZE;
+        notificationQueueCount--;
+        notificationMetrics.queueDepth = notificationQueueCount;
+        notificationDispatching = 1;
+        pthread_mutex_unlock(&notificationMutex);
 
-      mydeviceentry *current= (mydeviceentry*) devices;
-      devices = 0;
+        dispatchNotification(&msg);
 
-      mydeviceentry *next;
-      while(current) {
-          next=current->next;
-          freeDeviceEntry(current);
-          current=next;
-      }
+        pthread_mutex_lock(&notificationMutex);
+        notificationDispatching = 0;
+        pthread_cond_broadcast(&notificationIdle);
+    }
+    pthread_mutex_unlock(&notificationMutex);
+    return 0;
+}
 
-      unlockDeviceList();
+static void startNotificationThread()
+{
+    pthread_mutex_init(&notificationMutex,NULL);
+    pthread_cond_init(&notificationAvailable,NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&notificationIdle,&attr);
+
+    pthread_t thread;
+    if ( pthread_create(&thread,NULL,notificationThread,NULL) != 0 ) {
+        syslog(LOG_ERR,"Failed to start notification thread");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
 
-      deleteLockFile();
+static void logMetrics()
+{
+    pthread_mutex_lock(&notificationMutex);
+    notificationmetrics m = notificationMetrics;
+    pthread_mutex_unlock(&notificationMutex);
 
+    devicesnapshot *snapshot = acquireSnapshot();
+    int devices = snapshot ? snapshot->count : 0;
+    unsigned long version = snapshot ? (unsigned long) snapshot->version : 0;
+    releaseSnapshot(snapshot);
 
-      if ( inMainLoop ) {
-        shutdown = 1;
-        wakeup(0);
-      } else {
-        exit(1);
-      }
+    long avgLatencyMicros = m.dispatched ? (long) (m.totalLatencyMicros / m.dispatched) : 0;
+    char msg[460];
+    snprintf(msg,sizeof(msg),"devices=%d snapshot_version=%lu wakeups=%lu idle_wakeups=%lu notifications: enqueued=%lu dispatched=%lu dropped=%lu failed=%lu queue_depth=%d max_queue_depth=%d "
+             "latency_us_last=%ld latency_us_avg=%ld latency_us_max=%ld",
+             devices, version, (unsigned long) loopWakeups, (unsigned long) idleWakeups, (unsigned long) m.enqueued, (unsigned long) m.dispatched, (unsigned long) m.dropped, (unsigned long) m.failed,
+             m.queueDepth, m.maxQueueDepth, m.lastLatencyMicros, avgLatencyMicros, m.maxLatencyMicros);
+    // the SDK host only has SDK call statistics to tell
+    if ( ! sdkHostMode ) {
+        if ( runAsDaemon ) {
+            syslog(LOG_INFO,"%s",msg);
+        } else {
+            printf("%s\n",msg);
+        }
+    }
+    if ( splitMode ) {
+        snprintf(msg,sizeof(msg),"sdk_host: pid=%d restarts=%lu messages=%lu",(int) hostPid,(unsigned long) hostRestarts,(unsigned long) hostMessages);
+        if ( runAsDaemon ) {
+            syslog(LOG_INFO,"%s",msg);
+        } else {
+            printf("%s\n",msg);
+        }
+    }
+
+    uint64_t counts[NUMBER_OF_JABRA_RETURNCODES+1];
+    lockDeviceList();
+    memcpy(counts,returnCodeCounts,sizeof(counts));
+    unlockDeviceList();
+
+    sdkcallstats stats[SDK_FUNCTION_COUNT];
+    pthread_mutex_lock(&sdkStatsMutex);
+    memcpy(stats,sdkStats,sizeof(stats));
+    pthread_mutex_unlock(&sdkStatsMutex);
+
+    for ( int i = 0 ; i < SDK_FUNCTION_COUNT ; i++ )
+    {
+        if ( stats[i].calls == 0 && stats[i].stuck == 0 ) {
+            continue;
+        }
+        // upper bounds of the buckets the 50th and 99th percentile fall into
+        long p50 = -1, p99 = -1;
+        uint64_t seen = 0;
+        for ( int bucket = 0 ; bucket < SDK_LATENCY_BUCKETS ; bucket++ ) {
+            seen += stats[i].latencyHistogram[bucket];
+            if ( p50 < 0 && seen*2 >= stats[i].calls ) {
+                p50 = 1L << bucket;
+            }
+            if ( p99 < 0 && seen*100 >= stats[i].calls*99 ) {
+                p99 = 1L << bucket;
+            }
+        }
+        snprintf(msg,sizeof(msg),"%s: calls=%lu timed_out=%lu stuck=%d latency_us_p50<%ld latency_us_p99<%ld",
+                 sdkFunctionNames[i], (unsigned long) stats[i].calls, (unsigned long) stats[i].timedOut, stats[i].stuck, p50, p99);
+        if ( runAsDaemon ) {
+            syslog(LOG_INFO,"%s",msg);
+        } else {
+            printf("%s\n",msg);
+        }
+    }
 
+    size_t length = snprintf(msg,sizeof(msg),"battery queries:");
+    for ( int i = 0 ; i <= NUMBER_OF_JABRA_RETURNCODES && length < sizeof(msg) ; i++ ) {
+        if ( counts[i] ) {
+            length += snprintf(msg+length,sizeof(msg)-length," %s=%lu",i < NUMBER_OF_JABRA_RETURNCODES ? returnCodeNames[i] : "unknown",(unsigned long) counts[i]);
+        }
+    }
+    if ( sdkHostMode ) {
+        return;
+    }
+    if ( runAsDaemon ) {
+        syslog(LOG_INFO,"%s",msg);
+    } else {
+        printf("%s\n",msg);
+    }
 }
 
-static void handleSignal(const char*msg) {
+static void logSignal(const char*msg) {
    if ( verbose ) {
         if ( runAsDaemon ) {
           syslog(LOG_INFO,"%s",msg);
@@ -232,29 +988,66 @@ static void handleSignal(const char*msg) {
           printf("%s\n",msg);
         }
     }
-    cleanupAndExit();
-}
-
-static void sigTermHandler(int signal) {
-  handleSignal("Received SIGTERM");
-}
-
-static void sigIntHandler(int signal) {
-  handleSignal("Received SIGINT");
 }
 
-static void sigHupHandler(int signal) {
-  syslog(LOG_DEBUG,"Received SIGHUP");
-  wakeup(1);
+// Signals get blocked in all threads and picked up by the main loop through a signalfd,
+// so nothing ever runs in signal context. Must be called before any thread gets started.
+int blockSignals() {
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGTERM);
+  sigaddset(&signals, SIGINT );
+  sigaddset(&signals, SIGHUP );
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGUSR2);
+  sigaddset(&signals, SIGCHLD);
+  // daemonize() ignores SIGHUP and SIGCHLD, ignored signals never make it to a signalfd
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  if ( pthread_sigmask(SIG_BLOCK, &signals, 0) != 0 ) {
+    return 0;
+  }
+  signalFd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+  return signalFd != -1;
 }
 
-static void installSignalHandlers() {
-  signal(SIGTERM, sigTermHandler);
-  signal(SIGINT , sigIntHandler );
-  signal(SIGHUP , sigHupHandler );
+// sets 'forcedWakeup' on SIGHUP
+void handleSignals(int *forcedWakeup) {
+  struct signalfd_siginfo info;
+  while ( read(signalFd, &info, sizeof(info)) == sizeof(info) )
+  {
+    switch ( info.ssi_signo ) {
+      case SIGTERM:
+        logSignal("Received SIGTERM");
+        shutdownRequested = 1;
+        break;
+      case SIGINT:
+        logSignal("Received SIGINT");
+        shutdownRequested = 1;
+        break;
+      case SIGHUP:
+        syslog(LOG_DEBUG,"Received SIGHUP");
+        *forcedWakeup = 1;
+        break;
+      case SIGUSR1:
+        logMetrics();
+        // SDK call statistics are kept where the SDK lives
+        if ( hostPid ) {
+          kill(hostPid, SIGUSR1);
+        }
+        break;
+      case SIGUSR2:
+        logSignal("Received SIGUSR2");
+        reexecRequested = 1;
+        break;
+      case SIGCHLD:
+        reapSdkHost();
+        break;
+    }
+  }
 }
 
-static void lockDeviceList()
+void lockDeviceList()
 {
     if (0 != (errno = pthread_mutex_lock(&deviceListMutex)))
     {
@@ -263,7 +1056,7 @@ static void lockDeviceList()
     }
 }
 
-static void unlockDeviceList() {
+void unlockDeviceList() {
     if (0 != (errno = pthread_mutex_unlock(&deviceListMutex)))
     {
         perror("pthread_mutex_unlock failed");
@@ -271,204 +1064,3040 @@ static void unlockDeviceList() {
     }
 }
 
-static void checkBatteryStatus(int force) {
-
-    lockDeviceList();
-
-    if ( devices )
-    {
-        // count devices
-        int deviceCount = 0;
-        mydeviceentry *current = (mydeviceentry*) devices;
-        while ( current ) {
-            current = current->next;
-            deviceCount++;
-        }
-
-        // copy IDs so we can poll battery status without having to hold the lock
-        unsigned short *ids = calloc(deviceCount,sizeof(unsigned short));
-        current = (mydeviceentry*) devices;
-        for( int i = 0 ; current ; i++, current = current->next ) {
-            ids[i] = current->deviceID;
-        }
-        unlockDeviceList();
+static int64_t currentTimeMillis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME,&now);
+    return (int64_t) now.tv_sec*1000 + now.tv_nsec/1000000;
+}
 
-        // poll battery status while not locking the deviceInfoList
-        Jabra_BatteryStatus* batteryStatus;
-        for ( int i = 0 ; i < deviceCount ; i++) {
-              // LIBRARY_API Jabra_ReturnCode Jabra_GetBatteryStatusV2(unsigned short deviceID, Jabra_BatteryStatus** batteryStatus);
-              Jabra_ReturnCode rc = Jabra_GetBatteryStatusV2( ids[i], &batteryStatus );
-              if ( rc == Return_Ok )
-              {
-                  // find entry and notify if necessary
-                  lockDeviceList();
-
-                  current = (mydeviceentry*) devices;
-                  while ( current && current->deviceID != ids[i] ) {
-                      current = current->next;
-                  }
-                  if ( current )
-                  {
-                    uint8_t level = batteryStatus->levelInPercent;
-                    uint8_t charging = batteryStatus->charging;
-
-                    uint8_t notified = current->notifiedAtLeastOnce;
-                    uint8_t chargingStateChanged = notified && current->lastNotifyCharging != charging;
-                    uint8_t levelNotNotifiedYet = notified && current->lastNotifyPercentage != level;
-                    uint8_t levelIsMultipleOfThreshold = (level % notificationThreshold ) == 0;
-                    uint8_t deltaExceedsThreshold = notified && abs(current->lastNotifyPercentage - level) >= notificationThreshold;
-
-                    if ( force || ! notified || chargingStateChanged || ( levelNotNotifiedYet && ( levelIsMultipleOfThreshold || deltaExceedsThreshold ) ) )
-                    {
-                        char msg[200];
-                        const char *format;
-                        if ( charging ) {
-                            format = "Battery of '%s' is now at %d %% (charging)";
-                        } else {
-                            format = "Battery of '%s' is now at %d %%";
-                        }
-                        snprintf(msg,sizeof(msg),format,current->deviceName,level);
-                        showNotification( msg );
-
-                        if ( ! force ) {
-                            current->notifiedAtLeastOnce=1;
-                            current->lastNotifyPercentage=level;
-                            current->lastNotifyCharging=charging ? 1:0;
-                        }
-                    }
-                  }
-                  Jabra_FreeBatteryStatus(batteryStatus);
-                  unlockDeviceList();
-
-              } else if ( rc != Not_Supported) { // device has no battery
-                  syslog(LOG_ERR,"Failed to query battery status for device %04x: error %d", ids[i], rc );
-              }
-        }
+static void openStatusSegment()
+{
+    jabrastatus_name(statusSegmentName,sizeof(statusSegmentName));
 
+    // device names and battery levels are nobody else's business on a shared machine
+    int fd = shm_open(statusSegmentName, O_CREAT | O_RDWR, 0600);
+    if ( fd < 0 ) {
+        syslog(LOG_ERR,"Failed to create status segment %s: %s",statusSegmentName,strerror(errno));
+        return;
+    }
+    // one left behind by an older version might still be readable by others
+    struct stat st;
+    if ( fstat(fd,&st) != 0 || st.st_uid != getuid() || fchmod(fd,0600) != 0 ) {
+        syslog(LOG_ERR,"Status segment %s is not ours or can't be made private, not using it",statusSegmentName);
+        close(fd);
+        return;
+    }
+    if ( ftruncate(fd,sizeof(jabrastatus_segment)) != 0 ) {
+        syslog(LOG_ERR,"Failed to size status segment %s: %s",statusSegmentName,strerror(errno));
+        close(fd);
+        return;
+    }
+    void *mapped = mmap(0,sizeof(jabrastatus_segment),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    close(fd);
+    if ( mapped == MAP_FAILED ) {
+        syslog(LOG_ERR,"Failed to map status segment %s: %s",statusSegmentName,strerror(errno));
+        return;
+    }
 
-        // free memory
-        free(ids);
-    } else {
-        unlockDeviceList();
+    statusSegment = mapped;
+    // readers might still hold a mapping from a previous run, keep the sequence going
+    __atomic_fetch_add(&statusSegment->sequence, statusSegment->sequence & 1 ? 1 : 2, __ATOMIC_RELEASE);
+    // a hot restart keeps the PID, readers keep seeing the devices until the first snapshot gets published
+    if ( statusSegment->pid != getpid() || statusSegment->version != JABRA_STATUS_VERSION ) {
+        statusSegment->pid = getpid();
+        statusSegment->deviceCount = 0;
     }
+    statusSegment->magic = JABRA_STATUS_MAGIC;
+    statusSegment->version = JABRA_STATUS_VERSION;
 }
 
-static void freeDeviceEntry(mydeviceentry *entry) {
-    free(entry->deviceName);
-    free(entry);
+static void removeStatusSegment()
+{
+    if ( statusSegment ) {
+        shm_unlink(statusSegmentName);
+    }
 }
 
-static void delDevice(unsigned short deviceID)
+static void writeStatusSegment(devicesnapshot *snapshot)
 {
-    syslog(LOG_INFO,"DETACHED: device with ID %04x", deviceID);
+    if ( ! statusSegment ) {
+        return;
+    }
 
-    lockDeviceList();
+    // odd sequence tells readers an update is in progress
+    __atomic_fetch_add(&statusSegment->sequence,1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    mydeviceentry *previous=0;
-    mydeviceentry *current=(mydeviceentry*) devices;
-    while ( current )
+    int count = snapshot->count;
+    statusSegment->flags = 0;
+    if ( count > JABRA_STATUS_MAX_DEVICES ) {
+        count = JABRA_STATUS_MAX_DEVICES;
+        statusSegment->flags |= JABRA_STATUS_TRUNCATED;
+    }
+    for ( int i = 0 ; i < count ; i++ )
     {
-      if ( current->deviceID == deviceID )
-      {
-          if ( previous == 0 ) {
-            devices = current->next;
-          } else {
-            previous->next = current->next;
-          }
-          freeDeviceEntry(current);
-          break;
-      }
-      previous = current;
-      current = current->next;
+        devicestate *state = &snapshot->devices[i];
+        jabrastatus_device *device = &statusSegment->devices[i];
+        device->deviceID = state->deviceID;
+        device->flags = (state->hasBatteryStatus ? JABRA_STATUS_HAS_BATTERY : 0) | (state->charging ? JABRA_STATUS_CHARGING : 0);
+        device->level = state->level;
+        memcpy(device->componentLevels,state->componentLevels,sizeof(device->componentLevels));
+        device->componentFilling = state->componentFilling;
+        device->minutes = state->componentMinutes[state->mainComponent];
+        memcpy(device->componentMinutes,state->componentMinutes,sizeof(device->componentMinutes));
+        device->updatedAtMillis = state->lastStatusAtMillis;
+        memcpy(device->name,state->name,sizeof(device->name));
     }
+    statusSegment->deviceCount = count;
+    statusSegment->publishedAtMillis = currentTimeMillis();
 
-    unlockDeviceList();
+    __atomic_fetch_add(&statusSegment->sequence,1,__ATOMIC_RELEASE);
 }
 
-static void addDevice(Jabra_DeviceInfo* info) {
-
-    syslog(LOG_INFO,"ATTACHED: device with ID %04x (%s)", info->deviceID, info->deviceName);
-
-    lockDeviceList();
-
-    mydeviceentry *newEntry = calloc(1,sizeof(mydeviceentry));
-    newEntry->deviceID = info->deviceID;
-    newEntry->deviceName = strdup(info->deviceName);
+int makeDirectories(char *path)
+{
+    for ( char *slash = strchr(path+1,'/') ; slash ; slash = strchr(slash+1,'/') )
+    {
+        *slash = 0;
+        int rc = mkdir(path,0700);
+        *slash = '/';
+        if ( rc != 0 && errno != EEXIST ) {
+            return 0;
+        }
+    }
+    return 1;
+}
 
-    if ( devices )  {
-      newEntry->next = (mydeviceentry*) devices;
-      devices = newEntry;
+int defaultStateFilePath(char *buffer, size_t bufferSize, const char *fileName)
+{
+    const char *stateHome = getenv("XDG_STATE_HOME");
+    const char *home = getenv("HOME");
+    if ( stateHome && stateHome[0] ) {
+        snprintf(buffer,bufferSize,"%s/jabrac/%s",stateHome,fileName);
+    } else if ( home && home[0] ) {
+        snprintf(buffer,bufferSize,"%s/.local/state/jabrac/%s",home,fileName);
     } else {
-      devices = newEntry;
+        return 0;
     }
+    return 1;
+}
 
-    unlockDeviceList();
+// copies what we know from a previous run into a freshly attached device.
+// device list must be locked by caller
+static void restoreDeviceState(mydeviceentry *entry)
+{
+    staterecord *record = getOrCreateStateRecord(entry->serial);
+    if ( ! record ) {
+        return;
+    }
+    if ( record->flags & STATE_NOTIFIED ) {
+        entry->notifiedAtLeastOnce = 1;
+        entry->lastNotifyPercentage = record->lastNotifyPercentage;
+        entry->lastNotifyCharging = record->lastNotifyCharging;
+    }
+    if ( record->flags & STATE_HAS_BATTERY ) {
+        entry->hasBatteryStatus = 1;
+        entry->lastLevel = record->lastLevel;
+        entry->lastCharging = record->lastCharging;
+        entry->lastStatusAtMillis = record->lastStatusAtMillis;
+    }
+    entry->healthPermille = record->healthPermille;
+    entry->dischargedPercent = record->dischargedPercent;
+    record->productID = entry->productID;
+    record->lastSeenMillis = currentTimeMillis();
+}
 
-    wakeup(0);
+// device list must be locked by caller
+static void saveDeviceState(mydeviceentry *entry)
+{
+    staterecord *record = getOrCreateStateRecord(entry->serial);
+    if ( ! record ) {
+        return;
+    }
+    record->flags = (record->flags & STATE_NO_BATTERY) | (entry->notifiedAtLeastOnce ? STATE_NOTIFIED : 0) |
+                    (entry->hasBatteryStatus ? STATE_HAS_BATTERY : 0);
+    record->lastNotifyPercentage = entry->lastNotifyPercentage;
+    record->lastNotifyCharging = entry->lastNotifyCharging;
+    record->lastLevel = entry->lastLevel;
+    record->lastCharging = entry->lastCharging;
+    record->lastStatusAtMillis = entry->lastStatusAtMillis;
+    record->lastSeenMillis = currentTimeMillis();
 }
 
-static void daemonize()
+static long microsSince(struct timespec *start)
 {
-    pid_t pid = fork();
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (now.tv_sec - start->tv_sec)*1000000L + (now.tv_nsec - start->tv_nsec)/1000;
+}
 
-    if (pid < 0) {
-        exit(EXIT_FAILURE);
+// records a finished SDK call (including ones that returned after their deadline)
+static void recordSdkCall(sdkfunction function, struct timespec *startedAt, int returnedLate)
+{
+    long micros = microsSince(startedAt);
+    int bucket = micros <= 0 ? 0 : 64 - __builtin_clzll(micros);
+    if ( bucket >= SDK_LATENCY_BUCKETS ) {
+        bucket = SDK_LATENCY_BUCKETS-1;
     }
+    pthread_mutex_lock(&sdkStatsMutex);
+    sdkStats[function].calls++;
+    sdkStats[function].latencyHistogram[bucket]++;
+    if ( returnedLate ) {
+        sdkStats[function].stuck--;
+    }
+    pthread_mutex_unlock(&sdkStatsMutex);
+}
 
-    if (pid > 0)
-        exit(EXIT_SUCCESS);
+// an SDK call missed its deadline and got abandoned, 'deviceID' is -1 if the call isn't about a single device
+static void quarantineSdkCall(sdkfunction function, int deviceID)
+{
+    pthread_mutex_lock(&sdkStatsMutex);
+    sdkStats[function].timedOut++;
+    sdkStats[function].stuck++;
+    pthread_mutex_unlock(&sdkStatsMutex);
+    if ( deviceID >= 0 && atomic_fetch_add(&deviceStuckCalls[deviceID],1) == 0 ) {
+        syslog(LOG_WARNING,"%s for device %04x is stuck, considering the device unhealthy",sdkFunctionNames[function],deviceID);
+    }
+}
 
-    if (setsid() < 0) {
-        exit(EXIT_FAILURE);
+// an abandoned call finally returned
+static void releaseSdkCall(sdkfunction function, int deviceID)
+{
+    if ( deviceID >= 0 && atomic_fetch_sub(&deviceStuckCalls[deviceID],1) == 1 )
+    {
+        syslog(LOG_INFO,"%s for device %04x returned, device is healthy again",sdkFunctionNames[function],deviceID);
+        lockDeviceList();
+        snapshotDirty = 1;
+        unlockDeviceList();
+        wakeup(0);
     }
+}
 
-    signal(SIGCHLD, SIG_IGN);
-    signal(SIGHUP, SIG_IGN);
+static void *guardedCallThread(void *arg)
+{
+    guardedcall *call = arg;
+    struct timespec startedAt;
+    clock_gettime(CLOCK_MONOTONIC,&startedAt);
 
-    pid = fork();
-    if (pid < 0) {
-        exit(EXIT_FAILURE);
+    switch ( call->function ) {
+        case SDK_INITIALIZE:
+            /*
+              void(*FirstScanForDevicesDoneFunc)(void),
+              void(*DeviceAttachedFunc)(Jabra_DeviceInfo deviceInfo),
+              void(*DeviceRemovedFunc)(unsigned short deviceID),
+              void(*ButtonInDataRawHidFunc)(unsigned short deviceID, unsigned short usagePage, unsigned short usage, bool buttonInData),
+              void(*ButtonInDataTranslatedFunc)(unsigned short deviceID, Jabra_HidInput translatedInData, bool buttonInData),
+            */
+            call->rc = Jabra_InitializeV2(call->firstScanDone,call->deviceAttached,call->deviceRemoved,0,0,false,0) ? Return_Ok : System_Error;
+            break;
+        case SDK_UNINITIALIZE:
+            Jabra_Uninitialize();
+            call->rc = Return_Ok;
+            break;
+        case SDK_SET_APP_ID:
+            Jabra_SetAppID(JABRA_APP_ID);
+            call->rc = Return_Ok;
+            break;
+        case SDK_REGISTER_BATTERY_CALLBACK:
+            Jabra_RegisterBatteryStatusUpdateCallbackV2(call->batteryStatusChanged);
+            call->rc = Return_Ok;
+            break;
+        default:
+            call->rc = Return_ParameterFail;
+            break;
     }
 
-    if (pid > 0) {
-        exit(EXIT_SUCCESS);
+    // the caller may free 'call' as soon as it's done, unless it gave up on it
+    sdkfunction function = call->function;
+    pthread_mutex_lock(&guardMutex);
+    int abandoned = call->abandoned;
+    call->done = 1;
+    if ( abandoned ) {
+        guardCallsAbandoned--;
     }
+    pthread_cond_broadcast(&guardCallDone);
+    pthread_mutex_unlock(&guardMutex);
 
-    umask(0);
-
-    chdir("/");
-
-    int x;
-    for (x = sysconf(_SC_OPEN_MAX); x>=0; x--)
+    recordSdkCall(function,&startedAt,abandoned);
+    if ( abandoned )
     {
-        close (x);
+        releaseSdkCall(function,-1);
+        free(call);
     }
-
-    openlog ("jabrac", LOG_PID, LOG_DAEMON);
+    return 0;
 }
 
-static void deviceAttached(Jabra_DeviceInfo deviceInfo) {
-    addDevice(&deviceInfo);
-    Jabra_FreeDeviceInfo(deviceInfo);
-}
+// runs an SDK call on a thread of its own and waits at most 'timeoutMillis' for it.
+// Returns Return_Timeout if the call missed its deadline, 'call' must not be touched anymore then.
+static Jabra_ReturnCode runGuardedCall(guardedcall *call, int timeoutMillis)
+{
+    sdkfunction function = call->function;
 
-static void deviceRemoved(unsigned short deviceID) {
-    delDevice(deviceID);
-}
+    pthread_mutex_lock(&guardMutex);
+    int stuckThreads = guardCallsAbandoned;
+    pthread_mutex_unlock(&guardMutex);
+    if ( stuckThreads >= MAX_QUARANTINED_CALLS ) {
+        syslog(LOG_ERR,"Not calling %s, %d earlier calls are still stuck",sdkFunctionNames[function],stuckThreads);
+        return System_Error;
+    }
 
-int main(int argc, char** args) {
+    pthread_t thread;
+    if ( pthread_create(&thread,NULL,guardedCallThread,call) != 0 ) {
+        return System_Error;
+    }
+    pthread_detach(thread);
 
-  if ( argc > 0 )
-  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC,&deadline);
+    deadline.tv_sec += timeoutMillis / 1000;
+    deadline.tv_nsec += (timeoutMillis % 1000) * 1000000L;
+    if ( deadline.tv_nsec >= 1000000000L ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&guardMutex);
+    int abandoned = 0;
+    while ( ! call->done ) {
+        if ( pthread_cond_timedwait(&guardCallDone,&guardMutex,&deadline) == ETIMEDOUT && ! call->done ) {
+            // quarantine before the thread can see 'abandoned' and release it, the thread owns 'call' from then on
+            quarantineSdkCall(function,-1);
+            guardCallsAbandoned++;
+            call->abandoned = abandoned = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&guardMutex);
+
+    if ( abandoned ) {
+        syslog(LOG_ERR,"%s did not return within %d ms",sdkFunctionNames[function],timeoutMillis);
+        return Return_Timeout;
+    }
+    return call->rc;
+}
+
+// guarded call of an SDK function that takes no arguments we care about
+Jabra_ReturnCode runGuardedLibraryCall(sdkfunction function, int timeoutMillis)
+{
+    guardedcall *call = calloc(1,sizeof(guardedcall));
+    if ( ! call ) {
+        return System_Error;
+    }
+    call->function = function;
+    Jabra_ReturnCode rc = runGuardedCall(call,timeoutMillis);
+    if ( rc != Return_Timeout ) {
+        free(call);
+    }
+    return rc;
+}
+
+// guarded Jabra_InitializeV2() reporting devices to the given callbacks
+Jabra_ReturnCode initializeLibrary(void (*firstScanDone)(void), void (*attached)(Jabra_DeviceInfo deviceInfo), void (*removed)(unsigned short deviceID))
+{
+    guardedcall *call = calloc(1,sizeof(guardedcall));
+    if ( ! call ) {
+        return System_Error;
+    }
+    call->function = SDK_INITIALIZE;
+    call->firstScanDone = firstScanDone;
+    call->deviceAttached = attached;
+    call->deviceRemoved = removed;
+    Jabra_ReturnCode rc = runGuardedCall(call,SDK_INITIALIZE_TIMEOUT_MILLIS);
+    if ( rc != Return_Timeout ) {
+        free(call);
+    }
+    return rc;
+}
+
+// guarded Jabra_RegisterBatteryStatusUpdateCallbackV2(), devices whose events don't arrive just keep getting polled
+void registerBatteryCallback(void (*callback)(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus))
+{
+    guardedcall *call = calloc(1,sizeof(guardedcall));
+    if ( ! call ) {
+        syslog(LOG_ERR,"Out of memory, not registering for battery events");
+        return;
+    }
+    call->function = SDK_REGISTER_BATTERY_CALLBACK;
+    call->batteryStatusChanged = callback;
+    if ( runGuardedCall(call,SDK_SETUP_TIMEOUT_MILLIS) != Return_Timeout ) {
+        free(call);
+    }
+}
+
+void initGuardedCalls()
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&guardCallDone,&attr);
+}
+
+static int hasNoBattery(uint8_t capabilities)
+{
+    return (capabilities & (CAP_BATTERY_KNOWN|CAP_BATTERY)) == CAP_BATTERY_KNOWN;
+}
+
+// remembers what we learnt about a device for all devices of the same product.
+// device list must be locked by caller
+static void learnCapabilities(mydeviceentry *entry, uint8_t capabilities)
+{
+    if ( (capabilities & CAP_BATTERY) && ! (entry->capabilities & CAP_BATTERY) ) {
+        staterecord *record = getOrCreateStateRecord(entry->serial);
+        if ( record ) {
+            record->flags &= ~STATE_NO_BATTERY;
+        }
+    }
+    entry->capabilities |= capabilities;
+    if ( entry->productID != 0 && (productCapabilities[entry->productID] | capabilities) != productCapabilities[entry->productID] ) {
+        productCapabilities[entry->productID] |= capabilities;
+    }
+    snapshotDirty = 1;
+}
+
+// a battery query answered Not_Supported, the product only gets written off after NO_BATTERY_CONFIRMATIONS devices.
+// device list must be locked by caller
+static void learnNoBattery(mydeviceentry *entry)
+{
+    entry->capabilities |= CAP_BATTERY_KNOWN;
+    snapshotDirty = 1;
+    staterecord *record = getOrCreateStateRecord(entry->serial);
+    if ( ! record ) {
+        return;
+    }
+    record->flags |= STATE_NO_BATTERY;
+    if ( entry->productID == 0 || (productCapabilities[entry->productID] & (CAP_BATTERY_KNOWN|CAP_BATTERY)) ) {
+        return;
+    }
+    int confirmations = countNoBatteryRecords(entry->productID);
+    if ( confirmations >= NO_BATTERY_CONFIRMATIONS ) {
+        syslog(LOG_INFO,"Product %04x has no battery (%d devices answered Not_Supported), its devices won't be polled anymore",
+               entry->productID, confirmations);
+        productCapabilities[entry->productID] |= CAP_BATTERY_KNOWN;
+    }
+}
+
+// what a device's product is known to be capable of without asking the device. Its features get
+// probed along with its first battery query, see probeFeatures().
+uint8_t capabilitiesOf(Jabra_DeviceInfo *info)
+{
+    // dongles don't have a battery, the SDK answers Not_Supported for them
+    return info->isDongle ? CAP_BATTERY_KNOWN : 0;
+}
+
+static const char *returnCodeName(Jabra_ReturnCode rc)
+{
+    return (unsigned) rc < NUMBER_OF_JABRA_RETURNCODES ? returnCodeNames[rc] : "unknown";
+}
+
+// device list must be locked by caller
+static void countReturnCode(Jabra_ReturnCode rc)
+{
+    returnCodeCounts[ (unsigned) rc < NUMBER_OF_JABRA_RETURNCODES ? rc : NUMBER_OF_JABRA_RETURNCODES ]++;
+}
+
+static time_t monotonicSeconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec;
+}
+
+// picks how long to wait before polling a device again, based on its last known battery state
+static int pollInterval(mydeviceentry *entry)
+{
+    int interval = pollingIntervalSeconds;
+    if ( entry->hasBatteryStatus )
+    {
+        if ( entry->lastCharging || entry->lastLevel < LOW_BATTERY_PERCENTAGE ) {
+            interval = interval / 4;
+        } else if ( entry->lastLevel >= HIGH_BATTERY_PERCENTAGE ) {
+            interval = interval * 4;
+        }
+    }
+    // devices that never pushed an event keep the adaptive interval, the SDK might not support events for them
+    if ( useBatteryEvents && entry->pushesEvents && interval < RECONCILE_INTERVAL_SECONDS ) {
+        interval = RECONCILE_INTERVAL_SECONDS;
+    }
+    return interval < 1 ? 1 : interval;
+}
+
+// device list must be locked by caller
+static void unscheduleDevice(mydeviceentry *entry)
+{
+    if ( entry->wheelSlot < 0 ) {
+        return;
+    }
+    if ( entry->wheelPrev ) {
+        entry->wheelPrev->wheelNext = entry->wheelNext;
+    } else {
+        timerWheel[entry->wheelSlot] = entry->wheelNext;
+    }
+    if ( entry->wheelNext ) {
+        entry->wheelNext->wheelPrev = entry->wheelPrev;
+    }
+    entry->wheelNext = entry->wheelPrev = 0;
+    entry->wheelSlot = -1;
+    scheduledDeviceCount--;
+    if ( entry->nextPollAt == farPollEarliest ) {
+        farPollEarliest = 0;
+    }
+}
+
+// device list must be locked by caller
+static void scheduleDevice(mydeviceentry *entry, int delaySeconds)
+{
+    unscheduleDevice(entry);
+    if ( hasNoBattery(entry->capabilities) ) {
+        return;
+    }
+
+    entry->nextPollAt = monotonicSeconds() + delaySeconds;
+    if ( delaySeconds >= WHEEL_SLOTS && farPollEarliest != 0 && ( farPollEarliest == -1 || entry->nextPollAt < farPollEarliest ) ) {
+        farPollEarliest = entry->nextPollAt;
+    }
+    entry->wheelSlot = entry->nextPollAt & (WHEEL_SLOTS-1);
+    entry->wheelPrev = 0;
+    entry->wheelNext = timerWheel[entry->wheelSlot];
+    if ( entry->wheelNext ) {
+        entry->wheelNext->wheelPrev = entry;
+    }
+    timerWheel[entry->wheelSlot] = entry;
+    scheduledDeviceCount++;
+}
+
+// copies the handles of all devices due at 'now' into 'handles' and re-arms them.
+// device list must be locked by caller
+static int collectDueDevices(time_t now, devicehandle *handles, int maxHandles)
+{
+    int count = 0;
+    time_t from = wheelLastTick;
+    if ( now - from >= WHEEL_SLOTS ) {
+        from = now - WHEEL_SLOTS + 1;
+    }
+    for ( time_t tick = from ; tick <= now ; tick++ )
+    {
+        mydeviceentry *current = timerWheel[tick & (WHEEL_SLOTS-1)];
+        while ( current && count < maxHandles ) {
+            mydeviceentry *next = current->wheelNext;
+            if ( current->nextPollAt <= now ) {
+                handles[count].deviceID = current->deviceID;
+                handles[count].generation = current->generation;
+                count++;
+                // backoff is over, this poll is the probe
+                if ( current->breaker == BREAKER_OPEN ) {
+                    current->breaker = BREAKER_HALF_OPEN;
+                }
+                scheduleDevice( current, pollInterval(current) );
+            }
+            current = next;
+        }
+    }
+    wheelLastTick = now;
+    return count;
+}
+
+// returns the number of seconds until the next device is due, -1 if no device is scheduled.
+// device list must be locked by caller
+static int secondsUntilNextPoll(time_t now)
+{
+    if ( scheduledDeviceCount == 0 ) {
+        return -1;
+    }
+    for ( int i = 0 ; i < WHEEL_SLOTS ; i++ )
+    {
+        mydeviceentry *current = timerWheel[(now+i) & (WHEEL_SLOTS-1)];
+        for ( ; current ; current = current->wheelNext ) {
+            if ( current->nextPollAt <= now+i ) {
+                return current->nextPollAt <= now ? 0 : current->nextPollAt - now;
+            }
+        }
+    }
+    // nothing due within one revolution of the wheel, so everything left got scheduled further ahead than that.
+    // Unless the device farPollEarliest came from got rescheduled or removed since, that's when the next one is due.
+    if ( farPollEarliest >= now + WHEEL_SLOTS ) {
+        return farPollEarliest - now;
+    }
+    time_t earliest = -1;
+    for ( int i = 0 ; i < WHEEL_SLOTS ; i++ ) {
+        mydeviceentry *current = timerWheel[i];
+        for ( ; current ; current = current->wheelNext ) {
+            if ( earliest == -1 || current->nextPollAt < earliest ) {
+                earliest = current->nextPollAt;
+            }
+        }
+    }
+    farPollEarliest = earliest;
+    return earliest == -1 ? -1 : earliest - now;
+}
+
+// Returns the current snapshot with its reference count incremented, never blocks.
+// Callers must hand it back through releaseSnapshot().
+static devicesnapshot *acquireSnapshot()
+{
+    // the read-side critical section only needs to cover loading the pointer and taking a reference,
+    // after that the reference count keeps the snapshot alive
+    int epoch = atomic_load(&snapshotEpoch) & 1;
+    atomic_fetch_add(&snapshotReaders[epoch],1);
+    devicesnapshot *snapshot = atomic_load(&currentSnapshot);
+    if ( snapshot ) {
+        atomic_fetch_add(&snapshot->refCount,1);
+    }
+    atomic_fetch_sub(&snapshotReaders[epoch],1);
+    return snapshot;
+}
+
+static void releaseSnapshot(devicesnapshot *snapshot)
+{
+    if ( snapshot && atomic_fetch_sub(&snapshot->refCount,1) == 1 ) {
+        free(snapshot);
+    }
+}
+
+// waits until no reader can still be about to take a reference on a previously published snapshot.
+// Flips the epoch twice so readers that keep arriving can't starve us. Main thread only, never with the device list locked.
+static void waitForSnapshotReaders()
+{
+    for ( int phase = 0 ; phase < 2 ; phase++ )
+    {
+        int epoch = atomic_fetch_add(&snapshotEpoch,1) & 1;
+        // readers only hold it for a few instructions, unless they got preempted in between
+        for ( int spins = 0 ; atomic_load(&snapshotReaders[epoch]) != 0 ; spins++ ) {
+            if ( spins >= 100 ) {
+                nanosleep(&(struct timespec){ 0, 50000 },0);
+            }
+        }
+    }
+}
+
+static int roundUpToPowerOfTwo(int value)
+{
+    int result = 16;
+    while ( result < value ) {
+        result *= 2;
+    }
+    return result;
+}
+
+// device list must be locked by caller
+static devicesnapshot *allocateSnapshot(int count)
+{
+    devicesnapshot *snapshot = spareSnapshot;
+    spareSnapshot = 0;
+    if ( snapshot && snapshot->capacity >= count ) {
+        return snapshot;
+    }
+    free(snapshot);
+
+    int capacity = roundUpToPowerOfTwo(count);
+    snapshot = malloc( sizeof(devicesnapshot) + capacity*sizeof(devicestate) );
+    if ( snapshot ) {
+        snapshot->capacity = capacity;
+    }
+    return snapshot;
+}
+
+// drops the writer's reference to a snapshot that is no longer current, keeps it for reuse if nobody else holds on to it.
+// device list must be locked by caller
+static void retireSnapshot(devicesnapshot *snapshot)
+{
+    if ( atomic_fetch_sub(&snapshot->refCount,1) == 1 ) {
+        if ( spareSnapshot ) {
+            free(snapshot);
+        } else {
+            spareSnapshot = snapshot;
+        }
+    }
+}
+
+// device list must be locked by caller
+static void publishSnapshot()
+{
+    devicesnapshot *snapshot = allocateSnapshot(deviceCount);
+    if ( ! snapshot ) {
+        syslog(LOG_ERR,"Out of memory, failed to publish device snapshot");
+        return;
+    }
+    atomic_init(&snapshot->refCount,1);
+    snapshot->version = ++snapshotVersion;
+    snapshot->count = deviceCount;
+    for ( int i = 0 ; i < deviceCount ; i++ )
+    {
+        mydeviceentry *entry = deviceArray[i];
+        devicestate *state = &snapshot->devices[i];
+        state->deviceID = entry->deviceID;
+        state->generation = entry->generation;
+        strncpy(state->name,entry->deviceName,sizeof(state->name)-1);
+        state->name[sizeof(state->name)-1] = 0;
+        memcpy(state->serial,entry->serial,sizeof(state->serial));
+        state->productID = entry->productID;
+        state->capabilities = entry->capabilities;
+        state->breaker = entry->breaker;
+        state->consecutiveFailures = entry->consecutiveFailures;
+        state->lastError = entry->lastError;
+        state->stuckCalls = atomic_load(&deviceStuckCalls[entry->deviceID]);
+        state->hasBatteryStatus = entry->hasBatteryStatus;
+        state->level = entry->lastLevel;
+        state->charging = entry->lastCharging;
+        memcpy(state->componentLevels,entry->componentLevels,sizeof(state->componentLevels));
+        memcpy(state->componentMinutes,entry->componentMinutes,sizeof(state->componentMinutes));
+        state->componentFilling = entry->componentFilling;
+        state->mainComponent = entry->mainComponent;
+        state->healthPermille = entry->healthPermille;
+        state->dischargedPercent = entry->dischargedPercent;
+        state->lastStatusAtMillis = entry->lastStatusAtMillis;
+        state->nextPollAt = entry->nextPollAt;
+    }
+
+    writeStatusSegment(snapshot);
+
+    devicesnapshot *previous = atomic_exchange(&currentSnapshot,snapshot);
+    snapshotDirty = 0;
+    if ( previous ) {
+        previous->nextRetired = retiredSnapshots;
+        retiredSnapshots = previous;
+    }
+}
+
+// recycles the snapshots publishSnapshot() replaced once no reader can still pick them up.
+// Main thread only, device list must NOT be locked by caller.
+static void reclaimSnapshots()
+{
+    lockDeviceList();
+    devicesnapshot *retired = retiredSnapshots;
+    retiredSnapshots = 0;
+    unlockDeviceList();
+    if ( ! retired ) {
+        return;
+    }
+
+    waitForSnapshotReaders();
+
+    lockDeviceList();
+    while ( retired ) {
+        devicesnapshot *next = retired->nextRetired;
+        retireSnapshot(retired);
+        retired = next;
+    }
+    unlockDeviceList();
+}
+
+// device list must be locked by caller
+static void publishSnapshotIfDirty()
+{
+    if ( snapshotDirty || ! atomic_load(&currentSnapshot) ) {
+        publishSnapshot();
+    }
+}
+
+// device list must be locked by caller
+static mydeviceentry *findDevice(unsigned short deviceID)
+{
+    return deviceSlots[deviceID];
+}
+
+// device list must be locked by caller
+static mydeviceentry *findDeviceByHandle(devicehandle *handle)
+{
+    mydeviceentry *entry = deviceSlots[handle->deviceID];
+    return entry && entry->generation == handle->generation ? entry : 0;
+}
+
+// adds a sample at t=0 after moving the sums' origin to it and letting the earlier samples decay.
+// device list must be locked by caller
+static void addEstimatorSample(estimator *e, int64_t timeMillis, uint8_t level)
+{
+    if ( e->samples > 0 ) {
+        double dt = (timeMillis - e->lastTimeMillis) / 1000.0;
+        double decay = exp(-dt / ESTIMATOR_TIME_CONSTANT_SECONDS);
+        e->sumTT = (e->sumTT - 2*dt*e->sumT + dt*dt*e->weight) * decay;
+        e->sumT = (e->sumT - dt*e->weight) * decay;
+        e->sumTLevel = (e->sumTLevel - dt*e->sumLevel) * decay;
+        e->sumLevel *= decay;
+        e->weight *= decay;
+    } else {
+        e->firstTimeMillis = timeMillis;
+    }
+    e->weight += 1;
+    e->sumLevel += level;
+    e->lastTimeMillis = timeMillis;
+    e->lastLevel = level;
+    if ( e->samples < UINT16_MAX ) {
+        e->samples++;
+    }
+}
+
+// minutes from the latest sample until the fitted line hits 0 % (discharging) or 100 % (charging)
+static uint16_t estimateMinutes(estimator *e)
+{
+    if ( e->direction == 0 || e->samples < ESTIMATOR_MIN_SAMPLES
+         || e->lastTimeMillis - e->firstTimeMillis < ESTIMATOR_MIN_SPAN_SECONDS*1000 ) {
+        return JABRA_STATUS_MINUTES_UNKNOWN;
+    }
+    double determinant = e->weight*e->sumTT - e->sumT*e->sumT;
+    if ( determinant <= 0 ) {
+        return JABRA_STATUS_MINUTES_UNKNOWN;
+    }
+    // percent per second and level at the latest sample
+    double slope = (e->weight*e->sumTLevel - e->sumT*e->sumLevel) / determinant;
+    double fitted = (e->sumLevel - slope*e->sumT) / e->weight;
+    double seconds;
+    if ( e->direction > 0 ) {
+        if ( e->lastLevel >= 100 ) {
+            return 0;
+        }
+        if ( slope <= 0 ) {
+            return JABRA_STATUS_MINUTES_UNKNOWN;
+        }
+        seconds = (100 - fitted) / slope;
+    } else {
+        if ( slope >= 0 ) {
+            return JABRA_STATUS_MINUTES_UNKNOWN;
+        }
+        seconds = fitted / -slope;
+    }
+    double minutes = seconds > 0 ? seconds / 60 + 0.5 : 0;
+    return minutes < JABRA_STATUS_MINUTES_UNKNOWN - 1 ? (uint16_t) minutes : JABRA_STATUS_MINUTES_UNKNOWN - 1;
+}
+
+// direction: +1 charging, -1 discharging, 0 if only the level can tell (extra units have no charging flag)
+static uint16_t updateEstimator(estimator *e, int64_t timeMillis, uint8_t level, int8_t direction)
+{
+    if ( e->samples > 0 ) {
+        int change = level - e->lastLevel;
+        if ( direction == 0 ) {
+            direction = change > 0 ? 1 : change < 0 ? -1 : e->direction;
+        }
+        // a line through samples from before the battery turned around (or got swapped, or the clock jumped back) predicts nothing
+        if ( timeMillis < e->lastTimeMillis || ( e->direction != 0 && direction != e->direction ) || change*direction < 0 ) {
+            memset(e,0,sizeof(*e));
+        }
+    }
+    e->direction = direction;
+    addEstimatorSample(e, timeMillis, level);
+    return estimateMinutes(e);
+}
+
+// level and time-to-empty/full estimate of the main battery and the extra units.
+// device list must be locked by caller
+static void updateComponents(mydeviceentry *current, Jabra_BatteryStatus *batteryStatus)
+{
+    memset(current->componentLevels,JABRA_STATUS_LEVEL_UNKNOWN,sizeof(current->componentLevels));
+    memset(current->componentMinutes,0xff,sizeof(current->componentMinutes));
+    current->componentFilling = 0;
+    current->mainComponent = 0;
+
+    for ( int i = -1 ; i < (int) batteryStatus->extraUnitsCount ; i++ )
+    {
+        int component;
+        uint8_t level;
+        // extra units have no charging flag, their estimators go by the level's trend
+        int8_t direction;
+        if ( i < 0 ) {
+            component = batteryStatus->component;
+            level = batteryStatus->levelInPercent;
+            direction = batteryStatus->charging ? 1 : -1;
+        } else {
+            component = batteryStatus->extraUnits[i].component;
+            level = batteryStatus->extraUnits[i].levelInPercent;
+            direction = 0;
+        }
+        if ( (unsigned) component >= JABRA_STATUS_COMPONENTS || ( i >= 0 && component == batteryStatus->component ) ) {
+            continue;
+        }
+        current->componentLevels[component] = level;
+        current->componentMinutes[component] = updateEstimator(&current->estimators[component], current->lastStatusAtMillis, level, direction);
+        if ( current->componentMinutes[component] != JABRA_STATUS_MINUTES_UNKNOWN && current->estimators[component].direction > 0 ) {
+            current->componentFilling |= 1 << component;
+        }
+        if ( i < 0 ) {
+            current->mainComponent = component;
+        } else if ( current->componentNotifiedLevels[component] == JABRA_STATUS_LEVEL_UNKNOWN ) {
+            // first seen since attach (or restart), taken as is. A device's first notification covers all of its units.
+            current->componentNotifiedLevels[component] = level;
+        }
+    }
+}
+
+// " (left 80 %, right 75 %, cradle 40 %)" for the extra units of the latest battery status, "" if there are none
+static void formatComponents(char *buffer, size_t size, mydeviceentry *current)
+{
+    size_t length = 0;
+    buffer[0] = 0;
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS && length < size ; c++ ) {
+        if ( c != current->mainComponent && current->componentLevels[c] != JABRA_STATUS_LEVEL_UNKNOWN ) {
+            length += snprintf(buffer + length, size - length, "%s%s %d %%", length ? ", " : " (", componentNames[c], current->componentLevels[c]);
+        }
+    }
+    if ( length > 0 && length < size ) {
+        snprintf(buffer + length, size - length, ")");
+    }
+}
+
+// " (charging, full in about 1 h 5 min)", ", about 40 min left" or just " (charging)" / "" without an estimate
+static void formatEstimate(char *buffer, size_t size, uint8_t charging, uint16_t minutes)
+{
+    char duration[32];
+    if ( minutes == JABRA_STATUS_MINUTES_UNKNOWN ) {
+        snprintf(buffer, size, "%s", charging ? " (charging)" : "");
+        return;
+    }
+    if ( minutes == 0 ) {
+        snprintf(buffer, size, "%s", charging ? " (charging, almost full)" : ", less than a minute left");
+        return;
+    }
+    if ( minutes >= 60 ) {
+        snprintf(duration, sizeof(duration), "%d h %d min", minutes / 60, minutes % 60);
+    } else {
+        snprintf(duration, sizeof(duration), "%d min", minutes);
+    }
+    if ( charging ) {
+        snprintf(buffer, size, " (charging, full in about %s)", duration);
+    } else {
+        snprintf(buffer, size, ", about %s left", duration);
+    }
+}
+
+static int componentStep(int component)
+{
+    return componentThresholds[component] ? componentThresholds[component] : notificationThreshold;
+}
+
+// (re)allocates the arrays for at least 'capacity' devices, keeping the first 'count'.
+// Returns 0 if out of memory, 'levels' stays as it was then.
+static int resizeDeviceLevels(devicelevels *levels, int capacity, int count)
+{
+    capacity = (capacity + LEVELS_BLOCK - 1) / LEVELS_BLOCK * LEVELS_BLOCK;
+    size_t size = (size_t) capacity * (5 + 2*JABRA_STATUS_COMPONENTS) + capacity / 8;
+    size = (size + LEVELS_BLOCK - 1) / LEVELS_BLOCK * LEVELS_BLOCK;
+    uint8_t *memory = aligned_alloc(LEVELS_BLOCK, size);
+    if ( ! memory ) {
+        return 0;
+    }
+    memset(memory, 0, size);
+
+    devicelevels resized = { .memory = memory, .capacity = capacity, .components = levels->components };
+    uint8_t *next = memory;
+    resized.level = next; next += capacity;
+    resized.notifiedLevel = next; next += capacity;
+    resized.flags = next; next += capacity;
+    resized.step = next; next += capacity;
+    resized.componentMultiple = next; next += capacity;
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+        resized.componentLevel[c] = next; next += capacity;
+        resized.componentNotifiedLevel[c] = next; next += capacity;
+    }
+    resized.mask = (uint32_t*) next;
+
+    if ( levels->memory ) {
+        memcpy(resized.level, levels->level, count);
+        memcpy(resized.notifiedLevel, levels->notifiedLevel, count);
+        memcpy(resized.flags, levels->flags, count);
+        memcpy(resized.step, levels->step, count);
+        memcpy(resized.componentMultiple, levels->componentMultiple, count);
+        for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+            memcpy(resized.componentLevel[c], levels->componentLevel[c], count);
+            memcpy(resized.componentNotifiedLevel[c], levels->componentNotifiedLevel[c], count);
+        }
+        free(levels->memory);
+    }
+    *levels = resized;
+    return 1;
+}
+
+// copies what the notification decision looks at from the device into deviceLevels.
+// device list must be locked by caller
+static void syncDeviceLevels(mydeviceentry *entry)
+{
+    devicelevels *levels = &deviceLevels;
+    int i = entry->index;
+    int step = componentStep(entry->mainComponent);
+    levels->level[i] = entry->lastLevel;
+    levels->notifiedLevel[i] = entry->lastNotifyPercentage;
+    levels->flags[i] = (entry->hasBatteryStatus ? LEVELS_HAS_STATUS : 0) | (entry->lastCharging ? LEVELS_CHARGING : 0) |
+                       (entry->notifiedAtLeastOnce ? LEVELS_NOTIFIED : 0) | (entry->lastNotifyCharging ? LEVELS_NOTIFIED_CHARGING : 0) |
+                       (entry->notifyForced ? LEVELS_FORCED : 0) | (entry->lastLevel % step == 0 ? LEVELS_MULTIPLE : 0);
+    levels->step[i] = step;
+    levels->componentMultiple[i] = 0;
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+        int extraUnit = c != entry->mainComponent && entry->componentLevels[c] != JABRA_STATUS_LEVEL_UNKNOWN;
+        levels->componentLevel[c][i] = entry->componentLevels[c];
+        levels->componentNotifiedLevel[c][i] = extraUnit ? entry->componentNotifiedLevels[c] : JABRA_STATUS_LEVEL_UNKNOWN;
+        if ( extraUnit ) {
+            levels->components |= 1 << c;
+            levels->componentMultiple[i] |= entry->componentLevels[c] % componentStep(c) == 0 ? 1 << c : 0;
+        }
+    }
+}
+
+static int crossesStep(uint8_t level, uint8_t notified, int step, int multiple)
+{
+    return level != notified && ( multiple || abs(level - notified) >= step );
+}
+
+// The notification decision for one device: never notified, forced, charging state changed, or the main
+// battery or an extra unit crossed a multiple of its step or moved by at least a step since the last notification.
+static int deviceNeedsNotification(const devicelevels *levels, int i)
+{
+    uint8_t flags = levels->flags[i];
+    if ( ! (flags & LEVELS_HAS_STATUS) ) {
+        return 0;
+    }
+    if ( (flags & LEVELS_FORCED) || ! (flags & LEVELS_NOTIFIED) ||
+         ! (flags & LEVELS_CHARGING) != ! (flags & LEVELS_NOTIFIED_CHARGING) ||
+         crossesStep(levels->level[i], levels->notifiedLevel[i], levels->step[i], flags & LEVELS_MULTIPLE) ) {
+        return 1;
+    }
+    for ( uint32_t bits = levels->components ; bits ; bits &= bits - 1 ) {
+        int c = __builtin_ctz(bits);
+        // notified level is unknown for units that aren't reported
+        uint8_t notified = levels->componentNotifiedLevel[c][i];
+        if ( notified != JABRA_STATUS_LEVEL_UNKNOWN &&
+             crossesStep(levels->componentLevel[c][i], notified, componentStep(c), levels->componentMultiple[i] & (1 << c)) ) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Kernels: set bit i % 32 of mask[i / 32] for every device i < count (a multiple of LEVELS_BLOCK) that
+// deviceNeedsNotification(). The vector ones compare 16 or 32 devices at once, one byte each.
+static void needsNotificationScalar(const devicelevels *levels, int count, uint32_t *mask)
+{
+    for ( int block = 0 ; block < count / 32 ; block++ ) {
+        uint32_t bits = 0;
+        for ( int j = 0 ; j < 32 ; j++ ) {
+            bits |= (uint32_t) deviceNeedsNotification(levels, block*32 + j) << j;
+        }
+        mask[block] = bits;
+    }
+}
+
+#if defined(__x86_64__)
+// crossesStep() for 16 devices
+static inline __m128i crossesStepSse2(__m128i level, __m128i notified, __m128i step, __m128i multiple)
+{
+    __m128i distance = _mm_or_si128(_mm_subs_epu8(level, notified), _mm_subs_epu8(notified, level));
+    __m128i farEnough = _mm_cmpeq_epi8(_mm_max_epu8(distance, step), distance);
+    return _mm_andnot_si128(_mm_cmpeq_epi8(level, notified), _mm_or_si128(multiple, farEnough));
+}
+
+// 0xff in the lanes that have all of 'bits' set
+static inline __m128i hasBitsSse2(__m128i value, __m128i bits)
+{
+    return _mm_cmpeq_epi8(_mm_and_si128(value, bits), bits);
+}
+
+static void needsNotificationSse2(const devicelevels *levels, int count, uint32_t *mask)
+{
+    const __m128i unknown = _mm_set1_epi8((char) JABRA_STATUS_LEVEL_UNKNOWN);
+    const __m128i hasStatus = _mm_set1_epi8(LEVELS_HAS_STATUS);
+    const __m128i notified = _mm_set1_epi8(LEVELS_NOTIFIED);
+    const __m128i charging = _mm_set1_epi8(LEVELS_CHARGING);
+    const __m128i forced = _mm_set1_epi8(LEVELS_FORCED);
+    const __m128i multiple = _mm_set1_epi8(LEVELS_MULTIPLE);
+    __m128i componentSteps[JABRA_STATUS_COMPONENTS];
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+        componentSteps[c] = _mm_set1_epi8((char) componentStep(c));
+    }
+
+    for ( int i = 0 ; i < count ; i += 16 )
+    {
+        __m128i flags = _mm_load_si128((const __m128i*) (levels->flags + i));
+        __m128i need = crossesStepSse2(_mm_load_si128((const __m128i*) (levels->level + i)), _mm_load_si128((const __m128i*) (levels->notifiedLevel + i)),
+                                       _mm_load_si128((const __m128i*) (levels->step + i)), hasBitsSse2(flags, multiple));
+        need = _mm_or_si128(need, hasBitsSse2(flags, forced));
+        need = _mm_or_si128(need, _mm_cmpeq_epi8(_mm_and_si128(flags, notified), _mm_setzero_si128()));
+        // LEVELS_NOTIFIED_CHARGING shifted onto LEVELS_CHARGING, bits shifted in from the neighbouring lane get masked off
+        need = _mm_or_si128(need, hasBitsSse2(_mm_xor_si128(flags, _mm_srli_epi16(flags, 2)), charging));
+        __m128i multiples = _mm_load_si128((const __m128i*) (levels->componentMultiple + i));
+        for ( uint32_t bits = levels->components ; bits ; bits &= bits - 1 ) {
+            int c = __builtin_ctz(bits);
+            __m128i componentNotified = _mm_load_si128((const __m128i*) (levels->componentNotifiedLevel[c] + i));
+            __m128i crosses = crossesStepSse2(_mm_load_si128((const __m128i*) (levels->componentLevel[c] + i)), componentNotified,
+                                              componentSteps[c], hasBitsSse2(multiples, _mm_set1_epi8((char) (1 << c))));
+            need = _mm_or_si128(need, _mm_andnot_si128(_mm_cmpeq_epi8(componentNotified, unknown), crosses));
+        }
+        need = _mm_and_si128(need, hasBitsSse2(flags, hasStatus));
+        uint32_t bits = (uint32_t) _mm_movemask_epi8(need);
+        if ( i % 32 == 0 ) {
+            mask[i / 32] = bits;
+        } else {
+            mask[i / 32] |= bits << 16;
+        }
+    }
+}
+
+// the same for 32 devices
+__attribute__((target("avx2")))
+static inline __m256i crossesStepAvx2(__m256i level, __m256i notified, __m256i step, __m256i multiple)
+{
+    __m256i distance = _mm256_or_si256(_mm256_subs_epu8(level, notified), _mm256_subs_epu8(notified, level));
+    __m256i farEnough = _mm256_cmpeq_epi8(_mm256_max_epu8(distance, step), distance);
+    return _mm256_andnot_si256(_mm256_cmpeq_epi8(level, notified), _mm256_or_si256(multiple, farEnough));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i hasBitsAvx2(__m256i value, __m256i bits)
+{
+    return _mm256_cmpeq_epi8(_mm256_and_si256(value, bits), bits);
+}
+
+__attribute__((target("avx2")))
+static void needsNotificationAvx2(const devicelevels *levels, int count, uint32_t *mask)
+{
+    const __m256i unknown = _mm256_set1_epi8((char) JABRA_STATUS_LEVEL_UNKNOWN);
+    const __m256i hasStatus = _mm256_set1_epi8(LEVELS_HAS_STATUS);
+    const __m256i notified = _mm256_set1_epi8(LEVELS_NOTIFIED);
+    const __m256i charging = _mm256_set1_epi8(LEVELS_CHARGING);
+    const __m256i forced = _mm256_set1_epi8(LEVELS_FORCED);
+    const __m256i multiple = _mm256_set1_epi8(LEVELS_MULTIPLE);
+    __m256i componentSteps[JABRA_STATUS_COMPONENTS];
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+        componentSteps[c] = _mm256_set1_epi8((char) componentStep(c));
+    }
+
+    for ( int i = 0 ; i < count ; i += 32 )
+    {
+        __m256i flags = _mm256_load_si256((const __m256i*) (levels->flags + i));
+        __m256i need = crossesStepAvx2(_mm256_load_si256((const __m256i*) (levels->level + i)), _mm256_load_si256((const __m256i*) (levels->notifiedLevel + i)),
+                                       _mm256_load_si256((const __m256i*) (levels->step + i)), hasBitsAvx2(flags, multiple));
+        need = _mm256_or_si256(need, hasBitsAvx2(flags, forced));
+        need = _mm256_or_si256(need, _mm256_cmpeq_epi8(_mm256_and_si256(flags, notified), _mm256_setzero_si256()));
+        need = _mm256_or_si256(need, hasBitsAvx2(_mm256_xor_si256(flags, _mm256_srli_epi16(flags, 2)), charging));
+        __m256i multiples = _mm256_load_si256((const __m256i*) (levels->componentMultiple + i));
+        for ( uint32_t bits = levels->components ; bits ; bits &= bits - 1 ) {
+            int c = __builtin_ctz(bits);
+            __m256i componentNotified = _mm256_load_si256((const __m256i*) (levels->componentNotifiedLevel[c] + i));
+            __m256i crosses = crossesStepAvx2(_mm256_load_si256((const __m256i*) (levels->componentLevel[c] + i)), componentNotified,
+                                              componentSteps[c], hasBitsAvx2(multiples, _mm256_set1_epi8((char) (1 << c))));
+            need = _mm256_or_si256(need, _mm256_andnot_si256(_mm256_cmpeq_epi8(componentNotified, unknown), crosses));
+        }
+        need = _mm256_and_si256(need, hasBitsAvx2(flags, hasStatus));
+        mask[i / 32] = (uint32_t) _mm256_movemask_epi8(need);
+    }
+}
+#endif
+
+typedef void (*notificationkernel)(const devicelevels *levels, int count, uint32_t *mask);
+static notificationkernel needsNotification = needsNotificationScalar;
+static const char *notificationKernelName = "scalar";
+
+// picks the widest kernel the CPU supports
+static void selectNotificationKernel()
+{
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+        needsNotification = needsNotificationAvx2;
+        notificationKernelName = "avx2";
+    } else {
+        needsNotification = needsNotificationSse2;
+        notificationKernelName = "sse2";
+    }
+#endif
+}
+
+// shows the device's battery state and remembers what got notified, unless the notification was forced.
+// device list must be locked by caller
+static void notifyDevice(mydeviceentry *current)
+{
+    char estimate[64];
+    char components[96];
+    formatEstimate(estimate, sizeof(estimate), current->lastCharging, current->componentMinutes[current->mainComponent]);
+    formatComponents(components, sizeof(components), current);
+    devicehandle handle = { current->deviceID, current->generation };
+    enqueueNotification( NOTIFY_DEVICE, &handle, "Battery of '%s' is now at %d %%%s%s", current->deviceName, current->lastLevel, estimate, components );
+
+    if ( ! current->notifyForced ) {
+        current->notifiedAtLeastOnce = 1;
+        current->lastNotifyPercentage = current->lastLevel;
+        current->lastNotifyCharging = current->lastCharging;
+        for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+            if ( c != current->mainComponent && current->componentLevels[c] != JABRA_STATUS_LEVEL_UNKNOWN ) {
+                current->componentNotifiedLevels[c] = current->componentLevels[c];
+            }
+        }
+    }
+    current->notifyForced = 0;
+    syncDeviceLevels(current);
+    saveDeviceState(current);
+}
+
+// one decision pass over all devices, notifies the ones that need it.
+// device list must be locked by caller
+static void notifyChangedDevices()
+{
+    int count = (deviceCount + LEVELS_BLOCK - 1) / LEVELS_BLOCK * LEVELS_BLOCK;
+    needsNotification(&deviceLevels, count, deviceLevels.mask);
+    for ( int block = 0 ; block < count / 32 ; block++ ) {
+        for ( uint32_t bits = deviceLevels.mask[block] ; bits ; bits &= bits - 1 ) {
+            notifyDevice( deviceArray[block*32 + __builtin_ctz(bits)] );
+        }
+    }
+}
+
+// takes a battery status into the device's state, notifyChangedDevices() decides whether it is worth a notification
+static void updateBatteryStatus(mydeviceentry *current, Jabra_BatteryStatus *batteryStatus, int force)
+{
+    uint8_t level = batteryStatus->levelInPercent;
+    uint8_t charging = batteryStatus->charging;
+    int64_t now = currentTimeMillis();
+
+    current->hasBatteryStatus = 1;
+    current->lastLevel = level;
+    current->lastCharging = charging ? 1 : 0;
+    staterecord *record = getOrCreateStateRecord(current->serial);
+    if ( record ) {
+        updateBatteryHealth(record, now, level, charging ? 1 : 0);
+        current->healthPermille = record->healthPermille;
+        current->dischargedPercent = record->dischargedPercent;
+    }
+    current->lastStatusAtMillis = now;
+    recordHistorySample(current->serial, &current->historySeries, current->lastStatusAtMillis / 1000, level, current->lastCharging);
+
+    updateComponents(current, batteryStatus);
+    if ( force ) {
+        current->notifyForced = 1;
+    }
+    snapshotDirty = 1;
+    syncDeviceLevels(current);
+    saveDeviceState(current);
+}
+
+// device list must be locked by caller
+static void recordPollSuccess(mydeviceentry *entry)
+{
+    if ( entry->breaker != BREAKER_CLOSED ) {
+        syslog(LOG_INFO,"Battery queries for device %04x work again",entry->deviceID);
+        snapshotDirty = 1;
+    } else if ( entry->consecutiveFailures > 0 ) {
+        snapshotDirty = 1;
+    }
+    entry->breaker = BREAKER_CLOSED;
+    entry->consecutiveFailures = 0;
+    entry->breakerBackoffSeconds = 0;
+}
+
+// opens the breaker after too many failures in a row or a failed probe.
+// device list must be locked by caller
+static void recordPollFailure(mydeviceentry *entry, Jabra_ReturnCode rc)
+{
+    entry->consecutiveFailures++;
+    entry->lastError = rc;
+    snapshotDirty = 1;
+
+    if ( entry->breaker == BREAKER_CLOSED && entry->consecutiveFailures < BREAKER_FAILURE_THRESHOLD ) {
+        syslog(LOG_DEBUG,"Failed to query battery status for device %04x: %s", entry->deviceID, returnCodeName(rc));
+        return;
+    }
+
+    if ( entry->breaker == BREAKER_CLOSED ) {
+        entry->breakerBackoffSeconds = BREAKER_INITIAL_BACKOFF_SECONDS;
+    } else {
+        entry->breakerBackoffSeconds *= 2;
+        if ( entry->breakerBackoffSeconds > BREAKER_MAX_BACKOFF_SECONDS ) {
+            entry->breakerBackoffSeconds = BREAKER_MAX_BACKOFF_SECONDS;
+        }
+    }
+    // somewhere between half and all of the backoff, so devices that failed together don't retry together
+    int half = entry->breakerBackoffSeconds / 2;
+    int delay = half + rand_r(&jitterSeed) % (entry->breakerBackoffSeconds - half + 1);
+
+    if ( entry->breaker == BREAKER_CLOSED ) {
+        syslog(LOG_WARNING,"Battery queries for device %04x keep failing (%s), backing off for %d seconds", entry->deviceID, returnCodeName(rc), delay);
+    } else {
+        syslog(LOG_DEBUG,"Probe of device %04x failed (%s), backing off for %d seconds", entry->deviceID, returnCodeName(rc), delay);
+    }
+    entry->breaker = BREAKER_OPEN;
+    scheduleDevice(entry,delay);
+}
+
+long millisSince(struct timespec *start, struct timespec *now)
+{
+    return (now->tv_sec - start->tv_sec)*1000 + (now->tv_nsec - start->tv_nsec)/1000000;
+}
+
+// Copies an SDK battery status into caller-owned storage, extra units beyond MAX_EXTRA_UNITS get dropped.
+// Jabra_CopyJabraBatteryStatus() would allocate the extra units array on our behalf, with no documented way to free it.
+void copyBatteryStatus(const Jabra_BatteryStatus *from, Jabra_BatteryStatus *to, Jabra_BatteryStatusUnit *units)
+{
+    *to = *from;
+    to->extraUnitsCount = from->extraUnitsCount < MAX_EXTRA_UNITS ? from->extraUnitsCount : MAX_EXTRA_UNITS;
+    if ( to->extraUnitsCount > 0 && from->extraUnits ) {
+        memcpy(units,from->extraUnits,to->extraUnitsCount*sizeof(Jabra_BatteryStatusUnit));
+    } else {
+        to->extraUnitsCount = 0;
+    }
+    to->extraUnits = units;
+}
+
+// adds a unit to a battery status copied by copyBatteryStatus(), if there is room
+static void appendBatteryUnit(Jabra_BatteryStatus *status, BatteryComponent component, uint8_t level)
+{
+    if ( status->extraUnitsCount < MAX_EXTRA_UNITS ) {
+        status->extraUnits[status->extraUnitsCount].component = component;
+        status->extraUnits[status->extraUnitsCount].levelInPercent = level;
+        status->extraUnitsCount++;
+    }
+}
+
+// battery level of the device's remote control, -1 if there is none (or it didn't answer).
+// Runs under the deadline of the battery query it belongs to, a stuck call counts as a stuck battery query.
+static int queryRemoteControlBattery(unsigned short deviceID)
+{
+    struct timespec startedAt;
+    clock_gettime(CLOCK_MONOTONIC,&startedAt);
+    int level = -1;
+    bool charging = false, batteryLow = false;
+    Jabra_ReturnCode rc = Jabra_GetRemoteControlBatteryStatus( deviceID, &level, &charging, &batteryLow );
+    recordSdkCall( SDK_GET_REMOTE_CONTROL_BATTERY_STATUS, &startedAt, 0 );
+    return rc == Return_Ok && level >= 0 && level <= 100 ? level : -1;
+}
+
+// CAP_* bits of the features the SDK reports for a device.
+// Runs under the deadline of the battery query it belongs to, like queryRemoteControlBattery().
+static uint8_t probeFeatures(unsigned short deviceID)
+{
+    struct timespec startedAt;
+    clock_gettime(CLOCK_MONOTONIC,&startedAt);
+    unsigned int count = 0;
+    const DeviceFeature *features = Jabra_GetSupportedFeatures( deviceID, &count );
+    recordSdkCall( SDK_GET_SUPPORTED_FEATURES, &startedAt, 0 );
+    uint8_t capabilities = CAP_FEATURES_PROBED;
+    for ( unsigned int i = 0 ; features && i < count ; i++ ) {
+        if ( features[i] == RemoteControl ) {
+            capabilities |= CAP_REMOTE_CONTROL;
+        }
+    }
+    if ( features ) {
+        Jabra_FreeSupportedFeatures(features);
+    }
+    return capabilities;
+}
+
+static void *pollWorker(void *arg)
+{
+    pthread_mutex_lock(&poolMutex);
+    while ( ! shutdownRequested )
+    {
+        if ( poolNextJob >= poolJobCount ) {
+            pthread_cond_wait(&poolWorkAvailable,&poolMutex);
+            continue;
+        }
+
+        uint32_t batch = poolBatchNumber;
+        polljob *job = &poolJobs[poolNextJob++];
+        unsigned short deviceID = job->handle.deviceID;
+
+        // another call to this device is stuck, this one would most likely get stuck as well
+        if ( atomic_load(&deviceStuckCalls[deviceID]) > 0 ) {
+            job->state = POLL_DONE;
+            job->rc = Return_Timeout;
+            poolFinishedJobs++;
+            pthread_cond_signal(&poolJobDone);
+            if ( poolFinishedJobs == poolJobCount ) {
+                wakeup(0);
+            }
+            continue;
+        }
+
+        job->state = POLL_RUNNING;
+        clock_gettime(CLOCK_MONOTONIC,&job->startedAt);
+        struct timespec startedAt = job->startedAt;
+        int remoteControl = job->remoteControl;
+        int probe = job->probe;
+        pthread_mutex_unlock(&poolMutex);
+
+        uint8_t capabilities = probe ? probeFeatures(deviceID) : 0;
+        remoteControl |= (capabilities & CAP_REMOTE_CONTROL) != 0;
+        Jabra_BatteryStatus *batteryStatus = 0;
+        Jabra_ReturnCode rc = Jabra_GetBatteryStatusV2( deviceID, &batteryStatus );
+        int remoteLevel = rc == Return_Ok && remoteControl ? queryRemoteControlBattery(deviceID) : -1;
+
+        int exitWorker = 0;
+        int returnedLate = 0;
+        pthread_mutex_lock(&poolMutex);
+        if ( batch == poolBatchNumber && job->state == POLL_RUNNING )
+        {
+            job->rc = rc;
+            job->capabilities = capabilities;
+            if ( rc == Return_Ok ) {
+                copyBatteryStatus(batteryStatus,&job->batteryStatus,job->units);
+                if ( remoteLevel >= 0 ) {
+                    appendBatteryUnit(&job->batteryStatus,REMOTE_CONTROL,remoteLevel);
+                }
+            }
+            job->state = POLL_DONE;
+            poolFinishedJobs++;
+            pthread_cond_signal(&poolJobDone);
+            if ( poolFinishedJobs == poolJobCount ) {
+                wakeup(0);
+            }
+        }
+        else
+        {
+            // result arrived after the deadline, nobody is interested anymore.
+            // Job may already be gone so don't touch it.
+            poolStuckWorkers--;
+            returnedLate = 1;
+            // a replacement took over while we were stuck
+            if ( poolWorkerThreads - poolStuckWorkers > pollWorkerCount ) {
+                poolWorkerThreads--;
+                exitWorker = 1;
+            }
+        }
+        pthread_mutex_unlock(&poolMutex);
+
+        recordSdkCall( SDK_GET_BATTERY_STATUS, &startedAt, returnedLate );
+        if ( returnedLate ) {
+            releaseSdkCall( SDK_GET_BATTERY_STATUS, deviceID );
+        }
+        if ( rc == Return_Ok && batteryStatus ) {
+            Jabra_FreeBatteryStatus(batteryStatus);
+        }
+        if ( exitWorker ) {
+            return 0;
+        }
+        pthread_mutex_lock(&poolMutex);
+    }
+    pthread_mutex_unlock(&poolMutex);
+    return 0;
+}
+
+void startPollWorkers()
+{
+    pthread_mutex_init(&poolMutex,NULL);
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+    pthread_cond_init(&poolWorkAvailable,NULL);
+    pthread_cond_init(&poolJobDone,&attr);
+
+    int started = 0;
+    for ( int i = 0 ; i < pollWorkerCount ; i++ )
+    {
+        pthread_t thread;
+        if ( pthread_create(&thread,NULL,pollWorker,NULL) != 0 ) {
+            syslog(LOG_ERR,"Failed to start poll worker thread");
+            continue;
+        }
+        pthread_detach(thread);
+        started++;
+    }
+    pollWorkerCount = started;
+    poolWorkerThreads = started;
+}
+
+// gives up on a running job, its worker stays blocked inside the SDK until the call returns.
+// poolMutex must be locked by caller
+static void quarantineJob(polljob *job)
+{
+    job->state = POLL_TIMED_OUT;
+    job->rc = Return_Timeout;
+    poolStuckWorkers++;
+    quarantineSdkCall( SDK_GET_BATTERY_STATUS, job->handle.deviceID );
+}
+
+// starts workers to stand in for stuck ones, as long as the quarantine isn't full.
+// poolMutex must be locked by caller
+static void replaceStuckWorkers()
+{
+    while ( poolWorkerThreads - poolStuckWorkers < pollWorkerCount && poolStuckWorkers < MAX_QUARANTINED_CALLS )
+    {
+        pthread_t thread;
+        if ( pthread_create(&thread,NULL,pollWorker,NULL) != 0 ) {
+            syslog(LOG_ERR,"Failed to start replacement poll worker thread");
+            return;
+        }
+        pthread_detach(thread);
+        poolWorkerThreads++;
+    }
+}
+
+// hands a batch to the worker pool without waiting for it, see advancePoolJobs()
+static void startPoolJobs(polljob *jobs, int count)
+{
+    pthread_mutex_lock(&poolMutex);
+    poolJobs = jobs;
+    poolJobCount = count;
+    poolNextJob = 0;
+    poolFinishedJobs = 0;
+    pthread_cond_broadcast(&poolWorkAvailable);
+    pthread_mutex_unlock(&poolMutex);
+}
+
+// gives up on jobs that missed their deadline (POLL_TIMED_OUT), never blocks.
+// Returns the milliseconds until the next deadline, -1 once the batch is retired.
+static int advancePoolJobs()
+{
+    pthread_mutex_lock(&poolMutex);
+    if ( ! poolJobs ) {
+        pthread_mutex_unlock(&poolMutex);
+        return -1;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+
+    // give up on calls that took too long, the worker stays blocked until the SDK returns.
+    // Jobs nobody picked up yet have a later deadline than any running one.
+    long waitMillis = pollTimeoutMillis;
+    for ( int i = 0 ; i < poolNextJob ; i++ )
+    {
+        if ( poolJobs[i].state != POLL_RUNNING ) {
+            continue;
+        }
+        long elapsed = millisSince(&poolJobs[i].startedAt,&now);
+        if ( elapsed >= pollTimeoutMillis ) {
+            quarantineJob(&poolJobs[i]);
+            poolFinishedJobs++;
+        } else if ( pollTimeoutMillis - elapsed < waitMillis ) {
+            waitMillis = pollTimeoutMillis - elapsed;
+        }
+    }
+
+    replaceStuckWorkers();
+
+    // no worker left to pick up the remaining jobs
+    if ( poolStuckWorkers >= poolWorkerThreads ) {
+        for ( int i = poolNextJob ; i < poolJobCount ; i++ ) {
+            poolJobs[i].state = POLL_TIMED_OUT;
+            poolJobs[i].rc = Return_Timeout;
+            poolFinishedJobs++;
+        }
+        poolNextJob = poolJobCount;
+    }
+
+    if ( poolFinishedJobs < poolJobCount && ! shutdownRequested ) {
+        pthread_mutex_unlock(&poolMutex);
+        return (int) waitMillis;
+    }
+
+    // retire batch so that late results get dropped
+    for ( int i = 0 ; i < poolNextJob ; i++ ) {
+        if ( poolJobs[i].state == POLL_RUNNING ) {
+            quarantineJob(&poolJobs[i]);
+        }
+    }
+    replaceStuckWorkers();
+    poolBatchNumber++;
+    poolJobs = 0;
+    poolJobCount = 0;
+    poolNextJob = 0;
+
+    pthread_mutex_unlock(&poolMutex);
+    return -1;
+}
+
+// runs all jobs on the worker pool and waits until each of them either finished or missed its deadline.
+// For the SDK host, the daemon's main loop uses startPoolJobs() and advancePoolJobs() instead.
+void runPollJobs(polljob *jobs, int count)
+{
+    startPoolJobs(jobs,count);
+    int waitMillis;
+    while ( (waitMillis = advancePoolJobs()) >= 0 )
+    {
+        struct timespec wakeAt;
+        clock_gettime(CLOCK_MONOTONIC,&wakeAt);
+        wakeAt.tv_sec += waitMillis / 1000;
+        wakeAt.tv_nsec += (waitMillis % 1000) * 1000000L;
+        if ( wakeAt.tv_nsec >= 1000000000L ) {
+            wakeAt.tv_sec++;
+            wakeAt.tv_nsec -= 1000000000L;
+        }
+        pthread_mutex_lock(&poolMutex);
+        if ( poolFinishedJobs < poolJobCount ) {
+            pthread_cond_timedwait(&poolJobDone,&poolMutex,&wakeAt);
+        }
+        pthread_mutex_unlock(&poolMutex);
+    }
+}
+
+// makes sure the scratch arrays used by startBatteryCheck() can hold 'count' devices.
+// Only allocates while the number of devices grows, steady-state polling does not allocate.
+static int ensurePollScratch(int count)
+{
+    if ( count <= pollScratchCapacity ) {
+        return 1;
+    }
+    int capacity = roundUpToPowerOfTwo(count);
+    polljob *jobs = realloc(pollScratchJobs,capacity*sizeof(polljob));
+    if ( jobs ) {
+        pollScratchJobs = jobs;
+    }
+    devicehandle *handles = realloc(pollScratchHandles,capacity*sizeof(devicehandle));
+    if ( handles ) {
+        pollScratchHandles = handles;
+    }
+    if ( ! jobs || ! handles ) {
+        syslog(LOG_ERR,"Out of memory, failed to poll %d devices",count);
+        return 0;
+    }
+    pollScratchCapacity = capacity;
+    return 1;
+}
+
+// runs a batch of battery queries, on our own worker pool or through the SDK host in split mode.
+// Neither blocks, advanceJobs() returns the milliseconds until it wants to be called again.
+static void (*startJobs)(polljob *jobs, int count) = startPoolJobs;
+static int (*advanceJobs)() = advancePoolJobs;
+
+// the battery check in flight, see startBatteryCheck(). Only touched by the main loop.
+static polljob *checkJobs;
+static int checkJobCount;
+static int checkForced;
+
+// starts polling all devices that are due (or all of them if 'force' is set), advanceBatteryCheck()
+// merges the results once they are in. Returns 0 if no device needed polling.
+static int startBatteryCheck(int force) {
+
+    polljob *jobs = 0;
+    int dueCount = 0;
+
+    // copy handles so we can poll battery status without having to hold the lock
+    if ( force )
+    {
+        // every device gets polled, no need to touch the schedule (and the lock) for that
+        devicesnapshot *snapshot = acquireSnapshot();
+        if ( snapshot && snapshot->count > 0 && ensurePollScratch(snapshot->count) ) {
+            jobs = pollScratchJobs;
+            for( int i = 0 ; i < snapshot->count ; i++ ) {
+                // devices with an open breaker are left alone until their backoff is over
+                if ( ! hasNoBattery(snapshot->devices[i].capabilities) && snapshot->devices[i].breaker != BREAKER_OPEN ) {
+                    jobs[dueCount].handle.deviceID = snapshot->devices[i].deviceID;
+                    jobs[dueCount].handle.generation = snapshot->devices[i].generation;
+                    jobs[dueCount].remoteControl = (snapshot->devices[i].capabilities & CAP_REMOTE_CONTROL) != 0;
+                    jobs[dueCount].probe = ! (snapshot->devices[i].capabilities & CAP_FEATURES_PROBED);
+                    dueCount++;
+                }
+            }
+        }
+        releaseSnapshot(snapshot);
+    }
+    else
+    {
+        lockDeviceList();
+        if ( deviceCount > 0 && ensurePollScratch(deviceCount) ) {
+            jobs = pollScratchJobs;
+            dueCount = collectDueDevices( monotonicSeconds(), pollScratchHandles, deviceCount );
+            for ( int i = 0 ; i < dueCount ; i++ ) {
+                jobs[i].handle = pollScratchHandles[i];
+                mydeviceentry *entry = findDeviceByHandle( &jobs[i].handle );
+                jobs[i].remoteControl = entry && (entry->capabilities & CAP_REMOTE_CONTROL);
+                jobs[i].probe = entry && ! (entry->capabilities & CAP_FEATURES_PROBED);
+            }
+        }
+        unlockDeviceList();
+    }
+
+    if ( dueCount == 0 ) {
+        return 0;
+    }
+
+    for ( int i = 0 ; i < dueCount ; i++ ) {
+        jobs[i].state = POLL_PENDING;
+        jobs[i].rc = Return_Ok;
+        jobs[i].capabilities = 0;
+    }
+
+    // poll battery status while not locking the device list
+    checkJobs = jobs;
+    checkJobCount = dueCount;
+    checkForced = force;
+    startJobs( jobs, dueCount );
+    return 1;
+}
+
+// moves the running battery check along and merges its results once all of them are in.
+// Returns the milliseconds until it needs to be called again at the latest, -1 if no check is running (anymore).
+static int advanceBatteryCheck() {
+
+    if ( ! checkJobs ) {
+        return -1;
+    }
+    int waitMillis = advanceJobs();
+    if ( waitMillis >= 0 ) {
+        return waitMillis;
+    }
+
+    polljob *jobs = checkJobs;
+    int dueCount = checkJobCount;
+    int force = checkForced;
+    checkJobs = 0;
+    checkJobCount = 0;
+
+    // merge all results in one go
+    lockDeviceList();
+    for ( int i = 0 ; i < dueCount ; i++ )
+    {
+        if ( jobs[i].state == POLL_PENDING ) {
+            // never got to the SDK (shutdown or SDK host restart), the device keeps its schedule
+            continue;
+        }
+        countReturnCode( jobs[i].rc );
+        mydeviceentry *current = findDeviceByHandle( &jobs[i].handle );
+        if ( ! current ) {
+            continue;
+        }
+        if ( jobs[i].capabilities ) {
+            learnCapabilities( current, jobs[i].capabilities );
+        }
+        if ( jobs[i].state == POLL_DONE && jobs[i].rc == Return_Ok )
+        {
+            recordPollSuccess( current );
+            if ( ! (current->capabilities & CAP_BATTERY) ) {
+                learnCapabilities( current, CAP_BATTERY_KNOWN|CAP_BATTERY );
+            }
+            updateBatteryStatus( current, &jobs[i].batteryStatus, force || current->forceNotify );
+            current->forceNotify = 0;
+            scheduleDevice( current, pollInterval(current) );
+        }
+        else if ( jobs[i].state == POLL_DONE && jobs[i].rc == Not_Supported )
+        {
+            // no battery (dongle, wired device), polling it again won't change that
+            learnNoBattery( current );
+            unscheduleDevice( current );
+        }
+        else
+        {
+            // failed or timed out (rc is Return_Timeout then)
+            recordPollFailure( current, jobs[i].rc );
+        }
+    }
+    notifyChangedDevices();
+    publishSnapshotIfDirty();
+    unlockDeviceList();
+    reclaimSnapshots();
+    return -1;
+}
+
+// a device reported a battery change on its own, 'batteryStatus' stays owned by the caller
+void batteryStatusReported(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus)
+{
+    lockDeviceList();
+
+    mydeviceentry *current = findDevice( deviceID );
+    if ( current ) {
+        if ( ! (current->capabilities & CAP_BATTERY) ) {
+            learnCapabilities( current, CAP_BATTERY_KNOWN|CAP_BATTERY );
+        }
+        // the device evidently works, no need to keep backing off
+        recordPollSuccess( current );
+        current->pushesEvents = 1;
+        // events leave out the remote control, which only gets polled. It keeps its last level until the next poll.
+        Jabra_BatteryStatus status;
+        Jabra_BatteryStatusUnit units[MAX_EXTRA_UNITS];
+        copyBatteryStatus( batteryStatus, &status, units );
+        int hasRemoteControl = status.component == REMOTE_CONTROL;
+        for ( size_t i = 0 ; i < status.extraUnitsCount ; i++ ) {
+            hasRemoteControl |= units[i].component == REMOTE_CONTROL;
+        }
+        if ( ! hasRemoteControl && current->componentLevels[REMOTE_CONTROL] != JABRA_STATUS_LEVEL_UNKNOWN ) {
+            appendBatteryUnit( &status, REMOTE_CONTROL, current->componentLevels[REMOTE_CONTROL] );
+        }
+        updateBatteryStatus( current, &status, 0 );
+        if ( deviceNeedsNotification( &deviceLevels, current->index ) ) {
+            notifyDevice( current );
+        }
+        // we just got fresh data, no need to poll before the next interval is up
+        scheduleDevice( current, pollInterval(current) );
+    }
+
+    unlockDeviceList();
+
+    // main loop publishes the new state
+    wakeup(0);
+}
+
+// invoked by the SDK on its own thread whenever a device reports a battery change
+static void batteryStatusChanged(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus)
+{
+    if ( ! batteryStatus ) {
+        return;
+    }
+    if ( atomic_load(&handingOff) ) {
+        // the state already went to the new binary
+        atomic_fetch_add(&handoffDroppedEvents,1);
+    } else {
+        batteryStatusReported(deviceID, batteryStatus);
+    }
+    Jabra_FreeBatteryStatus(batteryStatus);
+}
+
+static void freeDeviceEntry(mydeviceentry *entry) {
+    free(entry->deviceName);
+    free(entry);
+}
+
+// device list must be locked by caller
+static void removeDevice(unsigned short deviceID)
+{
+    mydeviceentry *current = deviceSlots[deviceID];
+    if ( ! current ) {
+        return;
+    }
+    deviceSlots[deviceID] = 0;
+    snapshotDirty = 1;
+    releaseDeviceNotification(current);
+
+    // move last entry into the gap to keep the array dense
+    deviceCount--;
+    if ( current->index != deviceCount ) {
+        deviceArray[current->index] = deviceArray[deviceCount];
+        deviceArray[current->index]->index = current->index;
+        syncDeviceLevels(deviceArray[current->index]);
+    }
+    deviceLevels.flags[deviceCount] = 0;
+    unscheduleDevice(current);
+    freeDeviceEntry(current);
+}
+
+static void freeAllDevices()
+{
+    lockDeviceList();
+
+    for ( int i = 0 ; i < deviceCount ; i++ ) {
+        deviceSlots[ deviceArray[i]->deviceID ] = 0;
+        unscheduleDevice( deviceArray[i] );
+        freeDeviceEntry( deviceArray[i] );
+        deviceLevels.flags[i] = 0;
+    }
+    deviceCount = 0;
+
+    unlockDeviceList();
+}
+
+void delDevice(unsigned short deviceID)
+{
+    syslog(LOG_INFO,"DETACHED: device with ID %04x", deviceID);
+
+    lockDeviceList();
+
+    removeDevice(deviceID);
+
+    unlockDeviceList();
+
+    wakeup(0);
+}
+
+// device list must be locked by caller, returns 0 if out of memory
+static int appendDevice(mydeviceentry *entry)
+{
+    if ( deviceCount == deviceCapacity ) {
+        int newCapacity = deviceCapacity ? deviceCapacity*2 : 16;
+        mydeviceentry **newArray = realloc(deviceArray, newCapacity*sizeof(mydeviceentry*));
+        if ( ! newArray ) {
+            return 0;
+        }
+        deviceArray = newArray;
+        if ( ! resizeDeviceLevels(&deviceLevels, newCapacity, deviceCount) ) {
+            return 0;
+        }
+        deviceCapacity = newCapacity;
+    }
+    entry->index = deviceCount;
+    deviceArray[deviceCount++] = entry;
+    deviceSlots[entry->deviceID] = entry;
+    syncDeviceLevels(entry);
+    snapshotDirty = 1;
+    return 1;
+}
+
+// 'capabilities' are the CAP_* bits known for the device, see capabilitiesOf()
+void addDevice(Jabra_DeviceInfo* info, uint8_t capabilities) {
+
+    lockDeviceList();
+
+    // an SDK that started over reports all devices again, the ones we still know keep their state
+    mydeviceentry *known = deviceSlots[info->deviceID];
+    if ( known && known->sdkGeneration != sdkGeneration && known->productID == info->productID &&
+         strncmp(known->serial, info->serialNumber ? info->serialNumber : "", sizeof(known->serial)-1) == 0 &&
+         strcmp(known->deviceName, info->deviceName) == 0 )
+    {
+        syslog(LOG_INFO,"ATTACHED: device with ID %04x (%s) is still known, keeping its state", info->deviceID, info->deviceName);
+        known->sdkGeneration = sdkGeneration;
+        learnCapabilities(known, capabilities);
+        // battery changes while the SDK was gone went unreported, catch up right away
+        scheduleDevice(known, 0);
+        unlockDeviceList();
+        wakeup(0);
+        return;
+    }
+
+    syslog(LOG_INFO,"ATTACHED: device with ID %04x (%s)", info->deviceID, info->deviceName);
+
+    // SDK should've told us about the detach already, be defensive anyway
+    removeDevice(info->deviceID);
+
+    mydeviceentry *newEntry = calloc(1,sizeof(mydeviceentry));
+    char *deviceName = strdup(info->deviceName);
+    if ( ! newEntry || ! deviceName ) {
+        syslog(LOG_ERR,"Out of memory, ignoring device %04x", info->deviceID);
+        free(newEntry);
+        free(deviceName);
+        unlockDeviceList();
+        return;
+    }
+    newEntry->deviceID = info->deviceID;
+    newEntry->generation = ++deviceGenerations[info->deviceID];
+    newEntry->deviceName = deviceName;
+    newEntry->productID = info->productID;
+    if ( info->serialNumber ) {
+        strncpy(newEntry->serial,info->serialNumber,sizeof(newEntry->serial)-1);
+    }
+    memset(newEntry->componentLevels,JABRA_STATUS_LEVEL_UNKNOWN,sizeof(newEntry->componentLevels));
+    memset(newEntry->componentNotifiedLevels,JABRA_STATUS_LEVEL_UNKNOWN,sizeof(newEntry->componentNotifiedLevels));
+    memset(newEntry->componentMinutes,0xff,sizeof(newEntry->componentMinutes));
+    newEntry->sdkGeneration = sdkGeneration;
+    restoreDeviceState(newEntry);
+    learnCapabilities(newEntry, capabilities | (info->productID != 0 ? productCapabilities[info->productID] : 0));
+    newEntry->wheelSlot = -1;
+    if ( ! appendDevice(newEntry) ) {
+        syslog(LOG_ERR,"Out of memory, ignoring device %04x", info->deviceID);
+        freeDeviceEntry(newEntry);
+        unlockDeviceList();
+        return;
+    }
+    scheduleDevice( newEntry, 0 );
+
+    unlockDeviceList();
+
+    wakeup(0);
+}
+
+static void daemonize()
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid > 0)
+        exit(EXIT_SUCCESS);
+
+    if (setsid() < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    signal(SIGCHLD, SIG_IGN);
+    signal(SIGHUP, SIG_IGN);
+
+    pid = fork();
+    if (pid < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (pid > 0) {
+        exit(EXIT_SUCCESS);
+    }
+
+    umask(0);
+
+    chdir("/");
+
+    int x;
+    for (x = sysconf(_SC_OPEN_MAX); x>=0; x--)
+    {
+        close (x);
+    }
+
+    openlog ("jabrac", LOG_PID, LOG_DAEMON);
+}
+
+// while handing off, attaches and detaches are left to the new binary's SDK, which reports all devices again
+static void deviceAttached(Jabra_DeviceInfo deviceInfo) {
+    if ( ! atomic_load(&handingOff) ) {
+        addDevice(&deviceInfo, capabilitiesOf(&deviceInfo));
+    }
+    Jabra_FreeDeviceInfo(deviceInfo);
+}
+
+static void deviceRemoved(unsigned short deviceID) {
+    if ( ! atomic_load(&handingOff) ) {
+        delDevice(deviceID);
+    }
+}
+
+// appends to a client's output buffer, returns 0 if out of memory
+static int controlPrintf(controlclient *client, const char *format, ...)
+{
+    for (;;)
+    {
+        size_t available = client->outputCapacity - client->outputLength;
+        va_list args;
+        va_start(args,format);
+        int length = vsnprintf(client->output + client->outputLength, available, format, args);
+        va_end(args);
+        if ( length < 0 ) {
+            return 0;
+        }
+        if ( (size_t) length < available ) {
+            client->outputLength += length;
+            return 1;
+        }
+        size_t newCapacity = client->outputCapacity ? client->outputCapacity*2 : 4096;
+        while ( newCapacity - client->outputLength <= (size_t) length ) {
+            newCapacity *= 2;
+        }
+        char *newOutput = realloc(client->output,newCapacity);
+        if ( ! newOutput ) {
+            return 0;
+        }
+        client->output = newOutput;
+        client->outputCapacity = newCapacity;
+    }
+}
+
+static int controlPrintString(controlclient *client, const char *value)
+{
+    if ( ! controlPrintf(client,"\"") ) {
+        return 0;
+    }
+    for ( const unsigned char *c = (const unsigned char*) value ; *c ; c++ )
+    {
+        int ok;
+        if ( *c == '"' || *c == '\\' ) {
+            ok = controlPrintf(client,"\\%c",*c);
+        } else if ( *c < 0x20 ) {
+            ok = controlPrintf(client,"\\u%04x",*c);
+        } else {
+            ok = controlPrintf(client,"%c",*c);
+        }
+        if ( ! ok ) {
+            return 0;
+        }
+    }
+    return controlPrintf(client,"\"");
+}
+
+static int controlPrintDevice(controlclient *client, devicestate *state)
+{
+    int ok = controlPrintf(client,"{\"id\":\"%04x\",\"product_id\":%u,\"name\":",state->deviceID,state->productID)
+        && controlPrintString(client,state->name)
+        && controlPrintf(client,",\"serial\":")
+        && controlPrintString(client,state->serial);
+    if ( ok && (state->capabilities & CAP_BATTERY_KNOWN) ) {
+        ok = controlPrintf(client,",\"has_battery\":%s",(state->capabilities & CAP_BATTERY) ? "true" : "false");
+    }
+    if ( ok && (state->capabilities & CAP_FEATURES_PROBED) ) {
+        ok = controlPrintf(client,",\"remote_control\":%s",(state->capabilities & CAP_REMOTE_CONTROL) ? "true" : "false");
+    }
+    ok = ok && controlPrintf(client,",\"healthy\":%s,\"breaker\":\"%s\",\"failures\":%d",
+                             state->stuckCalls ? "false" : "true", breakerStateNames[state->breaker], state->consecutiveFailures);
+    if ( ok && state->consecutiveFailures > 0 ) {
+        ok = controlPrintf(client,",\"last_error\":\"%s\"",returnCodeName(state->lastError));
+        if ( ok && state->breaker == BREAKER_OPEN ) {
+            time_t now = monotonicSeconds();
+            ok = controlPrintf(client,",\"retry_in\":%ld",(long) (state->nextPollAt > now ? state->nextPollAt - now : 0));
+        }
+    }
+    if ( ok && state->hasBatteryStatus ) {
+        ok = controlPrintf(client,",\"level\":%d,\"charging\":%s,\"updated_at_ms\":%lld,\"components\":{",
+                           state->level, state->charging ? "true" : "false", (long long) state->lastStatusAtMillis);
+        int first = 1;
+        for ( int i = 0 ; ok && i < JABRA_STATUS_COMPONENTS ; i++ ) {
+            if ( state->componentLevels[i] != JABRA_STATUS_LEVEL_UNKNOWN ) {
+                ok = controlPrintf(client,"%s\"%d\":%d",first ? "" : ",",i,state->componentLevels[i]);
+                first = 0;
+            }
+        }
+        ok = ok && controlPrintf(client,"}");
+        uint16_t minutes = state->componentMinutes[state->mainComponent];
+        if ( ok && minutes != JABRA_STATUS_MINUTES_UNKNOWN ) {
+            ok = controlPrintf(client,",\"%s\":%d",state->charging ? "minutes_to_full" : "minutes_to_empty",minutes);
+        }
+        if ( ok && state->serial[0] ) {
+            ok = controlPrintf(client,",\"cycles\":%.2f",state->dischargedPercent / 100.0);
+        }
+        if ( ok && state->healthPermille ) {
+            ok = controlPrintf(client,",\"health\":%.1f",state->healthPermille / 10.0);
+        }
+        ok = ok && controlPrintf(client,",\"estimates\":{");
+        first = 1;
+        for ( int i = 0 ; ok && i < JABRA_STATUS_COMPONENTS ; i++ ) {
+            if ( state->componentMinutes[i] != JABRA_STATUS_MINUTES_UNKNOWN ) {
+                ok = controlPrintf(client,"%s\"%d\":{\"%s\":%d}",first ? "" : ",",i,
+                                   (state->componentFilling & (1 << i)) ? "minutes_to_full" : "minutes_to_empty",state->componentMinutes[i]);
+                first = 0;
+            }
+        }
+        ok = ok && controlPrintf(client,"}");
+    }
+    return ok && controlPrintf(client,"}");
+}
+
+// answers 'status [id]' from the current snapshot, never touches the device list or the SDK
+static int controlStatus(controlclient *client, const char *argument)
+{
+    devicesnapshot *snapshot = acquireSnapshot();
+    if ( ! snapshot ) {
+        return controlPrintf(client,"{\"error\":\"not ready\"}");
+    }
+    int ok;
+    if ( argument )
+    {
+        unsigned long deviceID = strtoul(argument,0,16);
+        int found = -1;
+        for ( int i = 0 ; i < snapshot->count ; i++ ) {
+            if ( snapshot->devices[i].deviceID == deviceID ) {
+                found = i;
+                break;
+            }
+        }
+        if ( found == -1 ) {
+            ok = controlPrintf(client,"{\"error\":\"no such device\"}");
+        } else {
+            ok = controlPrintDevice(client,&snapshot->devices[found]);
+        }
+    }
+    else
+    {
+        ok = controlPrintf(client,"{\"version\":%llu,\"devices\":[",(unsigned long long) snapshot->version);
+        for ( int i = 0 ; ok && i < snapshot->count ; i++ ) {
+            ok = ( i == 0 || controlPrintf(client,",") ) && controlPrintDevice(client,&snapshot->devices[i]);
+        }
+        ok = ok && controlPrintf(client,"]}");
+    }
+    releaseSnapshot(snapshot);
+    return ok;
+}
+
+static int controlRefresh(controlclient *client, const char *argument)
+{
+    if ( ! argument ) {
+        return controlPrintf(client,"{\"error\":\"refresh requires a device ID\"}");
+    }
+    unsigned long deviceID = strtoul(argument,0,16);
+    lockDeviceList();
+    mydeviceentry *entry = deviceID < DEVICE_ID_RANGE ? findDevice(deviceID) : 0;
+    if ( entry ) {
+        entry->forceNotify = 1;
+        scheduleDevice(entry,0);
+    }
+    unlockDeviceList();
+    if ( ! entry ) {
+        return controlPrintf(client,"{\"error\":\"no such device\"}");
+    }
+    wakeup(0);
+    return controlPrintf(client,"{\"ok\":true}");
+}
+
+static void collectHistory(void *context, const historysample *samples, int count)
+{
+    historyreply *reply = context;
+    for ( int i = 0 ; i < count ; i++ ) {
+        reply->samples[ reply->seen++ % reply->wanted ] = samples[i];
+    }
+}
+
+static int controlHistory(controlclient *client, const char *argument, const char *countArgument)
+{
+    if ( ! argument ) {
+        return controlPrintf(client,"{\"error\":\"history requires a device ID\"}");
+    }
+    unsigned long deviceID = strtoul(argument,0,16);
+    historyreply reply;
+    reply.wanted = countArgument ? atoi(countArgument) : 60;
+    reply.seen = 0;
+    if ( reply.wanted < 1 || reply.wanted > HISTORY_MAX_REPLY_SAMPLES ) {
+        return controlPrintf(client,"{\"error\":\"count must be > 0 and <= %d\"}",HISTORY_MAX_REPLY_SAMPLES);
+    }
+    char serial[MAX_SERIAL_LENGTH] = "";
+    int series = -1;
+
+    lockDeviceList();
+    mydeviceentry *entry = deviceID < DEVICE_ID_RANGE ? findDevice(deviceID) : 0;
+    int found = entry != 0;
+    if ( entry && historyFile && entry->serial[0] ) {
+        memcpy(serial,entry->serial,sizeof(serial));
+        series = findHistorySeries(serial,0);
+    }
+    unlockDeviceList();
+
+    if ( ! found ) {
+        return controlPrintf(client,"{\"error\":\"no such device\"}");
+    }
+    scanHistory(series,collectHistory,&reply);
+    int ok = controlPrintf(client,"{\"id\":\"%04x\",\"serial\":",(unsigned) deviceID) && controlPrintString(client,serial) &&
+             controlPrintf(client,",\"total\":%llu,\"samples\":[",(unsigned long long) reply.seen);
+    // oldest first
+    uint64_t first = reply.seen > (uint64_t) reply.wanted ? reply.seen - reply.wanted : 0;
+    for ( uint64_t i = first ; ok && i < reply.seen ; i++ ) {
+        historysample *sample = &reply.samples[ i % reply.wanted ];
+        ok = controlPrintf(client,"%s[%lld,%d,%d]",i == first ? "" : ",",(long long) sample->time,sample->level,sample->charging);
+    }
+    return ok && controlPrintf(client,"]}");
+}
+
+static int controlInterval(controlclient *client, const char *argument)
+{
+    int seconds = argument ? atoi(argument) : 0;
+    if ( seconds < 1 ) {
+        return controlPrintf(client,"{\"error\":\"interval must be > 0\"}");
+    }
+    lockDeviceList();
+    pollingIntervalSeconds = seconds;
+    // re-arm every device so the new interval takes effect right away, backoffs stay as they are
+    for ( int i = 0 ; i < deviceCount ; i++ ) {
+        if ( deviceArray[i]->breaker != BREAKER_OPEN ) {
+            scheduleDevice(deviceArray[i],pollInterval(deviceArray[i]));
+        }
+    }
+    unlockDeviceList();
+    wakeup(0);
+    return controlPrintf(client,"{\"ok\":true,\"interval\":%d}",seconds);
+}
+
+static int controlMetrics(controlclient *client)
+{
+    pthread_mutex_lock(&notificationMutex);
+    notificationmetrics m = notificationMetrics;
+    pthread_mutex_unlock(&notificationMutex);
+
+    devicesnapshot *snapshot = acquireSnapshot();
+    int devices = snapshot ? snapshot->count : 0;
+    unsigned long long version = snapshot ? (unsigned long long) snapshot->version : 0;
+    releaseSnapshot(snapshot);
+
+    long avgLatencyMicros = m.dispatched ? (long) (m.totalLatencyMicros / m.dispatched) : 0;
+    int ok = controlPrintf(client,"{\"devices\":%d,\"snapshot_version\":%llu,\"polling_interval\":%d,\"notification_kernel\":\"%s\",\"wakeups\":%llu,\"idle_wakeups\":%llu,\"notifications\":{\"enqueued\":%llu,"
+                         "\"dispatched\":%llu,\"dropped\":%llu,\"failed\":%llu,\"queue_depth\":%d,\"max_queue_depth\":%d,"
+                         "\"latency_us_last\":%ld,\"latency_us_avg\":%ld,\"latency_us_max\":%ld},",
+                         devices, version, pollingIntervalSeconds, notificationKernelName, (unsigned long long) loopWakeups, (unsigned long long) idleWakeups, (unsigned long long) m.enqueued, (unsigned long long) m.dispatched,
+                         (unsigned long long) m.dropped, (unsigned long long) m.failed, m.queueDepth, m.maxQueueDepth,
+                         m.lastLatencyMicros, avgLatencyMicros, m.maxLatencyMicros);
+
+    uint64_t counts[NUMBER_OF_JABRA_RETURNCODES+1];
+    lockDeviceList();
+    memcpy(counts,returnCodeCounts,sizeof(counts));
+    unlockDeviceList();
+
+    ok = ok && controlPrintf(client,"\"return_codes\":{");
+    int first = 1;
+    for ( int i = 0 ; ok && i <= NUMBER_OF_JABRA_RETURNCODES ; i++ ) {
+        if ( counts[i] ) {
+            ok = controlPrintf(client,"%s\"%s\":%llu",first ? "" : ",",i < NUMBER_OF_JABRA_RETURNCODES ? returnCodeNames[i] : "unknown",(unsigned long long) counts[i]);
+            first = 0;
+        }
+    }
+
+    sdkcallstats stats[SDK_FUNCTION_COUNT];
+    pthread_mutex_lock(&sdkStatsMutex);
+    memcpy(stats,sdkStats,sizeof(stats));
+    pthread_mutex_unlock(&sdkStatsMutex);
+
+    ok = ok && controlPrintf(client,"},\"sdk\":{");
+    for ( int i = 0 ; ok && i < SDK_FUNCTION_COUNT ; i++ )
+    {
+        ok = controlPrintf(client,"%s\"%s\":{\"calls\":%llu,\"timed_out\":%llu,\"stuck\":%d,\"latency_us_log2\":[",
+                           i ? "," : "", sdkFunctionNames[i], (unsigned long long) stats[i].calls, (unsigned long long) stats[i].timedOut, stats[i].stuck);
+        // bucket i: latency < 2^i microseconds, trailing empty buckets left out
+        int used = SDK_LATENCY_BUCKETS;
+        while ( used > 0 && stats[i].latencyHistogram[used-1] == 0 ) {
+            used--;
+        }
+        for ( int bucket = 0 ; ok && bucket < used ; bucket++ ) {
+            ok = controlPrintf(client,"%s%llu",bucket ? "," : "",(unsigned long long) stats[i].latencyHistogram[bucket]);
+        }
+        ok = ok && controlPrintf(client,"]}");
+    }
+    ok = ok && controlPrintf(client,"},\"handoffs\":{\"count\":%llu,\"last_us\":%ld,\"dropped_events\":%llu}",
+                             (unsigned long long) handoffCount, lastHandoffMicros, (unsigned long long) atomic_load(&handoffDroppedEvents));
+    if ( splitMode ) {
+        ok = ok && controlPrintf(client,",\"sdk_host\":{\"pid\":%d,\"restarts\":%llu,\"messages\":%llu}",
+                                 (int) hostPid, (unsigned long long) hostRestarts, (unsigned long long) hostMessages);
+    }
+    return ok && controlPrintf(client,"}");
+}
+
+// the records findWorstHealth() picked. Main thread only.
+static staterecord controlHealthRecords[HEALTH_MAX_REPLY_DEVICES];
+
+static int controlHealth(controlclient *client, const char *argument)
+{
+    int wanted = argument ? atoi(argument) : 20;
+    if ( wanted < 1 || wanted > HEALTH_MAX_REPLY_DEVICES ) {
+        return controlPrintf(client,"{\"error\":\"count must be > 0 and <= %d\"}",HEALTH_MAX_REPLY_DEVICES);
+    }
+    int tracked;
+    lockDeviceList();
+    int count = findWorstHealth(controlHealthRecords,wanted,&tracked);
+    unlockDeviceList();
+
+    int ok = controlPrintf(client,"{\"tracked\":%d,\"devices\":[",tracked);
+    for ( int i = 0 ; ok && i < count ; i++ ) {
+        staterecord *record = &controlHealthRecords[i];
+        ok = controlPrintf(client,"%s{\"serial\":",i ? "," : "") && controlPrintString(client,record->serial) &&
+             controlPrintf(client,",\"product_id\":%u,\"health\":%.1f,\"cycles\":%.2f,\"stretches\":%u,"
+                           "\"baseline_rate\":%.2f,\"recent_rate\":%.2f,\"last_seen_ms\":%lld}",
+                           record->productID, record->healthPermille / 10.0, record->dischargedPercent / 100.0, record->stretches,
+                           record->baselineRate, record->recentRate, (long long) record->lastSeenMillis);
+    }
+    return ok && controlPrintf(client,"]}");
+}
+
+static int controlReexec(controlclient *client)
+{
+    if ( ! selfPath[0] ) {
+        return controlPrintf(client,"{\"error\":\"binary to restart unknown\"}");
+    }
+    // the main loop hands off once this reply went out, the connection closes with the exec
+    reexecRequested = 1;
+    return controlPrintf(client,"{\"ok\":true,\"pid\":%d,\"binary\":",(int) getpid()) &&
+           controlPrintString(client,selfPath) && controlPrintf(client,"}");
+}
+
+// executes one command line, the reply ends up in the client's output buffer
+static int controlCommand(controlclient *client, char *line)
+{
+    char *command = strtok(line," \t\r");
+    char *argument = command ? strtok(0," \t\r") : 0;
+    int ok;
+    if ( ! command ) {
+        ok = controlPrintf(client,"{\"error\":\"empty command\"}");
+    } else if ( strcmp(command,"status") == 0 ) {
+        ok = controlStatus(client,argument);
+    } else if ( strcmp(command,"refresh") == 0 ) {
+        ok = controlRefresh(client,argument);
+    } else if ( strcmp(command,"interval") == 0 ) {
+        ok = controlInterval(client,argument);
+    } else if ( strcmp(command,"metrics") == 0 ) {
+        ok = controlMetrics(client);
+    } else if ( strcmp(command,"history") == 0 ) {
+        ok = controlHistory(client,argument,argument ? strtok(0," \t\r") : 0);
+    } else if ( strcmp(command,"health") == 0 ) {
+        ok = controlHealth(client,argument);
+    } else if ( strcmp(command,"reexec") == 0 ) {
+        ok = controlReexec(client);
+    } else {
+        ok = controlPrintf(client,"{\"error\":\"unknown command\"}");
+    }
+    return ok && controlPrintf(client,"\n");
+}
+
+static void closeControlClient(controlclient *client)
+{
+    close(client->fd);
+    client->fd = -1;
+    client->inputLength = 0;
+    client->outputLength = 0;
+    client->outputSent = 0;
+}
+
+// reads whatever the client sent and executes all complete commands
+static void readControlClient(controlclient *client)
+{
+    ssize_t count = read(client->fd, client->input + client->inputLength, sizeof(client->input) - client->inputLength);
+    if ( count <= 0 ) {
+        if ( count == 0 || ( errno != EAGAIN && errno != EINTR ) ) {
+            closeControlClient(client);
+        }
+        return;
+    }
+    client->inputLength += count;
+
+    char *start = client->input;
+    char *end = client->input + client->inputLength;
+    char *newline;
+    while ( ( newline = memchr(start,'\n',end-start) ) )
+    {
+        *newline = 0;
+        if ( ! controlCommand(client,start) ) {
+            syslog(LOG_ERR,"Out of memory while answering control command");
+            closeControlClient(client);
+            return;
+        }
+        start = newline+1;
+    }
+    client->inputLength = end - start;
+    memmove(client->input,start,client->inputLength);
+
+    if ( client->inputLength == sizeof(client->input) ) {
+        // no newline within the maximum command length, nothing sensible we can do with that
+        closeControlClient(client);
+    }
+}
+
+static void writeControlClient(controlclient *client)
+{
+    // a client that went away must not kill us with SIGPIPE
+    ssize_t count = send(client->fd, client->output + client->outputSent, client->outputLength - client->outputSent, MSG_NOSIGNAL);
+    if ( count < 0 ) {
+        if ( errno != EAGAIN && errno != EINTR ) {
+            closeControlClient(client);
+        }
+        return;
+    }
+    client->outputSent += count;
+    if ( client->outputSent == client->outputLength ) {
+        client->outputSent = 0;
+        client->outputLength = 0;
+    }
+}
+
+// only waits for writability while a reply is pending, so no further commands get read until it went out
+static void updateControlClientEvents(int index)
+{
+    struct epoll_event event;
+    event.events = controlClients[index].outputLength > 0 ? EPOLLOUT : EPOLLIN;
+    event.data.u64 = EVENT_CONTROL_CLIENT + index;
+    epoll_ctl(epollFd,EPOLL_CTL_MOD,controlClients[index].fd,&event);
+}
+
+static void handleControlClient(int index, uint32_t events)
+{
+    if ( index >= MAX_CONTROL_CLIENTS || controlClients[index].fd == -1 ) {
+        return;
+    }
+    controlclient *client = &controlClients[index];
+    if ( events & EPOLLOUT ) {
+        writeControlClient(client);
+    } else {
+        readControlClient(client);
+        // most replies fit into the socket buffer right away
+        if ( client->fd != -1 && client->outputLength > 0 ) {
+            writeControlClient(client);
+        }
+    }
+    if ( client->fd != -1 ) {
+        updateControlClientEvents(index);
+    }
+}
+
+static void acceptControlClients()
+{
+    int fd;
+    while ( ( fd = accept(controlSocketFd,0,0) ) >= 0 )
+    {
+        fcntl(fd,F_SETFL,O_NONBLOCK);
+        fcntl(fd,F_SETFD,FD_CLOEXEC);
+        int index = -1;
+        for ( int i = 0 ; i < MAX_CONTROL_CLIENTS ; i++ ) {
+            if ( controlClients[i].fd == -1 ) {
+                index = i;
+                break;
+            }
+        }
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.u64 = EVENT_CONTROL_CLIENT + index;
+        if ( index == -1 || epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&event) != 0 ) {
+            syslog(LOG_WARNING,"Too many control socket clients, dropping connection");
+            close(fd);
+            continue;
+        }
+        controlClients[index].fd = fd;
+    }
+}
+
+// starts accepting clients on a listening socket bound to 'path'
+static void watchControlSocket(int fd, const char *path)
+{
+    strcpy(controlSocketName,path);
+    controlSocketFd = fd;
+
+    for ( int i = 0 ; i < MAX_CONTROL_CLIENTS ; i++ ) {
+        controlClients[i].fd = -1;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = EVENT_CONTROL_LISTENER;
+    if ( epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&event) != 0 ) {
+        syslog(LOG_ERR,"Failed to watch control socket: %s",strerror(errno));
+        removeControlSocket();
+    }
+}
+
+static void openControlSocket()
+{
+    char path[PATH_MAX];
+    if ( controlSocketPath ) {
+        snprintf(path,sizeof(path),"%s",controlSocketPath);
+    } else {
+        jabracontrol_socket_path(path,sizeof(path));
+    }
+    if ( strlen(path) >= sizeof(controlSocketName) ) {
+        syslog(LOG_ERR,"Control socket path %s is too long",path);
+        return;
+    }
+
+    int fd = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0);
+    if ( fd < 0 ) {
+        syslog(LOG_ERR,"Failed to create control socket: %s",strerror(errno));
+        return;
+    }
+    struct sockaddr_un address;
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path,path);
+
+    // a socket left behind by a previous instance, isAlreadyRunning() made sure it is dead
+    unlink(path);
+    mode_t oldMask = umask(0077);
+    int rc = bind(fd,(struct sockaddr*) &address,sizeof(address));
+    umask(oldMask);
+    if ( rc != 0 || listen(fd,16) != 0 ) {
+        syslog(LOG_ERR,"Failed to listen on control socket %s: %s",path,strerror(errno));
+        close(fd);
+        return;
+    }
+    watchControlSocket(fd,path);
+}
+
+static void removeControlSocket()
+{
+    if ( controlSocketName[0] ) {
+        unlink(controlSocketName);
+        controlSocketName[0] = 0;
+    }
+}
+
+int watchEventSource(int fd, uint64_t tag)
+{
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.u64 = tag;
+    return fd != -1 && epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&event) == 0;
+}
+
+// sets up the file descriptors the main loop waits on, signals need to be blocked already
+static int openEventLoop()
+{
+    epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if ( epollFd == -1 ) {
+        return 0;
+    }
+    timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    wakeupFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if ( splitMode ) {
+        hostRespawnFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if ( ! watchEventSource(hostRespawnFd,EVENT_HOST_RESPAWN) ) {
+            return 0;
+        }
+    }
+    return watchEventSource(timerFd,EVENT_TIMER) && watchEventSource(wakeupFd,EVENT_WAKEUP) && watchEventSource(signalFd,EVENT_SIGNAL);
+}
+
+// -1 disarms the timer
+void armTimerMillis(int fd, long millis)
+{
+    struct itimerspec timer;
+    memset(&timer,0,sizeof(timer));
+    if ( millis > 0 ) {
+        timer.it_value.tv_sec = millis / 1000;
+        timer.it_value.tv_nsec = (millis % 1000) * 1000000L;
+    } else if ( millis == 0 ) {
+        // an all-zero value would disarm the timer
+        timer.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(fd,0,&timer,0);
+}
+
+static void armPollTimer(int seconds)
+{
+    armTimerMillis(timerFd, seconds < 0 ? -1 : seconds * 1000L);
+}
+
+void drainEventSource(int fd)
+{
+    uint64_t counter;
+    while ( read(fd,&counter,sizeof(counter)) > 0 ) {
+    }
+}
+
+// the SDK (or SDK host) finished its first scan after starting over, devices it didn't report again are gone
+void removeStaleDevices()
+{
+    lockDeviceList();
+    // removeDevice() moves the last device into the gap, so walk backwards
+    for ( int i = deviceCount-1 ; i >= 0 ; i-- ) {
+        if ( deviceArray[i]->sdkGeneration != sdkGeneration ) {
+            syslog(LOG_INFO,"DETACHED: device with ID %04x (not reported again after the SDK started over)", deviceArray[i]->deviceID);
+            removeDevice(deviceArray[i]->deviceID);
+        }
+    }
+    unlockDeviceList();
+    wakeup(0);
+}
+
+// hot restart: hands devices and schedule over to a fresh exec of the binary with --adopt-state.
+// Only returns if that failed.
+static void handOffState()
+{
+    struct timespec startedAt;
+    clock_gettime(CLOCK_MONOTONIC,&startedAt);
+    syslog(LOG_INFO,"Hot restart: handing off to %s",selfPath);
+
+    // notification ids can only be read once the notification thread is done with them. A notification
+    // daemon that hangs must not hold up the device list meanwhile, so it's not locked yet.
+    pthread_mutex_lock(&notificationMutex);
+    notificationsPaused = 1;
+    struct timespec deadline = startedAt;
+    deadline.tv_sec += HANDOFF_NOTIFICATION_WAIT_MILLIS / 1000;
+    deadline.tv_nsec += (HANDOFF_NOTIFICATION_WAIT_MILLIS % 1000) * 1000000L;
+    if ( deadline.tv_nsec >= 1000000000L ) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    int rc = 0;
+    while ( notificationDispatching && rc == 0 ) {
+        rc = pthread_cond_timedwait(&notificationIdle,&notificationMutex,&deadline);
+    }
+    if ( rc != 0 ) {
+        syslog(LOG_ERR,"Hot restart: failed to save state: notification daemon is not responding");
+        notificationsPaused = 0;
+        pthread_cond_signal(&notificationAvailable);
+        pthread_mutex_unlock(&notificationMutex);
+        return;
+    }
+    pthread_mutex_unlock(&notificationMutex);
+
+    // the notification thread stays paused, the queue can only grow until we lock it again
+    lockDeviceList();
+    pthread_mutex_lock(&notificationMutex);
+    size_t size = sizeof(handoffheader) + deviceCount*sizeof(handoffdevice) + notificationQueueCount*sizeof(notificationmsg);
+    // inherited by the new binary, hence no MFD_CLOEXEC
+    int fd = memfd_create("jabrac-handoff",0);
+    handoffheader *header = MAP_FAILED;
+    if ( fd != -1 && ftruncate(fd,size) == 0 ) {
+        header = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    }
+    if ( header == MAP_FAILED )
+    {
+        syslog(LOG_ERR,"Hot restart: failed to save state: %s",strerror(errno));
+        if ( fd != -1 ) {
+            close(fd);
+        }
+        notificationsPaused = 0;
+        pthread_cond_signal(&notificationAvailable);
+        pthread_mutex_unlock(&notificationMutex);
+        unlockDeviceList();
+        return;
+    }
+
+    header->magic = HANDOFF_MAGIC;
+    header->version = HANDOFF_VERSION;
+    header->headerSize = sizeof(handoffheader);
+    header->deviceSize = sizeof(handoffdevice);
+    header->notificationSize = sizeof(notificationmsg);
+    header->deviceCount = deviceCount;
+    header->notificationCount = notificationQueueCount;
+    header->pollingIntervalSeconds = pollingIntervalSeconds;
+    header->controlSocketFd = controlSocketName[0] ? controlSocketFd : -1;
+    strcpy(header->controlSocketName,controlSocketName);
+    header->hostPid = hostPid;
+    header->hostSegmentFd = hostSegmentFd;
+    header->hostEventFd = hostEventFd;
+    header->hostRequestFd = hostRequestFd;
+    header->hostPollBatch = hostPollBatch;
+    header->sdkGeneration = sdkGeneration;
+    header->hostRestarts = hostRestarts;
+    header->hostMessages = hostMessages;
+    header->loopWakeups = loopWakeups;
+    header->idleWakeups = idleWakeups;
+    header->handoffCount = handoffCount;
+    header->notificationMetrics = notificationMetrics;
+    memcpy(header->returnCodeCounts,returnCodeCounts,sizeof(returnCodeCounts));
+    header->startedAt = startedAt;
+
+    handoffdevice *devices = (handoffdevice*) (header+1);
+    for ( int i = 0 ; i < deviceCount ; i++ )
+    {
+        mydeviceentry *entry = deviceArray[i];
+        handoffdevice *device = &devices[i];
+        device->deviceID = entry->deviceID;
+        device->productID = entry->productID;
+        device->generation = entry->generation;
+        device->sdkGeneration = entry->sdkGeneration;
+        snprintf(device->name,sizeof(device->name),"%s",entry->deviceName);
+        memcpy(device->serial,entry->serial,sizeof(device->serial));
+        if ( deviceNotifications[entry->deviceID] && deviceNotificationGenerations[entry->deviceID] == entry->generation ) {
+            int id = 0;
+            g_object_get(G_OBJECT(deviceNotifications[entry->deviceID]),"id",&id,NULL);
+            device->notificationId = id;
+        } else if ( adoptedNotificationGenerations[entry->deviceID] == entry->generation ) {
+            // taken over on an earlier hot restart and not shown since
+            device->notificationId = adoptedNotificationIds[entry->deviceID];
+        }
+        device->notifiedAtLeastOnce = entry->notifiedAtLeastOnce;
+        device->lastNotifyCharging = entry->lastNotifyCharging;
+        device->lastNotifyPercentage = entry->lastNotifyPercentage;
+        device->forceNotify = entry->forceNotify;
+        device->capabilities = entry->capabilities;
+        device->hasBatteryStatus = entry->hasBatteryStatus;
+        device->lastLevel = entry->lastLevel;
+        device->lastCharging = entry->lastCharging;
+        device->pushesEvents = entry->pushesEvents;
+        memcpy(device->componentLevels,entry->componentLevels,sizeof(device->componentLevels));
+        memcpy(device->componentNotifiedLevels,entry->componentNotifiedLevels,sizeof(device->componentNotifiedLevels));
+        device->lastStatusAtMillis = entry->lastStatusAtMillis;
+        memcpy(device->estimators,entry->estimators,sizeof(device->estimators));
+        memcpy(device->componentMinutes,entry->componentMinutes,sizeof(device->componentMinutes));
+        device->componentFilling = entry->componentFilling;
+        device->mainComponent = entry->mainComponent;
+        device->healthPermille = entry->healthPermille;
+        device->dischargedPercent = entry->dischargedPercent;
+        device->breaker = entry->breaker;
+        device->consecutiveFailures = entry->consecutiveFailures;
+        device->breakerBackoffSeconds = entry->breakerBackoffSeconds;
+        device->lastError = entry->lastError;
+        device->nextPollAt = entry->wheelSlot >= 0 ? entry->nextPollAt : -1;
+    }
+    notificationmsg *notifications = (notificationmsg*) (devices + deviceCount);
+    for ( int i = 0 ; i < notificationQueueCount ; i++ ) {
+        notifications[i] = notificationQueue[(notificationQueueHead + i) % NOTIFICATION_QUEUE_SIZE];
+    }
+
+    atomic_store(&handingOff,1);
+    pthread_mutex_unlock(&notificationMutex);
+    unlockDeviceList();
+
+    // callbacks that come in from here on get ignored, the new binary initializes the SDK again
+    if ( ! splitMode && libraryInitialized ) {
+        runGuardedLibraryCall(SDK_UNINITIALIZE,SDK_UNINITIALIZE_TIMEOUT_MILLIS);
+        libraryInitialized = 0;
+    }
+    // as late as possible, battery events ignored until now still count
+    header->droppedEvents = atomic_load(&handoffDroppedEvents);
+    int inherited[] = { header->controlSocketFd, hostSegmentFd, hostEventFd, hostRequestFd };
+    munmap(header,size);
+
+    for ( int i = 0 ; i < 4 ; i++ ) {
+        if ( inherited[i] != -1 ) {
+            fcntl(inherited[i],F_SETFD,0);
+        }
+    }
+
+    // same arguments, an --adopt-state from an earlier hot restart gets replaced
+    char fdArg[16];
+    snprintf(fdArg,sizeof(fdArg),"%d",fd);
+    char **args = calloc(savedArgc+3,sizeof(char*));
+    if ( args )
+    {
+        int argCount = 0;
+        for ( int i = 0 ; i < savedArgc ; i++ ) {
+            if ( strcmp(savedArgs[i],"--adopt-state") == 0 && (i+1) < savedArgc ) {
+                i++;
+            } else {
+                args[argCount++] = savedArgs[i];
+            }
+        }
+        args[argCount++] = "--adopt-state";
+        args[argCount++] = fdArg;
+        args[argCount] = 0;
+
+        fflush(stdout);
+        execv(selfPath,args);
+        free(args);
+    }
+
+    syslog(LOG_ERR,"Hot restart: failed to execute %s: %s",selfPath,strerror(errno));
+    close(fd);
+    for ( int i = 0 ; i < 4 ; i++ ) {
+        if ( inherited[i] != -1 ) {
+            fcntl(inherited[i],F_SETFD,FD_CLOEXEC);
+        }
+    }
+    pthread_mutex_lock(&notificationMutex);
+    notificationsPaused = 0;
+    pthread_cond_signal(&notificationAvailable);
+    pthread_mutex_unlock(&notificationMutex);
+    atomic_store(&handingOff,0);
+
+    // carry on with what we have, the SDK reports all devices again
+    if ( ! splitMode && ! libraryInitialized ) {
+        sdkGeneration++;
+        if ( initializeLibrary(removeStaleDevices,deviceAttached,deviceRemoved) != Return_Ok ) {
+            syslog(LOG_ERR,"Failed to initialize library");
+            shutdownRequested = 1;
+            finalReturnCode = 1;
+            return;
+        }
+        libraryInitialized = 1;
+        if ( useBatteryEvents ) {
+            registerBatteryCallback(batteryStatusChanged);
+        }
+    }
+}
+
+// takes over the state handed off by handOffState(), returns 0 if there is nothing usable in 'fd'.
+// Needs the event loop and must run before the notification thread gets started.
+static int adoptState(int fd)
+{
+    struct stat st;
+    handoffheader *header = MAP_FAILED;
+    if ( fstat(fd,&st) == 0 && st.st_size >= (off_t) sizeof(handoffheader) ) {
+        header = mmap(0,st.st_size,PROT_READ,MAP_PRIVATE,fd,0);
+    }
+    close(fd);
+    if ( header == MAP_FAILED ) {
+        syslog(LOG_ERR,"Hot restart: no state to adopt in descriptor %d",fd);
+        return 0;
+    }
+    if ( header->magic != HANDOFF_MAGIC || header->version != HANDOFF_VERSION || header->headerSize != sizeof(handoffheader) ||
+         header->deviceSize != sizeof(handoffdevice) || header->notificationSize != sizeof(notificationmsg) ||
+         header->notificationCount > NOTIFICATION_QUEUE_SIZE ||
+         (size_t) st.st_size < sizeof(handoffheader) + header->deviceCount*sizeof(handoffdevice) + header->notificationCount*sizeof(notificationmsg) )
+    {
+        syslog(LOG_ERR,"Hot restart: state handed over has an unsupported format, starting from scratch");
+        // the SDK host would be running unsupervised otherwise
+        if ( header->magic == HANDOFF_MAGIC && header->hostPid > 0 ) {
+            kill(header->hostPid,SIGKILL);
+        }
+        munmap(header,st.st_size);
+        return 0;
+    }
+
+    time_t now = monotonicSeconds();
+    const handoffdevice *devices = (const handoffdevice*) (header+1);
+    lockDeviceList();
+    for ( uint32_t i = 0 ; i < header->deviceCount ; i++ )
+    {
+        const handoffdevice *device = &devices[i];
+        mydeviceentry *entry = calloc(1,sizeof(mydeviceentry));
+        char *name = strndup(device->name,sizeof(device->name)-1);
+        if ( ! entry || ! name || deviceSlots[device->deviceID] ) {
+            free(entry);
+            free(name);
+            continue;
+        }
+        entry->deviceID = device->deviceID;
+        entry->generation = device->generation;
+        entry->deviceName = name;
+        entry->productID = device->productID;
+        memcpy(entry->serial,device->serial,sizeof(entry->serial));
+        entry->serial[sizeof(entry->serial)-1] = 0;
+        entry->notifiedAtLeastOnce = device->notifiedAtLeastOnce;
+        entry->lastNotifyCharging = device->lastNotifyCharging;
+        entry->lastNotifyPercentage = device->lastNotifyPercentage;
+        entry->forceNotify = device->forceNotify;
+        entry->capabilities = device->capabilities;
+        entry->breaker = device->breaker;
+        entry->consecutiveFailures = device->consecutiveFailures;
+        entry->breakerBackoffSeconds = device->breakerBackoffSeconds;
+        entry->lastError = device->lastError;
+        entry->hasBatteryStatus = device->hasBatteryStatus;
+        entry->lastLevel = device->lastLevel;
+        entry->lastCharging = device->lastCharging;
+        entry->pushesEvents = device->pushesEvents;
+        memcpy(entry->componentLevels,device->componentLevels,sizeof(entry->componentLevels));
+        memcpy(entry->componentNotifiedLevels,device->componentNotifiedLevels,sizeof(entry->componentNotifiedLevels));
+        entry->lastStatusAtMillis = device->lastStatusAtMillis;
+        memcpy(entry->estimators,device->estimators,sizeof(entry->estimators));
+        memcpy(entry->componentMinutes,device->componentMinutes,sizeof(entry->componentMinutes));
+        entry->componentFilling = device->componentFilling;
+        entry->mainComponent = device->mainComponent;
+        entry->healthPermille = device->healthPermille;
+        entry->dischargedPercent = device->dischargedPercent;
+        entry->sdkGeneration = device->sdkGeneration;
+        entry->wheelSlot = -1;
+        if ( ! appendDevice(entry) ) {
+            freeDeviceEntry(entry);
+            continue;
+        }
+        deviceGenerations[entry->deviceID] = entry->generation;
+        if ( device->nextPollAt >= 0 ) {
+            scheduleDevice(entry, device->nextPollAt > now ? device->nextPollAt - now : 0);
+        }
+        adoptedNotificationIds[entry->deviceID] = device->notificationId;
+        adoptedNotificationGenerations[entry->deviceID] = entry->generation;
+    }
+    pollingIntervalSeconds = header->pollingIntervalSeconds;
+    sdkGeneration = header->sdkGeneration;
+    memcpy(returnCodeCounts,header->returnCodeCounts,sizeof(returnCodeCounts));
+    unlockDeviceList();
+
+    // the notification thread isn't running yet
+    const notificationmsg *notifications = (const notificationmsg*) (devices + header->deviceCount);
+    for ( uint32_t i = 0 ; i < header->notificationCount ; i++ ) {
+        notificationQueue[i] = notifications[i];
+    }
+    notificationQueueHead = 0;
+    notificationQueueCount = header->notificationCount;
+    notificationMetrics = header->notificationMetrics;
+    notificationMetrics.queueDepth = notificationQueueCount;
+
+    loopWakeups = header->loopWakeups;
+    idleWakeups = header->idleWakeups;
+    handoffCount = header->handoffCount + 1;
+    atomic_store(&handoffDroppedEvents,header->droppedEvents);
+
+    if ( header->controlSocketFd != -1 ) {
+        fcntl(header->controlSocketFd,F_SETFD,FD_CLOEXEC);
+        watchControlSocket(header->controlSocketFd,header->controlSocketName);
+    }
+
+    if ( header->hostPid > 0 && adoptSdkHost(header->hostPid,header->hostSegmentFd,header->hostEventFd,header->hostRequestFd) ) {
+        hostPollBatch = header->hostPollBatch;
+        hostRestarts = header->hostRestarts;
+        hostMessages = header->hostMessages;
+    }
+
+    handoffStartedAt = header->startedAt;
+    struct timespec adoptedAt;
+    clock_gettime(CLOCK_MONOTONIC,&adoptedAt);
+    lastHandoffMicros = (adoptedAt.tv_sec - handoffStartedAt.tv_sec)*1000000L + (adoptedAt.tv_nsec - handoffStartedAt.tv_nsec)/1000;
+    syslog(LOG_INFO,"Hot restart: adopted %d devices and %d queued notifications, %ld us after the hand-off started",
+           deviceCount, notificationQueueCount, lastHandoffMicros);
+    munmap(header,st.st_size);
+    return 1;
+}
+
+// --reexec: asks the running daemon to restart itself in place through the control socket
+static int requestReexec()
+{
+    char path[PATH_MAX];
+    if ( controlSocketPath ) {
+        snprintf(path,sizeof(path),"%s",controlSocketPath);
+    } else {
+        jabracontrol_socket_path(path,sizeof(path));
+    }
+    struct sockaddr_un address;
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path,path,sizeof(address.sun_path)-1);
+
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    if ( fd < 0 || connect(fd,(struct sockaddr*) &address,sizeof(address)) != 0 ) {
+        printf("ERROR: Failed to connect to %s: %s\n",path,strerror(errno));
+        return 1;
+    }
+    const char command[] = "reexec\n";
+    char reply[512];
+    ssize_t length = 0;
+    if ( write(fd,command,sizeof(command)-1) == (ssize_t) sizeof(command)-1 ) {
+        for ( ssize_t count ; length < (ssize_t) sizeof(reply)-1 && ( count = read(fd,reply+length,sizeof(reply)-1-length) ) > 0 ; ) {
+            length += count;
+            if ( memchr(reply,'\n',length) ) {
+                break;
+            }
+        }
+    }
+    close(fd);
+    reply[length] = 0;
+    printf("%s",reply);
+    return length > 0 && strstr(reply,"\"ok\":true") ? 0 : 1;
+}
+
+// parses '<component>=<percentage>' (--component-step) into componentThresholds
+static int parseComponentStep(const char *argument)
+{
+    const char *separator = strchr(argument,'=');
+    if ( ! separator ) {
+        return 0;
+    }
+    int step = atoi(separator+1);
+    if ( step < 1 || step > 100 ) {
+        return 0;
+    }
+    for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+        if ( strlen(componentNames[c]) == (size_t) (separator - argument) && strncmp(componentNames[c],argument,separator - argument) == 0 ) {
+            componentThresholds[c] = step;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// benchmarks include this file and bring their own main()
+#ifndef JABRA_NO_MAIN
+int main(int argc, char** args) {
+
+  int adoptStateFd = -1;
+  int reexecClient = 0;
+  // NULL to use the default locations
+  char *stateFilePath = 0;
+  char *historyFilePath = 0;
+
+  if ( argc > 0 )
+  {
 
     for ( int i = 0 ; i < argc ; i++) {
       if ( strcmp("-h", args[i]) == 0 || strcmp("--help",args[i]) == 0 ) {
-        printf("Usage: [-h|--help] [-d|--daemon] [-v|--verbose] [--notify-step <battery level percentage delta>] [--polling-interval <seconds>]\n");
+        printf("Usage: [-h|--help] [-d|--daemon] [-v|--verbose] [--notify-step <battery level percentage delta>] [--component-step <component>=<percentage delta>] [--polling-interval <seconds>] [--no-battery-events] [--poll-workers <count>] [--poll-timeout <milliseconds>] [--state-file <path>] [--history-file <path>] [--control-socket <path>] [--split] [--reexec]\n");
         return 1;
       } else if ( strcmp("-d", args[i]) == 0 || strcmp("--daemon",args[i]) == 0 ) {
         runAsDaemon=1;
       } else if ( strcmp("-v", args[i]) == 0 || strcmp("--verbose",args[i]) == 0 ) {
         verbose=1;
+      } else if ( strcmp("--no-battery-events", args[i]) == 0 ) {
+        useBatteryEvents=0;
+      } else if ( strcmp("--split", args[i]) == 0 ) {
+        splitMode=1;
+      } else if ( strcmp("--reexec", args[i]) == 0 ) {
+        reexecClient=1;
+      } else if ( strcmp("--adopt-state", args[i]) == 0 ) {
+        // internal, how a hot restart hands over to the new binary (see handOffState())
+        if ( (i+1) < argc ) {
+            adoptStateFd = atoi(args[i+1]);
+            i++;
+        } else {
+          printf("ERROR: --adopt-state requires an argument\n");
+          return 1;
+        }
+      } else if ( strcmp("--sdk-host", args[i]) == 0 ) {
+        // internal, how the daemon starts its SDK host (see startSdkHost())
+        if ( (i+3) < argc ) {
+            sdkHostMode = 1;
+            hostSegmentFd = atoi(args[i+1]);
+            hostEventFd = atoi(args[i+2]);
+            hostRequestFd = atoi(args[i+3]);
+            i += 3;
+        } else {
+          printf("ERROR: --sdk-host requires three arguments\n");
+          return 1;
+        }
+      } else if ( strcmp("--state-file", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            stateFilePath = args[i+1];
+            i++;
+        } else {
+          printf("ERROR: --state-file requires an argument\n");
+          return 1;
+        }
+      } else if ( strcmp("--history-file", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            historyFilePath = args[i+1];
+            i++;
+        } else {
+          printf("ERROR: --history-file requires an argument\n");
+          return 1;
+        }
+      } else if ( strcmp("--control-socket", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            controlSocketPath = args[i+1];
+            i++;
+        } else {
+          printf("ERROR: --control-socket requires an argument\n");
+          return 1;
+        }
+      } else if ( strcmp("--poll-workers", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            pollWorkerCount = atoi(args[i+1]);
+            if ( pollWorkerCount < 1 || pollWorkerCount > MAX_POLL_WORKERS ) {
+              printf("ERROR: %d is an invalid argument for --poll-workers, must be > 0 and <= %d\n", pollWorkerCount, MAX_POLL_WORKERS);
+              return 1;
+            }
+            i++;
+        } else {
+          printf("ERROR: --poll-workers requires an argument\n");
+          return 1;
+        }
+      } else if ( strcmp("--poll-timeout", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            pollTimeoutMillis = atoi(args[i+1]);
+            if ( pollTimeoutMillis < 1 ) {
+              printf("ERROR: %d is an invalid argument for --poll-timeout, must be > 0\n", pollTimeoutMillis);
+              return 1;
+            }
+            i++;
+        } else {
+          printf("ERROR: --poll-timeout requires an argument\n");
+          return 1;
+        }
       } else if ( strcmp("--polling-interval", args[i]) == 0 ) {
         if ( (i+1) < argc ) {
             pollingIntervalSeconds = atoi(args[i+1]);
@@ -481,6 +4110,21 @@ int main(int argc, char** args) {
           printf("ERROR: --notify-step requires an argument\n");
           return 1;
         }
+      } else if ( strcmp("--component-step", args[i]) == 0 ) {
+        if ( (i+1) < argc ) {
+            if ( ! parseComponentStep(args[i+1]) ) {
+              printf("ERROR: %s is an invalid argument for --component-step, must be <component>=<percentage> with a percentage > 0 and <= 100 and one of the components",args[i+1]);
+              for ( int c = 0 ; c < JABRA_STATUS_COMPONENTS ; c++ ) {
+                  printf("%s%s",c ? ", " : " ",componentNames[c]);
+              }
+              printf("\n");
+              return 1;
+            }
+            i++;
+        } else {
+          printf("ERROR: --component-step requires an argument\n");
+          return 1;
+        }
       } else if ( strcmp("--notify-step", args[i]) == 0 ) {
         if ( (i+1) < argc ) {
             notificationThreshold = atoi(args[i+1]);
@@ -497,25 +4141,48 @@ int main(int argc, char** args) {
     }
   }
 
-  if ( isAlreadyRunning() )
+  if ( sdkHostMode ) {
+    return runSdkHost();
+  }
+  if ( reexecClient ) {
+    return requestReexec();
+  }
+
+  savedArgc = argc;
+  savedArgs = args;
+  if ( ! resolveLinkTarget("/proc/self/exe",selfPath,sizeof(selfPath)) ) {
+    selfPath[0] = 0;
+  }
+
+  // a hot restart: we are the instance that is running, already detached and holding the lock file
+  if ( adoptStateFd != -1 ) {
+    weCreatedLockFile = 1;
+    if ( runAsDaemon ) {
+      openlog ("jabrac", LOG_PID, LOG_DAEMON);
+    }
+  }
+
+  if ( adoptStateFd == -1 && isAlreadyRunning() )
   {
     printf("ERROR: Another instance is already running, terminate that one first.\n");
     return 1;
   }
 
+  selectNotificationKernel();
+
   if ( verbose ) {
     printf("Will notify about battery level changes every %d percent.\n",notificationThreshold);
-    printf("Will poll battery status every %d seconds.\n",pollingIntervalSeconds);
+    printf("Will poll battery status every %d seconds (adjusted per device by battery state).\n",pollingIntervalSeconds);
   }
 
-  if ( runAsDaemon ) {
+  if ( runAsDaemon && adoptStateFd == -1 ) {
     if ( verbose ) {
       printf("Running as daemon\n");
     }
     daemonize();
   }
 
-  if ( ! createLockFile() )
+  if ( adoptStateFd == -1 && ! createLockFile() )
   {
     if ( runAsDaemon ) {
       syslog(LOG_ERR, "Failed to create lock file %s\n", PID_LOCK_FILE);
@@ -525,52 +4192,180 @@ int main(int argc, char** args) {
     return 1;
   }
 
-  installSignalHandlers();
+  if ( ! blockSignals() || ! openEventLoop() )
+  {
+    if ( runAsDaemon ) {
+      syslog(LOG_ERR, "Failed to set up event loop: %s\n", strerror(errno));
+    } else {
+      printf("ERROR: Failed to set up event loop: %s\n", strerror(errno));
+    }
+    deleteLockFile();
+    return 1;
+  }
+
+  openStatusSegment();
+  openStateFile(stateFilePath);
+  openHistoryFile(historyFilePath);
 
   pthread_mutex_init(&deviceListMutex,NULL);
-  pthread_mutex_init(&sleep_mutex,NULL);
 
-  // setup timed_wait() to use CLOCK_MONOTONIC
-  // clock as the default CLOCK_REALTIME is prone to
-  // jumps as it may be adjusted by the user/NTPD etc.
-  pthread_condattr_t attr;
+  int adopted = adoptStateFd != -1 && adoptState(adoptStateFd);
+
+  notify_init("jabrac");
+  startNotificationThread();
 
-  pthread_condattr_init(&attr);
-  pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+  if ( splitMode )
+  {
+    startJobs = startHostPollJobs;
+    advanceJobs = advanceHostPollJobs;
+    // a host taken over on a hot restart just carries on
+    if ( ! hostPid && ! openSdkHost() ) {
+      if ( runAsDaemon ) {
+        syslog(LOG_ERR,"Failed to start SDK host: %s\n",strerror(errno));
+      } else {
+        printf("Failed to start SDK host: %s\n",strerror(errno));
+      }
+      return 1;
+    }
+  }
+  else
+  {
+    startPollWorkers();
+    initGuardedCalls();
 
-  pthread_cond_init(&sleep_condition, &attr);
+    runGuardedLibraryCall(SDK_SET_APP_ID,SDK_SETUP_TIMEOUT_MILLIS);
 
-  notify_init("jabrac");
+    // after a hot restart the SDK reports all devices again, the ones we adopted keep their state
+    if ( adopted ) {
+      sdkGeneration++;
+    }
+    if ( initializeLibrary(removeStaleDevices,deviceAttached,deviceRemoved) != Return_Ok ) {
+      if ( runAsDaemon ) {
+        syslog(LOG_ERR,"Failed to initialize library\n");
+      } else {
+        printf("Failed to initialize library\n");
+      }
+      return 1;
+    }
+    libraryInitialized = 1;
 
-  Jabra_SetAppID("fb56-2b8723b1-9b05-4b1c-a3b6-960b79b75f03");
-  
-  /*
-    void(*FirstScanForDevicesDoneFunc)(void),
-    void(*DeviceAttachedFunc)(Jabra_DeviceInfo deviceInfo),
-    void(*DeviceRemovedFunc)(unsigned short deviceID),
-    void(*ButtonInDataRawHidFunc)(unsigned short deviceID, unsigned short usagePage, unsigned short usage, bool buttonInData),
-    void(*ButtonInDataTranslatedFunc)(unsigned short deviceID, Jabra_HidInput translatedInData, bool buttonInData),
-  */
-  if ( ! Jabra_InitializeV2(0,deviceAttached,deviceRemoved,0,0,false,0) ) {
-    if ( runAsDaemon ) {
-      syslog(LOG_ERR,"Failed to initialize library\n");
-    } else {
-      printf("Failed to initialize library\n");
+    if ( useBatteryEvents ) {
+      registerBatteryCallback(batteryStatusChanged);
     }
-    return 1;
   }
-  libraryInitialized = 1;
 
-  showNotification("jabrac started");
+  if ( controlSocketFd == -1 ) {
+    openControlSocket();
+  }
+
+  if ( ! adopted ) {
+    showNotification("jabrac started");
+  }
+
+  wheelLastTick = monotonicSeconds();
+  jitterSeed = time(0) ^ getpid();
 
   int forcedWakeup = 0;
-  while( ! shutdown )
+  int pollDue = 1;
+  // timer disarmed, wake-ups count as idle ones
+  int loopIdle = 0;
+  struct epoll_event events[MAX_EVENTS];
+  while( ! shutdownRequested )
   {
-    inMainLoop=1;
-    checkBatteryStatus(forcedWakeup);
-    forcedWakeup = sleepInterruptibly(60);
+    if ( pollDue )
+    {
+      pollDue = 0;
+      growStateFile();
+      // the batch runs while we keep serving events, the last result (or the timer) gets us back here.
+      // Forced polls wait for the running batch, no batch starts while the SDK host is restarting
+      // or a hot restart is pending.
+      int waitMillis = advanceBatteryCheck();
+      if ( waitMillis < 0 && ! reexecRequested && ( ! splitMode || hostPid ) ) {
+        if ( startBatteryCheck(forcedWakeup) ) {
+          waitMillis = advanceBatteryCheck();
+        }
+        forcedWakeup = 0;
+      }
+
+      // devices attached while a batch is running show up right away as well
+      lockDeviceList();
+      publishSnapshotIfDirty();
+      int sleepSeconds = waitMillis >= 0 || ( splitMode && ! hostPid ) ? -1 : secondsUntilNextPoll( monotonicSeconds() );
+      unlockDeviceList();
+      reclaimSnapshots();
+
+      if ( waitMillis >= 0 ) {
+        loopIdle = 0;
+        armTimerMillis( timerFd, waitMillis );
+      } else {
+        // nothing to poll: sleep until a device gets attached, reports a battery event or somebody talks to us
+        loopIdle = sleepSeconds < 0;
+        armPollTimer( sleepSeconds );
+      }
+    }
+
+    // waits for the running batch, the new binary only gets the results that were merged
+    if ( reexecRequested && ! checkJobs ) {
+      reexecRequested = 0;
+      handOffState();
+      pollDue = 1;
+      continue;
+    }
+
+    int count = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+    if ( count < 0 && errno != EINTR ) {
+      syslog(LOG_ERR,"epoll_wait() failed: %s",strerror(errno));
+      finalReturnCode = 1;
+      break;
+    }
+    loopWakeups++;
+    if ( loopIdle ) {
+      for ( int i = 0 ; i < count ; i++ ) {
+        if ( events[i].data.u64 < EVENT_CONTROL_LISTENER ) {
+          idleWakeups++;
+          break;
+        }
+      }
+    }
+    for ( int i = 0 ; i < count ; i++ )
+    {
+      switch ( events[i].data.u64 ) {
+        case EVENT_TIMER:
+          drainEventSource(timerFd);
+          pollDue = 1;
+          break;
+        case EVENT_WAKEUP:
+          drainEventSource(wakeupFd);
+          if ( atomic_exchange(&forcedWakeupPending,0) ) {
+            forcedWakeup = 1;
+          }
+          pollDue = 1;
+          break;
+        case EVENT_SIGNAL:
+          handleSignals(&forcedWakeup);
+          // a reaped SDK host takes the running batch with it
+          pollDue = pollDue || forcedWakeup || checkJobs;
+          break;
+        case EVENT_SDK_HOST:
+          drainEventSource(hostEventFd);
+          drainHostEvents();
+          pollDue = pollDue || checkJobs;
+          break;
+        case EVENT_HOST_RESPAWN:
+          drainEventSource(hostRespawnFd);
+          if ( ! hostPid && ! shutdownRequested ) {
+            respawnSdkHost();
+          }
+          break;
+        case EVENT_CONTROL_LISTENER:
+          acceptControlClients();
+          break;
+        default:
+          handleControlClient(events[i].data.u64 - EVENT_CONTROL_CLIENT, events[i].events);
+          break;
+      }
+    }
   }
-  inMainLoop=0;
   if ( verbose ) {
     if ( runAsDaemon ) {
       syslog(LOG_INFO,"Program is terminating.\n");
@@ -578,6 +4373,15 @@ int main(int argc, char** args) {
       printf("Program is terminating.\n");
     }
   }
-  Jabra_Uninitialize();
+  if ( splitMode ) {
+    stopSdkHost();
+  } else {
+    runGuardedLibraryCall(SDK_UNINITIALIZE,SDK_UNINITIALIZE_TIMEOUT_MILLIS);
+  }
+  removeStatusSegment();
+  removeControlSocket();
+  deleteLockFile();
+  freeAllDevices();
   return finalReturnCode;
 }
+#endif
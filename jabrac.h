@@ -0,0 +1,123 @@
+#ifndef JABRAC_H
+#define JABRAC_H
+
+/*
+ * What the daemon's source files share. jabra.c owns the device list, the
+ * poll workers and the event loop, jabrastate.c and jabrahistory.c keep the
+ * persistent stores and jabrahost.c runs the SDK host of split mode.
+ */
+
+#include <Common.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <time.h>
+
+// number of distinct device IDs (deviceID is an unsigned short)
+#define DEVICE_ID_RANGE (USHRT_MAX+1)
+// device names longer than this get truncated in snapshots
+#define MAX_DEVICE_NAME_LENGTH 64
+#define MAX_SERIAL_LENGTH 32
+// max. number of extra battery units (earbuds, cradle...) kept per battery status
+#define MAX_EXTRA_UNITS 8
+
+// deadlines for SDK calls that don't talk to a single device
+#define SDK_INITIALIZE_TIMEOUT_MILLIS 60000
+#define SDK_UNINITIALIZE_TIMEOUT_MILLIS 5000
+#define SDK_SETUP_TIMEOUT_MILLIS 5000
+
+// capability bits, per device and cached per product ID
+// Jabra_GetSupportedFeatures() has been consulted
+#define CAP_FEATURES_PROBED 0x01
+// CAP_BATTERY is valid, learnt from battery queries since the SDK has no feature flag for it
+#define CAP_BATTERY_KNOWN   0x02
+#define CAP_BATTERY         0x04
+#define CAP_REMOTE_CONTROL  0x08
+
+// SDK functions we keep statistics for, see sdkFunctionNames
+typedef enum sdkfunction {
+    SDK_INITIALIZE,
+    SDK_UNINITIALIZE,
+    SDK_GET_BATTERY_STATUS,
+    SDK_GET_SUPPORTED_FEATURES,
+    SDK_GET_REMOTE_CONTROL_BATTERY_STATUS,
+    SDK_SET_APP_ID,
+    SDK_REGISTER_BATTERY_CALLBACK,
+    SDK_FUNCTION_COUNT
+} sdkfunction;
+
+// identifies a device across a window where the device list is not locked,
+// a device that got detached and re-attached under the same ID in between won't match
+typedef struct devicehandle {
+    unsigned short deviceID;
+    uint32_t generation;
+} devicehandle;
+
+typedef enum pollstate {
+    POLL_PENDING,
+    POLL_RUNNING,
+    POLL_DONE,
+    POLL_TIMED_OUT
+} pollstate;
+
+// one battery query handed to the worker pool
+typedef struct polljob {
+    devicehandle handle;
+    pollstate state;
+    // also query the battery of the device's remote control
+    uint8_t remoteControl;
+    // ask for the device's features first, the CAP_* bits found end up in 'capabilities'
+    uint8_t probe;
+    uint8_t capabilities;
+    struct timespec startedAt;
+    Jabra_ReturnCode rc;
+    // only valid if rc == Return_Ok, extraUnits points into 'units'
+    Jabra_BatteryStatus batteryStatus;
+    Jabra_BatteryStatusUnit units[MAX_EXTRA_UNITS];
+} polljob;
+
+// what an epoll event belongs to, control clients are tagged EVENT_CONTROL_CLIENT + their index
+enum { EVENT_TIMER, EVENT_WAKEUP, EVENT_SIGNAL, EVENT_SDK_HOST, EVENT_HOST_RESPAWN, EVENT_CONTROL_LISTENER, EVENT_CONTROL_CLIENT };
+
+extern int verbose;
+extern int runAsDaemon;
+extern int useBatteryEvents;
+extern int splitMode;
+extern volatile int shutdownRequested;
+extern int signalFd;
+extern int pollWorkerCount;
+extern int pollTimeoutMillis;
+extern pthread_mutex_t deviceListMutex;
+extern int snapshotDirty;
+extern uint32_t sdkGeneration;
+extern atomic_uchar deviceStuckCalls[DEVICE_ID_RANGE];
+
+void lockDeviceList();
+void unlockDeviceList();
+void wakeup(int forced);
+long millisSince(struct timespec *start, struct timespec *now);
+int makeDirectories(char *path);
+int defaultStateFilePath(char *buffer, size_t bufferSize, const char *fileName);
+
+int watchEventSource(int fd, uint64_t tag);
+void armTimerMillis(int fd, long millis);
+void drainEventSource(int fd);
+int blockSignals();
+void handleSignals(int *forcedWakeup);
+
+void startPollWorkers();
+void runPollJobs(polljob *jobs, int count);
+void initGuardedCalls();
+Jabra_ReturnCode runGuardedLibraryCall(sdkfunction function, int timeoutMillis);
+Jabra_ReturnCode initializeLibrary(void (*firstScanDone)(void), void (*attached)(Jabra_DeviceInfo deviceInfo), void (*removed)(unsigned short deviceID));
+void registerBatteryCallback(void (*callback)(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus));
+void copyBatteryStatus(const Jabra_BatteryStatus *from, Jabra_BatteryStatus *to, Jabra_BatteryStatusUnit *units);
+uint8_t capabilitiesOf(Jabra_DeviceInfo *info);
+
+void addDevice(Jabra_DeviceInfo* info, uint8_t capabilities);
+void delDevice(unsigned short deviceID);
+void removeStaleDevices();
+void batteryStatusReported(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus);
+
+#endif
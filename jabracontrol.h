@@ -0,0 +1,52 @@
+#ifndef JABRACONTROL_H
+#define JABRACONTROL_H
+
+/*
+ * Control socket protocol shared by jabrac and jabractl.
+ *
+ * The daemon listens on a Unix stream socket (see jabracontrol_socket_path()).
+ * Clients send one command per line and get exactly one line back, always a
+ * JSON object. Errors look like {"error":"<message>"}. Commands:
+ *
+ *   status              all attached devices, served from the latest snapshot
+ *   status <id>         a single device
+ *   refresh <id>        poll a device right away and notify about its state
+ *   interval <seconds>  change the base polling interval
+ *   metrics             notification queue and snapshot metrics
+ *   history <id> [n]    the device's n (default 60) most recent battery samples,
+ *                       oldest first, as [unix time, level, charging]
+ *   health [n]          the n (default 20) serial numbers in the persistent store whose
+ *                       batteries lost the most capacity, worst first, with
+ *                       "health" (capacity left in percent of the baseline) and
+ *                       "cycles" (equivalent full charge cycles)
+ *   reexec              hot restart, the daemon replies and then execs its binary
+ *                       again, which closes the connection
+ *
+ * Devices with a battery status carry "minutes_to_empty" (or "minutes_to_full"
+ * while charging) once the daemon has seen enough samples to predict it, and
+ * the same per BatteryComponent under "estimates". Devices with a serial number
+ * carry "cycles" and, once measured, "health" (see the health command).
+ *
+ * Device IDs are given in hex, the same way the daemon logs them.
+ * A connection can be kept open for any number of commands.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// longest command line the daemon accepts, including the newline
+#define JABRA_CONTROL_MAX_COMMAND_LENGTH 256
+
+// writes the default socket path for the current user
+static inline void jabracontrol_socket_path(char *buffer, size_t bufferSize)
+{
+    const char *runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if ( runtimeDir && runtimeDir[0] ) {
+        snprintf(buffer,bufferSize,"%s/jabrac.sock",runtimeDir);
+    } else {
+        snprintf(buffer,bufferSize,"/tmp/jabrac-%u.sock",(unsigned int) getuid());
+    }
+}
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Command line client for the jabrac control socket, see jabracontrol.h
+ * for the protocol.
+ *
+ * Usage: jabractl [-s|--socket <path>] <command> [argument]
+ *
+ * Prints the daemon's reply (a single JSON object) to stdout and exits
+ * with status 1 if the daemon reported an error.
+ */
+#include "jabracontrol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static void usage(const char *program)
+{
+    fprintf(stderr,"Usage: %s [-s|--socket <path>] <command> [argument]\n"
+                   "Commands: status [device id] | refresh <device id> | interval <seconds> | metrics | history <device id> [count] | health [count] | reexec\n",program);
+}
+
+int main(int argc, char **argv)
+{
+    char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+    jabracontrol_socket_path(path,sizeof(path));
+
+    int i = 1;
+    if ( i < argc && ( strcmp(argv[i],"-s") == 0 || strcmp(argv[i],"--socket") == 0 ) ) {
+        if ( i+1 >= argc ) {
+            usage(argv[0]);
+            return 2;
+        }
+        snprintf(path,sizeof(path),"%s",argv[i+1]);
+        i += 2;
+    }
+    if ( i >= argc || strcmp(argv[i],"-h") == 0 || strcmp(argv[i],"--help") == 0 ) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    char command[JABRA_CONTROL_MAX_COMMAND_LENGTH];
+    size_t length = 0;
+    for ( ; i < argc ; i++ ) {
+        int written = snprintf(command+length,sizeof(command)-length,"%s%s",length ? " " : "",argv[i]);
+        if ( written < 0 || (size_t) written >= sizeof(command)-length-1 ) {
+            fprintf(stderr,"Command too long\n");
+            return 2;
+        }
+        length += written;
+    }
+    command[length++] = '\n';
+
+    int fd = socket(AF_UNIX,SOCK_STREAM,0);
+    struct sockaddr_un address;
+    memset(&address,0,sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path,path,sizeof(address.sun_path)-1);
+    if ( fd < 0 || connect(fd,(struct sockaddr*) &address,sizeof(address)) != 0 ) {
+        fprintf(stderr,"Failed to connect to %s: %s\n",path,strerror(errno));
+        return 1;
+    }
+
+    for ( size_t sent = 0 ; sent < length ; ) {
+        ssize_t count = write(fd,command+sent,length-sent);
+        if ( count < 0 ) {
+            fprintf(stderr,"Failed to send command: %s\n",strerror(errno));
+            return 1;
+        }
+        sent += count;
+    }
+
+    // the reply is a single line, copy it through until the newline
+    char buffer[4096];
+    int first = 1;
+    int isError = 0;
+    for (;;)
+    {
+        ssize_t count = read(fd,buffer,sizeof(buffer));
+        if ( count <= 0 ) {
+            fprintf(stderr,"Connection closed before the reply was complete\n");
+            return 1;
+        }
+        if ( first ) {
+            isError = strncmp(buffer,"{\"error\"",count < 8 ? count : 8) == 0;
+            first = 0;
+        }
+        fwrite(buffer,1,count,stdout);
+        if ( buffer[count-1] == '\n' ) {
+            break;
+        }
+    }
+    close(fd);
+    return isError ? 1 : 0;
+}
@@ -0,0 +1,408 @@
+#define _GNU_SOURCE
+#include "jabrahistory.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// where a serial number's stream left off, the next sample gets encoded relative to it
+typedef struct historytail {
+    int64_t time;
+    int64_t delta;
+    uint8_t level;
+    uint8_t charging;
+    // the last sample repeated the one before, the next repeat starts a run
+    uint8_t repeated;
+    // payload offset + 1 of the run token repeats get added to, 0 if the last sample wasn't part of a run
+    uint16_t runAt;
+} historytail;
+// memory-mapped battery sample history, NULL if not available. Protected by deviceListMutex.
+historyfile *historyFile;
+static int historyFd = -1;
+// chunks the file currently has room for
+static uint32_t historyCapacity;
+// derived from the last chunk of every series when opening the file, so a crash can't make them disagree
+static historytail historyTails[HISTORY_MAX_SERIES];
+// set once the file stopped growing and the oldest chunks get reused
+static int historyFull;
+// a decoded chunk, protected by deviceListMutex as well
+static historysample historySamples[HISTORY_CHUNK_MAX_SAMPLES];
+// bumped whenever reuseOldestHistoryChunk() hands out a chunk, tells scanHistory() a chain might have changed
+static uint64_t historyChunksReused;
+
+static historychunk *historyChunk(uint32_t index)
+{
+    return (historychunk*) ((char*) historyFile + HISTORY_HEADER_SIZE) + index;
+}
+
+static uint8_t *putVarint(uint8_t *out, uint64_t value)
+{
+    while ( value >= 0x80 ) {
+        *out++ = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+static const uint8_t *getVarint(const uint8_t *in, const uint8_t *end, uint64_t *value)
+{
+    uint64_t result = 0;
+    for ( int shift = 0 ; in < end && shift < 64 ; shift += 7 ) {
+        uint8_t byte = *in++;
+        result |= (uint64_t) (byte & 0x7f) << shift;
+        if ( ! (byte & 0x80) ) {
+            *value = result;
+            return in;
+        }
+    }
+    *value = 0;
+    return end;
+}
+
+static uint64_t zigzag(int64_t value)
+{
+    return ((uint64_t) value << 1) ^ (uint64_t) (value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value)
+{
+    return (int64_t) (value >> 1) ^ -(int64_t) (value & 1);
+}
+
+// decodes a chunk into 'samples' (room for HISTORY_CHUNK_MAX_SAMPLES samples), returns the number decoded.
+// 'tail' (may be NULL) ends up describing the last one.
+static int decodeHistoryChunk(const historychunk *chunk, historysample *samples, historytail *tail)
+{
+    historytail state = { chunk->firstTime, 0, chunk->firstLevel, chunk->firstCharging, 0, 0 };
+    int count = 0;
+    samples[count++] = (historysample) { state.time, state.level, state.charging };
+
+    uint16_t length = __atomic_load_n(&chunk->length,__ATOMIC_ACQUIRE);
+    const uint8_t *in = chunk->payload;
+    const uint8_t *end = chunk->payload + (length < sizeof(chunk->payload) ? length : sizeof(chunk->payload));
+    int sampleCount = chunk->sampleCount < HISTORY_CHUNK_MAX_SAMPLES ? chunk->sampleCount : HISTORY_CHUNK_MAX_SAMPLES;
+    while ( in < end && count < sampleCount )
+    {
+        uint64_t token, levelDelta = 0;
+        if ( *in < 0x80 ) {
+            // the common case, a single byte
+            token = *in++;
+        } else {
+            in = getVarint(in,end,&token);
+        }
+        if ( token & 1 ) {
+            for ( uint64_t repeats = token >> 1 ; repeats > 0 && count < sampleCount ; repeats-- ) {
+                state.time += state.delta;
+                samples[count].time = state.time;
+                samples[count].level = state.level;
+                samples[count].charging = state.charging;
+                count++;
+            }
+            continue;
+        }
+        if ( token & 2 ) {
+            in = getVarint(in,end,&levelDelta);
+        }
+        state.delta += unzigzag(token >> 3);
+        state.time += state.delta;
+        state.level += unzigzag(levelDelta);
+        state.charging = (token >> 2) & 1;
+        samples[count].time = state.time;
+        samples[count].level = state.level;
+        samples[count].charging = state.charging;
+        count++;
+    }
+    // a run left open before a restart stays as it is, the next repeat starts a new one
+    if ( tail ) {
+        *tail = state;
+    }
+    return count;
+}
+
+// visits all samples of a series in chronological order, a chunk at a time. Only locks the device list
+// while copying a chunk, which the caller must not hold.
+uint64_t scanHistory(int series, void (*visit)(void *context, const historysample *samples, int count), void *context)
+{
+    historysample *samples = malloc(HISTORY_CHUNK_MAX_SAMPLES*sizeof(historysample));
+    if ( ! samples ) {
+        return 0;
+    }
+    uint64_t total = 0;
+    historychunk chunk;
+    // first time of the newest chunk visited so far
+    int64_t visitedUpTo = INT64_MIN;
+    uint64_t reused = 0;
+
+    lockDeviceList();
+    uint32_t index = HISTORY_NO_CHUNK;
+    if ( historyFile && series >= 0 && series < HISTORY_MAX_SERIES && historyFile->series[series].serial[0] ) {
+        index = historyFile->series[series].firstChunk;
+        reused = historyChunksReused;
+    }
+    // 'hops' guards against a chain that a damaged file turned into a loop
+    uint32_t hops = 0;
+    while ( index != HISTORY_NO_CHUNK && index < historyFile->chunkCount && hops++ < historyFile->chunkCount )
+    {
+        if ( historyChunksReused != reused ) {
+            // the chunk we were about to visit may belong to another series by now, pick up where we left off
+            reused = historyChunksReused;
+            index = historyFile->series[series].firstChunk;
+            for ( uint32_t skipped = 0 ; index < historyFile->chunkCount && skipped < historyFile->chunkCount &&
+                  historyChunk(index)->firstTime <= visitedUpTo ; skipped++ ) {
+                index = historyChunk(index)->next;
+            }
+            continue;
+        }
+        chunk = *historyChunk(index);
+        unlockDeviceList();
+
+        int count = decodeHistoryChunk(&chunk,samples,0);
+        visit(context,samples,count);
+        total += count;
+        visitedUpTo = chunk.firstTime;
+
+        lockDeviceList();
+        index = chunk.next;
+    }
+    unlockDeviceList();
+    free(samples);
+    return total;
+}
+
+// returns the series for 'serial', creating it if there is room. -1 if there is none.
+// device list must be locked by caller
+int findHistorySeries(const char *serial, int create)
+{
+    for ( uint32_t i = 0 ; i < historyFile->seriesCount ; i++ ) {
+        if ( strncmp(historyFile->series[i].serial,serial,MAX_SERIAL_LENGTH) == 0 ) {
+            return i;
+        }
+    }
+    if ( ! create || historyFile->seriesCount == HISTORY_MAX_SERIES ) {
+        return -1;
+    }
+    historyseries *series = &historyFile->series[historyFile->seriesCount];
+    series->firstChunk = series->lastChunk = HISTORY_NO_CHUNK;
+    series->sampleCount = 0;
+    snprintf(series->serial,sizeof(series->serial),"%s",serial);
+    return historyFile->seriesCount++;
+}
+
+// takes the oldest chunk of the series whose history goes back furthest, every series keeps its last chunk.
+// HISTORY_NO_CHUNK if no series has more than one. device list must be locked by caller
+static uint32_t reuseOldestHistoryChunk()
+{
+    historyseries *oldest = 0;
+    for ( uint32_t i = 0 ; i < historyFile->seriesCount ; i++ ) {
+        historyseries *series = &historyFile->series[i];
+        if ( series->firstChunk < historyFile->chunkCount && series->firstChunk != series->lastChunk &&
+             ( ! oldest || historyChunk(series->firstChunk)->firstTime < historyChunk(oldest->firstChunk)->firstTime ) ) {
+            oldest = series;
+        }
+    }
+    if ( ! oldest ) {
+        return HISTORY_NO_CHUNK;
+    }
+    // unlinked before it gets reused, a crash in between leaves an unused chunk rather than a broken chain
+    uint32_t index = oldest->firstChunk;
+    historychunk *chunk = historyChunk(index);
+    oldest->sampleCount -= chunk->sampleCount < oldest->sampleCount ? chunk->sampleCount : oldest->sampleCount;
+    oldest->firstChunk = chunk->next;
+    historyChunksReused++;
+    return index;
+}
+
+// hands out a fresh chunk starting with the given sample, HISTORY_NO_CHUNK if there is none.
+// device list must be locked by caller
+static uint32_t allocateHistoryChunk(int series, int64_t time, uint8_t level, uint8_t charging)
+{
+    uint32_t index = HISTORY_NO_CHUNK;
+    if ( historyFile->chunkCount == historyCapacity && ! historyFull )
+    {
+        uint32_t capacity = historyCapacity + HISTORY_GROW_CHUNKS;
+        size_t oldSize = HISTORY_HEADER_SIZE + (size_t) historyCapacity * sizeof(historychunk);
+        size_t newSize = HISTORY_HEADER_SIZE + (size_t) capacity * sizeof(historychunk);
+        void *mapped = MAP_FAILED;
+        if ( capacity <= HISTORY_MAX_CHUNKS && ftruncate(historyFd,newSize) == 0 ) {
+            mapped = mremap(historyFile,oldSize,newSize,MREMAP_MAYMOVE);
+        }
+        if ( mapped == MAP_FAILED ) {
+            syslog(LOG_WARNING,"Battery history can't grow beyond %u chunks, dropping the oldest samples from now on",historyCapacity);
+            historyFull = 1;
+        } else {
+            historyFile = mapped;
+            historyCapacity = capacity;
+        }
+    }
+    if ( historyFile->chunkCount < historyCapacity ) {
+        // claimed before it gets linked, a crash in between leaves an unused chunk rather than a broken chain
+        index = historyFile->chunkCount++;
+    } else {
+        index = reuseOldestHistoryChunk();
+        if ( index == HISTORY_NO_CHUNK ) {
+            return HISTORY_NO_CHUNK;
+        }
+    }
+
+    historychunk *chunk = historyChunk(index);
+    memset(chunk,0,sizeof(historychunk));
+    chunk->next = HISTORY_NO_CHUNK;
+    chunk->series = series;
+    chunk->firstTime = time;
+    chunk->firstLevel = level;
+    chunk->firstCharging = charging;
+    chunk->sampleCount = 1;
+
+    historyseries *header = &historyFile->series[series];
+    if ( header->lastChunk == HISTORY_NO_CHUNK ) {
+        header->firstChunk = index;
+    } else {
+        historyChunk(header->lastChunk)->next = index;
+    }
+    header->lastChunk = index;
+    historyTails[series] = (historytail) { time, 0, level, charging, 0, 0 };
+    return index;
+}
+
+// appends a battery sample to the history of 'serial', none without one. '*cachedSeries' is the series + 1,
+// 0 until the first sample got recorded. device list must be locked by caller
+void recordHistorySample(const char *serial, uint16_t *cachedSeries, int64_t time, uint8_t level, uint8_t charging)
+{
+    if ( ! historyFile || ! serial[0] ) {
+        return;
+    }
+    if ( ! *cachedSeries ) {
+        int series = findHistorySeries(serial,1);
+        if ( series < 0 ) {
+            return;
+        }
+        *cachedSeries = series+1;
+    }
+    int series = *cachedSeries-1;
+    historyseries *header = &historyFile->series[series];
+
+    if ( header->lastChunk != HISTORY_NO_CHUNK && historyChunk(header->lastChunk)->sampleCount < HISTORY_CHUNK_MAX_SAMPLES )
+    {
+        historychunk *chunk = historyChunk(header->lastChunk);
+        historytail *tail = &historyTails[series];
+        int64_t delta = time - tail->time;
+        int64_t levelDelta = (int64_t) level - tail->level;
+        int repeat = delta == tail->delta && levelDelta == 0 && (charging ? 1 : 0) == tail->charging;
+
+        // another repeat for the open run, counted before the run token so a crash in between loses it rather than invents one
+        if ( tail->runAt && repeat && (chunk->payload[tail->runAt-1] >> 1) < HISTORY_MAX_RUN ) {
+            chunk->sampleCount++;
+            __atomic_store_n(&chunk->payload[tail->runAt-1],(uint8_t) (chunk->payload[tail->runAt-1] + 2),__ATOMIC_RELEASE);
+            tail->time = time;
+            header->sampleCount++;
+            return;
+        }
+        // two varints of at most 10 bytes each
+        if ( chunk->length + 20 <= sizeof(chunk->payload) )
+        {
+            uint8_t *out = chunk->payload + chunk->length;
+            // a single repeat costs a byte either way, runs only pay off (and are worth a branch when decoding) from the second one
+            if ( repeat && tail->repeated ) {
+                *out++ = 1 << 1 | 1;
+                tail->runAt = out - chunk->payload;
+            } else {
+                out = putVarint(out, zigzag(delta - tail->delta) << 3 | (charging ? 4 : 0) | (levelDelta != 0 ? 2 : 0));
+                if ( levelDelta != 0 ) {
+                    out = putVarint(out, zigzag(levelDelta));
+                }
+                tail->runAt = 0;
+            }
+            chunk->sampleCount++;
+            __atomic_store_n(&chunk->length,(uint16_t) (out - chunk->payload),__ATOMIC_RELEASE);
+            tail->repeated = repeat;
+            tail->time = time;
+            tail->delta = delta;
+            tail->level = level;
+            tail->charging = charging ? 1 : 0;
+            header->sampleCount++;
+            return;
+        }
+    }
+    // the file might have moved while growing
+    if ( allocateHistoryChunk(series,time,level,charging ? 1 : 0) != HISTORY_NO_CHUNK ) {
+        historyFile->series[series].sampleCount++;
+    }
+}
+
+void openHistoryFile(const char *location)
+{
+    char path[PATH_MAX];
+    if ( location ) {
+        snprintf(path,sizeof(path),"%s",location);
+    } else if ( ! defaultStateFilePath(path,sizeof(path),HISTORY_FILE_NAME) ) {
+        return;
+    }
+    if ( ! makeDirectories(path) ) {
+        syslog(LOG_ERR,"Failed to create directory for history file %s: %s",path,strerror(errno));
+        return;
+    }
+
+    int fd = open(path, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+    if ( fd < 0 ) {
+        syslog(LOG_ERR,"Failed to open history file %s: %s",path,strerror(errno));
+        return;
+    }
+    struct stat st;
+    if ( fstat(fd,&st) != 0 || st.st_size < (off_t) HISTORY_HEADER_SIZE ) {
+        st.st_size = 0;
+    }
+    uint32_t capacity = st.st_size ? (st.st_size - HISTORY_HEADER_SIZE) / sizeof(historychunk) : 0;
+    size_t size = HISTORY_HEADER_SIZE + (size_t) capacity * sizeof(historychunk);
+    if ( (off_t) size != st.st_size && ftruncate(fd,size) != 0 ) {
+        syslog(LOG_ERR,"Failed to size history file %s: %s",path,strerror(errno));
+        close(fd);
+        return;
+    }
+    historyfile *mapped = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if ( mapped == MAP_FAILED ) {
+        syslog(LOG_ERR,"Failed to map history file %s: %s",path,strerror(errno));
+        close(fd);
+        return;
+    }
+
+    if ( mapped->magic != HISTORY_FILE_MAGIC || mapped->version != HISTORY_FILE_VERSION || mapped->chunkSize != sizeof(historychunk) ||
+         mapped->maxSeries != HISTORY_MAX_SERIES || mapped->chunkCount > capacity || mapped->seriesCount > HISTORY_MAX_SERIES )
+    {
+        if ( st.st_size ) {
+            syslog(LOG_WARNING,"History file %s has an unsupported format, starting from scratch",path);
+        }
+        memset(mapped,0,HISTORY_HEADER_SIZE);
+        mapped->magic = HISTORY_FILE_MAGIC;
+        mapped->version = HISTORY_FILE_VERSION;
+        mapped->chunkSize = sizeof(historychunk);
+        mapped->maxSeries = HISTORY_MAX_SERIES;
+    }
+    historyFile = mapped;
+    historyFd = fd;
+    historyCapacity = capacity;
+
+    for ( uint32_t i = 0 ; i < historyFile->seriesCount ; i++ ) {
+        historyseries *series = &historyFile->series[i];
+        if ( series->lastChunk < historyFile->chunkCount ) {
+            decodeHistoryChunk(historyChunk(series->lastChunk),historySamples,&historyTails[i]);
+        } else {
+            series->firstChunk = series->lastChunk = HISTORY_NO_CHUNK;
+        }
+    }
+}
+
+void closeHistoryFile()
+{
+    if ( historyFile ) {
+        munmap(historyFile, HISTORY_HEADER_SIZE + (size_t) historyCapacity * sizeof(historychunk));
+        close(historyFd);
+        historyFile = 0;
+        historyFd = -1;
+    }
+}
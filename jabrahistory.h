@@ -0,0 +1,84 @@
+#ifndef JABRAHISTORY_H
+#define JABRAHISTORY_H
+
+/*
+ * Battery sample history, a memory-mapped file next to the state file holding
+ * a chain of delta-encoded chunks per serial number. Protected by the device
+ * list lock, scanHistory() takes it itself.
+ */
+
+#include "jabrac.h"
+
+#define HISTORY_FILE_NAME "history"
+#define HISTORY_FILE_MAGIC 0x5354424a /* "JBTS" */
+#define HISTORY_FILE_VERSION 2
+// max. number of serial numbers with a history, samples of further ones don't get recorded
+#define HISTORY_MAX_SERIES 1024
+// chunks decode on their own
+#define HISTORY_CHUNK_SIZE 512
+// bounds what decoding a chunk full of runs takes
+#define HISTORY_CHUNK_MAX_SAMPLES 8192
+// keeps a run token a single byte
+#define HISTORY_MAX_RUN 63
+// beyond HISTORY_MAX_CHUNKS (512 MB) the oldest chunks get reused
+#define HISTORY_GROW_CHUNKS 128
+#define HISTORY_MAX_CHUNKS (1 << 20)
+#define HISTORY_NO_CHUNK UINT32_MAX
+
+// The first sample is kept in the header, every further one is a varint of zigzag(change of the time delta)
+// << 3 | charging << 2 | level changed << 1, followed by a varint of zigzag(level delta) if the level changed.
+// A byte of count << 1 | 1 repeats the previous sample's time delta, level and charging state 'count' times.
+typedef struct historychunk {
+    // next chunk of the same serial number, HISTORY_NO_CHUNK if this is the last one
+    uint32_t next;
+    uint16_t series;
+    // payload bytes in use, bumped after the bytes got written
+    uint16_t length;
+    // wall clock seconds
+    int64_t firstTime;
+    uint32_t sampleCount;
+    uint8_t firstLevel;
+    uint8_t firstCharging;
+    uint8_t reserved[2];
+    uint8_t payload[HISTORY_CHUNK_SIZE - 24];
+} historychunk;
+
+typedef struct historyseries {
+    // empty if the slot is unused
+    char serial[MAX_SERIAL_LENGTH];
+    uint32_t firstChunk;
+    uint32_t lastChunk;
+    uint64_t sampleCount;
+} historyseries;
+
+// header of the history file, the chunks start at HISTORY_HEADER_SIZE
+typedef struct historyfile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t chunkSize;
+    uint32_t maxSeries;
+    // chunks handed out so far, the file is at least that large
+    uint32_t chunkCount;
+    uint32_t seriesCount;
+    historyseries series[HISTORY_MAX_SERIES];
+} historyfile;
+
+#define HISTORY_HEADER_SIZE ((sizeof(historyfile) + 4095) & ~(size_t) 4095)
+
+typedef struct historysample {
+    int64_t time;
+    uint8_t level;
+    uint8_t charging;
+} historysample;
+
+// NULL if there is none
+extern historyfile *historyFile;
+
+// 'path' is NULL for the default location
+void openHistoryFile(const char *path);
+void closeHistoryFile();
+int findHistorySeries(const char *serial, int create);
+void recordHistorySample(const char *serial, uint16_t *cachedSeries, int64_t time, uint8_t level, uint8_t charging);
+uint64_t scanHistory(int series, void (*visit)(void *context, const historysample *samples, int count), void *context);
+
+#endif
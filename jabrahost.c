@@ -0,0 +1,571 @@
+#define _GNU_SOURCE
+#include "jabrahost.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+
+// shared with the SDK host, NULL when not in split mode
+static hostsegment *hostSegment;
+int hostSegmentFd = -1;
+// eventfd doorbells, written to after pushing messages into the events and requests ring respectively
+int hostEventFd = -1;
+int hostRequestFd = -1;
+pid_t hostPid;
+int hostRespawnFd = -1;
+uint64_t hostRestarts;
+uint64_t hostMessages;
+static struct timespec hostStartedAt;
+// daemon side: poll batch waiting for results from the SDK host, only touched by the main loop
+static polljob *hostPollJobs;
+static int hostPollCount;
+static int hostPollNext;
+static int hostPollFinished;
+// the SDK host the batch went to
+static pid_t hostPollPid;
+uint32_t hostPollBatch;
+static struct timespec hostPollProgressAt;
+// SDK host side: SDK callbacks come from several threads, the events ring takes one producer at a time
+static pthread_mutex_t hostEventMutex = PTHREAD_MUTEX_INITIALIZER;
+static pid_t hostParentPid;
+
+static int ringPush(hostring *ring, const hostmessage *message)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if ( head - atomic_load_explicit(&ring->tail, memory_order_acquire) == HOST_RING_SLOTS ) {
+        return 0;
+    }
+    ring->slots[head & (HOST_RING_SLOTS-1)] = *message;
+    atomic_store_explicit(&ring->head, head+1, memory_order_release);
+    return 1;
+}
+
+static int ringPop(hostring *ring, hostmessage *message)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if ( tail == atomic_load_explicit(&ring->head, memory_order_acquire) ) {
+        return 0;
+    }
+    *message = ring->slots[tail & (HOST_RING_SLOTS-1)];
+    atomic_store_explicit(&ring->tail, tail+1, memory_order_release);
+    return 1;
+}
+
+static void ringDoorbell(int fd)
+{
+    uint64_t one = 1;
+    // EAGAIN means the counter is about to overflow, the other side has plenty to wake up for then
+    if ( write(fd,&one,sizeof(one)) < 0 && errno != EAGAIN ) {
+        syslog(LOG_ERR,"Failed to ring doorbell: %s",strerror(errno));
+    }
+}
+
+// SDK host: queues a message for the daemon without ringing the doorbell, waits while the ring is full
+static void pushHostEvent(hostmessage *message)
+{
+    pthread_mutex_lock(&hostEventMutex);
+    while ( ! ringPush(&hostSegment->events,message) ) {
+        // the daemon drains the ring as soon as it hears of it, unless it's gone
+        if ( getppid() != hostParentPid ) {
+            _exit(EXIT_FAILURE);
+        }
+        ringDoorbell(hostEventFd);
+        usleep(1000);
+    }
+    pthread_mutex_unlock(&hostEventMutex);
+}
+
+static void sendHostEvent(hostmessage *message)
+{
+    pushHostEvent(message);
+    ringDoorbell(hostEventFd);
+}
+
+static void hostScanDone()
+{
+    hostmessage message;
+    memset(&message,0,sizeof(message));
+    message.type = HOST_SCAN_DONE;
+    sendHostEvent(&message);
+}
+
+static void hostDeviceAttached(Jabra_DeviceInfo deviceInfo)
+{
+    uint8_t capabilities = capabilitiesOf(&deviceInfo);
+
+    hostmessage message;
+    memset(&message,0,sizeof(message));
+    message.type = HOST_ATTACHED;
+    message.deviceID = deviceInfo.deviceID;
+    message.productID = deviceInfo.productID;
+    message.isDongle = deviceInfo.isDongle;
+    message.capabilities = capabilities;
+    if ( deviceInfo.deviceName ) {
+        strncpy(message.name,deviceInfo.deviceName,sizeof(message.name)-1);
+    }
+    if ( deviceInfo.serialNumber ) {
+        strncpy(message.serial,deviceInfo.serialNumber,sizeof(message.serial)-1);
+    }
+    Jabra_FreeDeviceInfo(deviceInfo);
+    sendHostEvent(&message);
+}
+
+static void hostDeviceRemoved(unsigned short deviceID)
+{
+    hostmessage message;
+    memset(&message,0,sizeof(message));
+    message.type = HOST_REMOVED;
+    message.deviceID = deviceID;
+    sendHostEvent(&message);
+}
+
+static void hostBatteryStatusChanged(unsigned short deviceID, Jabra_BatteryStatus *batteryStatus)
+{
+    if ( ! batteryStatus ) {
+        return;
+    }
+    hostmessage message;
+    memset(&message,0,sizeof(message));
+    message.type = HOST_BATTERY_EVENT;
+    message.deviceID = deviceID;
+    message.rc = Return_Ok;
+    copyBatteryStatus(batteryStatus,&message.batteryStatus,message.units);
+    Jabra_FreeBatteryStatus(batteryStatus);
+    sendHostEvent(&message);
+}
+
+// SDK host: answers poll requests on the worker pool until told to stop
+static void serveHostRequests()
+{
+    int chunkSize = pollWorkerCount * HOST_POLL_WAVES;
+    polljob *jobs = calloc(chunkSize,sizeof(polljob));
+    hostmessage *requests = calloc(chunkSize,sizeof(hostmessage));
+    if ( ! jobs || ! requests ) {
+        syslog(LOG_ERR,"SDK host: out of memory");
+        free(jobs);
+        free(requests);
+        return;
+    }
+
+    hostmessage result;
+    int forcedWakeup = 0;
+    struct pollfd fds[2] = { { hostRequestFd, POLLIN, 0 }, { signalFd, POLLIN, 0 } };
+    while ( ! shutdownRequested )
+    {
+        int count = 0;
+        while ( count < chunkSize && ringPop(&hostSegment->requests,&requests[count]) ) {
+            jobs[count].handle.deviceID = requests[count].deviceID;
+            jobs[count].handle.generation = 0;
+            jobs[count].remoteControl = (requests[count].capabilities & CAP_REMOTE_CONTROL) != 0;
+            jobs[count].probe = ! (requests[count].capabilities & CAP_FEATURES_PROBED);
+            jobs[count].capabilities = 0;
+            jobs[count].state = POLL_PENDING;
+            jobs[count].rc = Return_Ok;
+            count++;
+        }
+
+        if ( count > 0 )
+        {
+            runPollJobs(jobs,count);
+            for ( int i = 0 ; i < count ; i++ )
+            {
+                memset(&result,0,sizeof(result));
+                result.type = HOST_POLL_RESULT;
+                result.deviceID = requests[i].deviceID;
+                result.batch = requests[i].batch;
+                result.job = requests[i].job;
+                result.rc = jobs[i].rc;
+                result.capabilities = jobs[i].capabilities;
+                result.stuckCalls = atomic_load(&deviceStuckCalls[requests[i].deviceID]);
+                if ( jobs[i].state == POLL_DONE && jobs[i].rc == Return_Ok ) {
+                    copyBatteryStatus(&jobs[i].batteryStatus,&result.batteryStatus,result.units);
+                }
+                pushHostEvent(&result);
+            }
+            ringDoorbell(hostEventFd);
+            continue;
+        }
+
+        if ( poll(fds,2,-1) < 0 && errno != EINTR ) {
+            syslog(LOG_ERR,"SDK host: poll() failed: %s",strerror(errno));
+            break;
+        }
+        if ( fds[0].revents ) {
+            drainEventSource(hostRequestFd);
+        }
+        if ( fds[1].revents ) {
+            handleSignals(&forcedWakeup);
+        }
+    }
+    free(jobs);
+    free(requests);
+}
+
+// main() of the SDK host, exits on SIGTERM which it also gets when the daemon dies
+int runSdkHost()
+{
+    // started through /proc/self/exe, which would make it show up as "exe"
+    prctl(PR_SET_NAME, "jabrac-sdk-host");
+    if ( runAsDaemon ) {
+        openlog("jabrac-sdk-host", LOG_PID, LOG_DAEMON);
+    }
+
+    hostsegment *segment = mmap(0, sizeof(hostsegment), PROT_READ | PROT_WRITE, MAP_SHARED, hostSegmentFd, 0);
+    if ( segment == MAP_FAILED || segment->magic != HOST_SEGMENT_MAGIC || segment->version != HOST_SEGMENT_VERSION ) {
+        syslog(LOG_ERR,"SDK host: shared memory segment is not usable");
+        return 1;
+    }
+    hostSegment = segment;
+    hostParentPid = getppid();
+
+    if ( ! blockSignals() ) {
+        syslog(LOG_ERR,"SDK host: failed to block signals: %s",strerror(errno));
+        return 1;
+    }
+    pthread_mutex_init(&deviceListMutex,NULL);
+    startPollWorkers();
+    initGuardedCalls();
+
+    runGuardedLibraryCall(SDK_SET_APP_ID,SDK_SETUP_TIMEOUT_MILLIS);
+    if ( initializeLibrary(hostScanDone,hostDeviceAttached,hostDeviceRemoved) != Return_Ok ) {
+        syslog(LOG_ERR,"SDK host: failed to initialize library");
+        return 1;
+    }
+    if ( useBatteryEvents ) {
+        registerBatteryCallback(hostBatteryStatusChanged);
+    }
+
+    serveHostRequests();
+
+    runGuardedLibraryCall(SDK_UNINITIALIZE,SDK_UNINITIALIZE_TIMEOUT_MILLIS);
+    return 0;
+}
+
+// starts a fresh SDK host, it starts out with empty rings
+static int startSdkHost()
+{
+    atomic_store(&hostSegment->events.head,0);
+    atomic_store(&hostSegment->events.tail,0);
+    atomic_store(&hostSegment->requests.head,0);
+    atomic_store(&hostSegment->requests.tail,0);
+    drainEventSource(hostEventFd);
+    drainEventSource(hostRequestFd);
+
+    // everything gets formatted before fork(), the child only makes async-signal-safe calls
+    char segmentArg[16], eventArg[16], requestArg[16], workersArg[16], timeoutArg[16];
+    snprintf(segmentArg,sizeof(segmentArg),"%d",hostSegmentFd);
+    snprintf(eventArg,sizeof(eventArg),"%d",hostEventFd);
+    snprintf(requestArg,sizeof(requestArg),"%d",hostRequestFd);
+    snprintf(workersArg,sizeof(workersArg),"%d",pollWorkerCount);
+    snprintf(timeoutArg,sizeof(timeoutArg),"%d",pollTimeoutMillis);
+    char *args[16];
+    int argCount = 0;
+    args[argCount++] = "jabrac-sdk-host";
+    args[argCount++] = "--sdk-host";
+    args[argCount++] = segmentArg;
+    args[argCount++] = eventArg;
+    args[argCount++] = requestArg;
+    args[argCount++] = "--poll-workers";
+    args[argCount++] = workersArg;
+    args[argCount++] = "--poll-timeout";
+    args[argCount++] = timeoutArg;
+    if ( ! useBatteryEvents ) {
+        args[argCount++] = "--no-battery-events";
+    }
+    if ( verbose ) {
+        args[argCount++] = "-v";
+    }
+    if ( runAsDaemon ) {
+        args[argCount++] = "-d";
+    }
+    args[argCount] = 0;
+
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if ( pid < 0 ) {
+        syslog(LOG_ERR,"Failed to start SDK host: %s",strerror(errno));
+        return 0;
+    }
+    if ( pid == 0 )
+    {
+        // the SDK host must not outlive us
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if ( getppid() != parent ) {
+            _exit(EXIT_FAILURE);
+        }
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, 0);
+        fcntl(hostSegmentFd, F_SETFD, 0);
+        fcntl(hostEventFd, F_SETFD, 0);
+        fcntl(hostRequestFd, F_SETFD, 0);
+        execv("/proc/self/exe", args);
+        _exit(127);
+    }
+
+    hostPid = pid;
+    sdkGeneration++;
+    clock_gettime(CLOCK_MONOTONIC,&hostStartedAt);
+    syslog(LOG_INFO,"Started SDK host (PID %d)",(int) pid);
+    return 1;
+}
+
+// starts the next SDK host, once hostRespawnFd fires if the last one didn't live long
+void respawnSdkHost()
+{
+    hostRestarts++;
+    startSdkHost();
+    wakeup(0);
+}
+
+static void sdkHostExited(int status)
+{
+    hostPid = 0;
+    if ( WIFSIGNALED(status) ) {
+        syslog(LOG_ERR,"SDK host got killed by signal %d",WTERMSIG(status));
+    } else {
+        syslog(LOG_ERR,"SDK host exited with status %d",WEXITSTATUS(status));
+    }
+    if ( shutdownRequested ) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    long uptime = millisSince(&hostStartedAt,&now);
+    if ( uptime < HOST_RESPAWN_INTERVAL_MILLIS ) {
+        armTimerMillis(hostRespawnFd,HOST_RESPAWN_INTERVAL_MILLIS - uptime);
+        return;
+    }
+    respawnSdkHost();
+}
+
+// SIGCHLD: restarts the SDK host if it's gone
+void reapSdkHost()
+{
+    int status;
+    pid_t pid;
+    while ( (pid = waitpid(-1,&status,WNOHANG)) > 0 ) {
+        if ( pid == hostPid ) {
+            // whatever it managed to send before dying
+            drainHostEvents();
+            sdkHostExited(status);
+        }
+    }
+}
+
+// handles everything the SDK host sent so far, main thread only
+void drainHostEvents()
+{
+    hostmessage message;
+    while ( ringPop(&hostSegment->events,&message) )
+    {
+        hostMessages++;
+        message.batteryStatus.extraUnits = message.units;
+        message.name[sizeof(message.name)-1] = 0;
+        message.serial[sizeof(message.serial)-1] = 0;
+
+        switch ( message.type ) {
+            case HOST_ATTACHED:
+            {
+                Jabra_DeviceInfo info;
+                memset(&info,0,sizeof(info));
+                info.deviceID = message.deviceID;
+                info.productID = message.productID;
+                info.isDongle = message.isDongle;
+                info.deviceName = message.name;
+                info.serialNumber = message.serial[0] ? message.serial : 0;
+                addDevice(&info,message.capabilities);
+                break;
+            }
+            case HOST_REMOVED:
+                delDevice(message.deviceID);
+                break;
+            case HOST_SCAN_DONE:
+                removeStaleDevices();
+                break;
+            case HOST_BATTERY_EVENT:
+                batteryStatusReported(message.deviceID,&message.batteryStatus);
+                break;
+            case HOST_POLL_RESULT:
+                // results for a batch we gave up on are of no interest anymore
+                if ( hostPollJobs && message.batch == hostPollBatch && message.job < (uint32_t) hostPollCount && hostPollJobs[message.job].state == POLL_RUNNING )
+                {
+                    polljob *job = &hostPollJobs[message.job];
+                    job->rc = message.rc;
+                    job->capabilities = message.capabilities;
+                    if ( message.rc == Return_Ok ) {
+                        copyBatteryStatus(&message.batteryStatus,&job->batteryStatus,job->units);
+                    }
+                    job->state = POLL_DONE;
+                    hostPollFinished++;
+                    clock_gettime(CLOCK_MONOTONIC,&hostPollProgressAt);
+                }
+                // stuck calls live in the SDK host, mirror them so the device's health shows
+                if ( atomic_exchange(&deviceStuckCalls[message.deviceID],message.stuckCalls) != message.stuckCalls ) {
+                    lockDeviceList();
+                    snapshotDirty = 1;
+                    unlockDeviceList();
+                }
+                break;
+        }
+    }
+}
+
+// Split mode counterpart of startPoolJobs(): the jobs go to the SDK host as fast as its request ring takes them
+void startHostPollJobs(polljob *jobs, int count)
+{
+    hostPollJobs = jobs;
+    hostPollCount = count;
+    hostPollNext = 0;
+    hostPollFinished = 0;
+    hostPollBatch++;
+    hostPollPid = hostPid;
+    clock_gettime(CLOCK_MONOTONIC,&hostPollProgressAt);
+    advanceHostPollJobs();
+}
+
+// Split mode counterpart of advancePoolJobs(). A host that stops making progress gets killed,
+// jobs lost because the host died are left POLL_PENDING.
+int advanceHostPollJobs()
+{
+    if ( ! hostPollJobs ) {
+        return -1;
+    }
+    long stallMillis = (long) HOST_POLL_WAVES * pollTimeoutMillis + HOST_STALL_GRACE_MILLIS;
+    // reapSdkHost() clears hostPid (and may have started another host already)
+    int hostLost = ! hostPid || hostPid != hostPollPid;
+
+    if ( hostPollFinished < hostPollCount && ! hostLost && ! shutdownRequested )
+    {
+        hostmessage request;
+        memset(&request,0,sizeof(request));
+        request.type = HOST_POLL_REQUEST;
+        request.batch = hostPollBatch;
+
+        int pushed = 0;
+        for ( ; hostPollNext < hostPollCount ; hostPollNext++ ) {
+            polljob *job = &hostPollJobs[hostPollNext];
+            request.deviceID = job->handle.deviceID;
+            request.capabilities = (job->remoteControl ? CAP_REMOTE_CONTROL : 0) | (job->probe ? 0 : CAP_FEATURES_PROBED);
+            request.job = hostPollNext;
+            if ( ! ringPush(&hostSegment->requests,&request) ) {
+                break;
+            }
+            job->state = POLL_RUNNING;
+            pushed = 1;
+        }
+        if ( pushed ) {
+            ringDoorbell(hostRequestFd);
+        }
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC,&now);
+        long waited = millisSince(&hostPollProgressAt,&now);
+        if ( waited < stallMillis ) {
+            return (int) (stallMillis - waited);
+        }
+        syslog(LOG_ERR,"SDK host made no progress for %ld ms, killing it",waited);
+        kill(hostPid,SIGKILL);
+    }
+
+    for ( int i = 0 ; i < hostPollNext ; i++ ) {
+        if ( hostPollJobs[i].state == POLL_RUNNING ) {
+            hostPollJobs[i].state = hostLost || shutdownRequested ? POLL_PENDING : POLL_TIMED_OUT;
+            hostPollJobs[i].rc = Return_Timeout;
+        }
+    }
+    hostPollJobs = 0;
+    hostPollCount = 0;
+    hostPollNext = 0;
+    return -1;
+}
+
+// split mode: sets up the segment shared with the SDK host and starts the first one
+int openSdkHost()
+{
+    char name[64];
+    snprintf(name,sizeof(name),"/jabrac-host-%d",(int) getpid());
+    hostSegmentFd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+    if ( hostSegmentFd == -1 ) {
+        return 0;
+    }
+    // SDK hosts inherit the descriptor, nobody else needs to find the segment
+    shm_unlink(name);
+    if ( ftruncate(hostSegmentFd, sizeof(hostsegment)) != 0 ) {
+        return 0;
+    }
+    hostsegment *segment = mmap(0, sizeof(hostsegment), PROT_READ | PROT_WRITE, MAP_SHARED, hostSegmentFd, 0);
+    if ( segment == MAP_FAILED ) {
+        return 0;
+    }
+    segment->magic = HOST_SEGMENT_MAGIC;
+    segment->version = HOST_SEGMENT_VERSION;
+    hostSegment = segment;
+
+    hostEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    hostRequestFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return hostRequestFd != -1 && watchEventSource(hostEventFd,EVENT_SDK_HOST) && startSdkHost();
+}
+
+// hot restart: takes over the SDK host the previous binary left running, kills it if we can't
+int adoptSdkHost(pid_t pid, int segmentFd, int eventFd, int requestFd)
+{
+    int fds[] = { segmentFd, eventFd, requestFd };
+    for ( int i = 0 ; i < 3 ; i++ ) {
+        fcntl(fds[i],F_SETFD,FD_CLOEXEC);
+    }
+    hostsegment *segment = MAP_FAILED;
+    if ( splitMode ) {
+        segment = mmap(0, sizeof(hostsegment), PROT_READ | PROT_WRITE, MAP_SHARED, segmentFd, 0);
+    }
+    if ( segment == MAP_FAILED || segment->magic != HOST_SEGMENT_MAGIC || segment->version != HOST_SEGMENT_VERSION )
+    {
+        syslog(LOG_WARNING,"Hot restart: can't take over SDK host (PID %d), starting a new one",(int) pid);
+        if ( segment != MAP_FAILED ) {
+            munmap(segment,sizeof(hostsegment));
+        }
+        kill(pid,SIGKILL);
+        waitpid(pid,0,0);
+        for ( int i = 0 ; i < 3 ; i++ ) {
+            close(fds[i]);
+        }
+        return 0;
+    }
+    hostSegment = segment;
+    hostSegmentFd = segmentFd;
+    hostEventFd = eventFd;
+    hostRequestFd = requestFd;
+    hostPid = pid;
+    clock_gettime(CLOCK_MONOTONIC,&hostStartedAt);
+    // whatever it sent in the meantime is still in the ring, the doorbell wakes us up for it
+    watchEventSource(hostEventFd,EVENT_SDK_HOST);
+    return 1;
+}
+
+// lets the SDK host shut down the SDK, kills it if that takes too long
+void stopSdkHost()
+{
+    if ( ! hostPid ) {
+        return;
+    }
+    kill(hostPid,SIGTERM);
+    for ( int waited = 0 ; waitpid(hostPid,0,WNOHANG) == 0 ; waited += 10 ) {
+        if ( waited >= SDK_UNINITIALIZE_TIMEOUT_MILLIS + HOST_STALL_GRACE_MILLIS ) {
+            kill(hostPid,SIGKILL);
+            waitpid(hostPid,0,0);
+            break;
+        }
+        usleep(10000);
+    }
+    hostPid = 0;
+}
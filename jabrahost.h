@@ -0,0 +1,103 @@
+#ifndef JABRAHOST_H
+#define JABRAHOST_H
+
+/*
+ * Split mode (--split): the SDK lives in a process of its own, the SDK host.
+ * It shares a segment with the daemon holding two single producer, single
+ * consumer rings, events (host -> daemon) and requests (daemon -> host). Every
+ * push is followed by a write to the consumer's eventfd doorbell.
+ */
+
+#include "jabrac.h"
+#include <sys/types.h>
+
+// messages per ring (must be a power of two)
+#define HOST_RING_SLOTS 1024
+#define HOST_SEGMENT_MAGIC 0x5453484a /* "JHST" */
+#define HOST_SEGMENT_VERSION 1
+// SDK host restarts are at least this far apart
+#define HOST_RESPAWN_INTERVAL_MILLIS 1000
+// the SDK host polls in chunks of this many jobs per poll worker
+#define HOST_POLL_WAVES 4
+// a host that makes no progress for HOST_POLL_WAVES * --poll-timeout plus this long gets killed
+#define HOST_STALL_GRACE_MILLIS 2000
+
+typedef enum hostmessagetype {
+    // SDK host -> daemon
+    HOST_ATTACHED,
+    HOST_REMOVED,
+    // the SDK finished its first scan for devices
+    HOST_SCAN_DONE,
+    // battery status pushed by the SDK
+    HOST_BATTERY_EVENT,
+    HOST_POLL_RESULT,
+    // daemon -> SDK host
+    HOST_POLL_REQUEST
+} hostmessagetype;
+
+// fixed-size message exchanged with the SDK host, fields not used by a type are zero
+typedef struct hostmessage {
+    uint8_t type;
+    uint8_t isDongle;
+    // CAP_* bits the sender knows of, a HOST_POLL_REQUEST without CAP_FEATURES_PROBED probes the device
+    uint8_t capabilities;
+    // HOST_POLL_RESULT: SDK calls to the device that are stuck past their deadline
+    uint8_t stuckCalls;
+    uint16_t deviceID;
+    uint16_t productID;
+    // HOST_POLL_REQUEST/RESULT: poll batch and index of the job within it
+    uint32_t batch;
+    uint32_t job;
+    Jabra_ReturnCode rc;
+    // HOST_BATTERY_EVENT and HOST_POLL_RESULT with rc Return_Ok, the receiver points extraUnits at 'units'
+    Jabra_BatteryStatus batteryStatus;
+    Jabra_BatteryStatusUnit units[MAX_EXTRA_UNITS];
+    char name[MAX_DEVICE_NAME_LENGTH];
+    char serial[MAX_SERIAL_LENGTH];
+} hostmessage;
+
+// lock-free single producer, single consumer ring of messages
+typedef struct hostring {
+    // next slot the producer writes, only written by the producer
+    _Atomic uint32_t head;
+    char headPadding[60];
+    // next slot the consumer reads, only written by the consumer
+    _Atomic uint32_t tail;
+    char tailPadding[60];
+    hostmessage slots[HOST_RING_SLOTS];
+} hostring;
+
+// shared memory between the daemon and the SDK host
+typedef struct hostsegment {
+    uint32_t magic;
+    uint32_t version;
+    char padding[56];
+    hostring events;
+    hostring requests;
+} hostsegment;
+
+extern int hostSegmentFd;
+extern int hostEventFd;
+extern int hostRequestFd;
+// daemon side: the current SDK host, 0 while there is none
+extern pid_t hostPid;
+// delays starting the next SDK host when the last one died right away
+extern int hostRespawnFd;
+extern uint64_t hostRestarts;
+extern uint64_t hostMessages;
+extern uint32_t hostPollBatch;
+
+// daemon side
+int openSdkHost();
+int adoptSdkHost(pid_t pid, int segmentFd, int eventFd, int requestFd);
+void stopSdkHost();
+void respawnSdkHost();
+void reapSdkHost();
+void drainHostEvents();
+void startHostPollJobs(polljob *jobs, int count);
+int advanceHostPollJobs();
+
+// SDK host side, its main()
+int runSdkHost();
+
+#endif
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+#include "jabrastate.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <syslog.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// version 3 files had a fixed table of this many records in front of the product capabilities
+#define STATE_FILE_V3_SLOTS 1024
+
+typedef struct statefilev3 {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t recordSize;
+    uint32_t usedSlots;
+    uint32_t reserved;
+    staterecord records[STATE_FILE_V3_SLOTS];
+    uint8_t productCapabilities[USHRT_MAX+1];
+} statefilev3;
+
+statefile *stateFile;
+static size_t stateFileSize;
+// where openStateFile() found the state file, growing the table replaces it
+static char stateFileLocation[PATH_MAX];
+// the table couldn't be grown, getOrCreateStateRecord() evicts records instead
+static int stateFileGrowthFailed;
+static uint8_t fallbackProductCapabilities[USHRT_MAX+1];
+uint8_t *productCapabilities = fallbackProductCapabilities;
+
+// FNV-1a
+static uint32_t hashSerial(const char *serial)
+{
+    uint32_t hash = 2166136261u;
+    for ( ; *serial ; serial++ ) {
+        hash = (hash ^ (uint8_t) *serial) * 16777619u;
+    }
+    return hash;
+}
+
+// returns the slot of 'file' holding 'serial' or the free slot it would go into.
+// device list must be locked by caller
+static int findStateSlot(statefile *file, const char *serial)
+{
+    uint32_t mask = file->slotCount-1;
+    int slot = hashSerial(serial) & mask;
+    while ( file->records[slot].serial[0] && strncmp(file->records[slot].serial,serial,MAX_SERIAL_LENGTH) != 0 ) {
+        slot = (slot+1) & mask;
+    }
+    return slot;
+}
+
+static size_t stateFileSizeFor(uint32_t slotCount)
+{
+    return sizeof(statefile) + (size_t) slotCount * sizeof(staterecord);
+}
+
+// writes a state file holding the used ones of 'records' to 'path' and syncs it, NULL if that failed
+static statefile *buildStateFile(const char *path, uint32_t slotCount, const staterecord *records, uint32_t recordCount, const uint8_t *capabilities)
+{
+    int fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_CLOEXEC, 0600);
+    if ( fd < 0 ) {
+        syslog(LOG_ERR,"Failed to create state file %s: %s",path,strerror(errno));
+        return 0;
+    }
+    size_t size = stateFileSizeFor(slotCount);
+    void *mapped = MAP_FAILED;
+    if ( ftruncate(fd,size) == 0 ) {
+        mapped = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    }
+    if ( mapped == MAP_FAILED ) {
+        syslog(LOG_ERR,"Failed to size state file %s: %s",path,strerror(errno));
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+
+    statefile *file = mapped;
+    file->magic = STATE_FILE_MAGIC;
+    file->version = STATE_FILE_VERSION;
+    file->slotCount = slotCount;
+    file->recordSize = sizeof(staterecord);
+    if ( capabilities ) {
+        memcpy(file->productCapabilities,capabilities,sizeof(file->productCapabilities));
+    }
+    for ( uint32_t i = 0 ; i < recordCount ; i++ )
+    {
+        if ( records[i].serial[0] ) {
+            file->records[findStateSlot(file,records[i].serial)] = records[i];
+            file->usedSlots++;
+        }
+    }
+
+    // the rename must not reach the disk before the contents do
+    if ( msync(mapped,size,MS_SYNC) != 0 || fsync(fd) != 0 ) {
+        syslog(LOG_ERR,"Failed to write state file %s: %s",path,strerror(errno));
+        munmap(mapped,size);
+        close(fd);
+        unlink(path);
+        return 0;
+    }
+    close(fd);
+    return file;
+}
+
+// renames what buildStateFile() wrote over the state file, syncStateDirectory() makes that durable.
+// device list must be locked by caller
+static int installStateFile(const char *path, statefile *file)
+{
+    size_t size = stateFileSizeFor(file->slotCount);
+    if ( rename(path,stateFileLocation) != 0 ) {
+        syslog(LOG_ERR,"Failed to replace state file %s: %s",stateFileLocation,strerror(errno));
+        munmap(file,size);
+        unlink(path);
+        return 0;
+    }
+    if ( stateFile ) {
+        munmap(stateFile,stateFileSize);
+    }
+    stateFile = file;
+    stateFileSize = size;
+    productCapabilities = stateFile->productCapabilities;
+    return 1;
+}
+
+static void syncStateDirectory()
+{
+    char directory[PATH_MAX];
+    snprintf(directory,sizeof(directory),"%s",stateFileLocation);
+    char *slash = strrchr(directory,'/');
+    if ( slash ) {
+        *(slash == directory ? slash+1 : slash) = 0;
+    } else {
+        strcpy(directory,".");
+    }
+    int fd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if ( fd < 0 || fsync(fd) != 0 ) {
+        syslog(LOG_WARNING,"Failed to sync directory %s: %s",directory,strerror(errno));
+    }
+    if ( fd >= 0 ) {
+        close(fd);
+    }
+}
+
+// replaces the state file by one with 'slotCount' slots, built and synced next to it before the rename.
+// Returns 0 and keeps the current file if that fails.
+static int rebuildStateFile(uint32_t slotCount, const staterecord *records, uint32_t recordCount, const uint8_t *capabilities)
+{
+    char path[PATH_MAX+4];
+    snprintf(path,sizeof(path),"%s.new",stateFileLocation);
+    statefile *file = buildStateFile(path,slotCount,records,recordCount,capabilities);
+    if ( ! file || ! installStateFile(path,file) ) {
+        return 0;
+    }
+    syncStateDirectory();
+    return 1;
+}
+
+// before version 5 a single Not_Supported wrote off a whole product, those products get probed and polled again
+static void forgetUnconfirmedNoBattery(uint8_t *capabilities)
+{
+    for ( int i = 0 ; i <= USHRT_MAX ; i++ ) {
+        if ( (capabilities[i] & (CAP_BATTERY_KNOWN|CAP_BATTERY)) == CAP_BATTERY_KNOWN ) {
+            capabilities[i] &= ~(CAP_BATTERY_KNOWN|CAP_FEATURES_PROBED);
+        }
+    }
+}
+
+void openStateFile(const char *location)
+{
+    char *path = stateFileLocation;
+    if ( location ) {
+        snprintf(path,sizeof(stateFileLocation),"%s",location);
+    } else if ( ! defaultStateFilePath(path,sizeof(stateFileLocation),STATE_FILE_NAME) ) {
+        syslog(LOG_WARNING,"Neither XDG_STATE_HOME nor HOME is set, device state will not be persisted");
+        return;
+    }
+    if ( ! makeDirectories(path) ) {
+        syslog(LOG_ERR,"Failed to create directory for state file %s: %s",path,strerror(errno));
+        return;
+    }
+
+    int fd = open(path, O_RDWR);
+    if ( fd < 0 && errno != ENOENT ) {
+        syslog(LOG_ERR,"Failed to open state file %s: %s",path,strerror(errno));
+        return;
+    }
+    struct stat st;
+    if ( fd < 0 || fstat(fd,&st) != 0 ) {
+        st.st_size = 0;
+    }
+    size_t size = st.st_size;
+    statefile *mapped = MAP_FAILED;
+    if ( size >= sizeof(statefile) ) {
+        mapped = mmap(0,size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    }
+    if ( fd >= 0 ) {
+        close(fd);
+    }
+
+    // version 4 only differs in what the product capabilities mean
+    if ( mapped != MAP_FAILED && mapped->magic == STATE_FILE_MAGIC && (mapped->version == STATE_FILE_VERSION || mapped->version == 4) &&
+         mapped->recordSize == sizeof(staterecord) && mapped->slotCount >= STATE_FILE_INITIAL_SLOTS &&
+         (mapped->slotCount & (mapped->slotCount-1)) == 0 && mapped->usedSlots < mapped->slotCount &&
+         size == stateFileSizeFor(mapped->slotCount) )
+    {
+        if ( mapped->version == 4 ) {
+            forgetUnconfirmedNoBattery(mapped->productCapabilities);
+            mapped->version = STATE_FILE_VERSION;
+        }
+        stateFile = mapped;
+        stateFileSize = size;
+        productCapabilities = stateFile->productCapabilities;
+        return;
+    }
+
+    int migrated = 0;
+    if ( mapped != MAP_FAILED && mapped->magic == STATE_FILE_MAGIC && mapped->version == 3 &&
+         mapped->slotCount == STATE_FILE_V3_SLOTS && mapped->recordSize == sizeof(staterecord) && size == sizeof(statefilev3) )
+    {
+        statefilev3 *old = (statefilev3*) mapped;
+        migrated = rebuildStateFile(STATE_FILE_INITIAL_SLOTS,old->records,STATE_FILE_V3_SLOTS,old->productCapabilities);
+    }
+    if ( mapped != MAP_FAILED ) {
+        munmap(mapped,size);
+    }
+    if ( migrated ) {
+        forgetUnconfirmedNoBattery(productCapabilities);
+        return;
+    }
+    if ( st.st_size ) {
+        syslog(LOG_WARNING,"State file %s has an unsupported format, starting from scratch",path);
+    }
+    rebuildStateFile(STATE_FILE_INITIAL_SLOTS,0,0,0);
+}
+
+void closeStateFile()
+{
+    if ( stateFile ) {
+        munmap(stateFile,stateFileSize);
+        stateFile = 0;
+    }
+    productCapabilities = fallbackProductCapabilities;
+    stateFileGrowthFailed = 0;
+}
+
+// removes a record, shifting back records of the same probe sequence so lookups keep working.
+// device list must be locked by caller
+static void deleteStateSlot(int slot)
+{
+    uint32_t mask = stateFile->slotCount-1;
+    int hole = slot;
+    for ( int next = (hole+1) & mask ; stateFile->records[next].serial[0] ; next = (next+1) & mask )
+    {
+        int home = hashSerial(stateFile->records[next].serial) & mask;
+        // move record into the hole unless its home slot lies cyclically within (hole,next]
+        int distanceToHome = (next - home) & mask;
+        int distanceToHole = (next - hole) & mask;
+        if ( distanceToHome >= distanceToHole ) {
+            stateFile->records[hole] = stateFile->records[next];
+            hole = next;
+        }
+    }
+    memset(&stateFile->records[hole],0,sizeof(staterecord));
+    stateFile->usedSlots--;
+}
+
+// returns the record for 'serial', creating it as needed. NULL for a new serial while the table waits
+// for growStateFile(), evicts the least recently seen device once it can't grow anymore.
+// device list must be locked by caller
+staterecord *getOrCreateStateRecord(const char *serial)
+{
+    if ( ! stateFile || ! serial[0] ) {
+        return 0;
+    }
+    int slot = findStateSlot(stateFile,serial);
+    if ( stateFile->records[slot].serial[0] ) {
+        return &stateFile->records[slot];
+    }
+
+    if ( (stateFile->usedSlots+1)*4 > stateFile->slotCount*3 )
+    {
+        if ( stateFile->slotCount < STATE_FILE_MAX_SLOTS && ! stateFileGrowthFailed ) {
+            // growStateFile() is about to make room, a device that's new to us has nothing to lose by waiting
+            wakeup(0);
+            return 0;
+        }
+        int oldest = -1;
+        for ( uint32_t i = 0 ; i < stateFile->slotCount ; i++ ) {
+            if ( stateFile->records[i].serial[0] && ( oldest == -1 || stateFile->records[i].lastSeenMillis < stateFile->records[oldest].lastSeenMillis ) ) {
+                oldest = i;
+            }
+        }
+        syslog(LOG_WARNING,"State file is full (%u devices), forgetting %.*s, the least recently seen one",
+               stateFile->usedSlots,MAX_SERIAL_LENGTH,stateFile->records[oldest].serial);
+        deleteStateSlot(oldest);
+        slot = findStateSlot(stateFile,serial);
+    }
+
+    staterecord *record = &stateFile->records[slot];
+    memset(record,0,sizeof(staterecord));
+    strncpy(record->serial,serial,MAX_SERIAL_LENGTH-1);
+    stateFile->usedSlots++;
+    return record;
+}
+
+// doubles the table ahead of time, called from the main loop. The new file gets written from a copy
+// without holding the device list lock, records that changed meanwhile are carried over.
+void growStateFile()
+{
+    lockDeviceList();
+    if ( ! stateFile || stateFileGrowthFailed || stateFile->slotCount >= STATE_FILE_MAX_SLOTS ||
+         stateFile->usedSlots*100 < (uint64_t) stateFile->slotCount*STATE_FILE_GROW_PERCENT ) {
+        unlockDeviceList();
+        return;
+    }
+    uint32_t slotCount = stateFile->slotCount;
+    staterecord *records = malloc(slotCount*sizeof(staterecord));
+    uint8_t *capabilities = malloc(USHRT_MAX+1);
+    if ( records && capabilities ) {
+        memcpy(records,stateFile->records,slotCount*sizeof(staterecord));
+        memcpy(capabilities,stateFile->productCapabilities,USHRT_MAX+1);
+    }
+    unlockDeviceList();
+
+    char path[PATH_MAX+4];
+    snprintf(path,sizeof(path),"%s.new",stateFileLocation);
+    statefile *file = records && capabilities ? buildStateFile(path,slotCount*2,records,slotCount,capabilities) : 0;
+    free(records);
+    free(capabilities);
+    if ( ! file ) {
+        syslog(LOG_ERR,"Failed to grow the state file beyond %u slots, least recently seen devices will be forgotten",slotCount);
+        stateFileGrowthFailed = 1;
+        return;
+    }
+
+    lockDeviceList();
+    for ( uint32_t i = 0 ; i < slotCount ; i++ )
+    {
+        staterecord *record = &stateFile->records[i];
+        if ( ! record->serial[0] ) {
+            continue;
+        }
+        staterecord *copy = &file->records[findStateSlot(file,record->serial)];
+        if ( ! copy->serial[0] ) {
+            file->usedSlots++;
+        }
+        if ( memcmp(copy,record,sizeof(staterecord)) != 0 ) {
+            *copy = *record;
+        }
+    }
+    if ( memcmp(file->productCapabilities,stateFile->productCapabilities,USHRT_MAX+1) != 0 ) {
+        memcpy(file->productCapabilities,stateFile->productCapabilities,USHRT_MAX+1);
+    }
+    int installed = installStateFile(path,file);
+    unlockDeviceList();
+
+    if ( installed ) {
+        syncStateDirectory();
+        syslog(LOG_INFO,"State file grew to %u slots",slotCount*2);
+    } else {
+        stateFileGrowthFailed = 1;
+    }
+}
+
+// records of 'productID' that answered Not_Supported when last polled.
+// device list must be locked by caller
+int countNoBatteryRecords(unsigned short productID)
+{
+    int count = 0;
+    for ( uint32_t i = 0 ; stateFile && i < stateFile->slotCount ; i++ ) {
+        if ( stateFile->records[i].serial[0] && stateFile->records[i].productID == productID &&
+             (stateFile->records[i].flags & STATE_NO_BATTERY) ) {
+            count++;
+        }
+    }
+    return count;
+}
+
+// fed every battery status before saveDeviceState() overwrites the record. A fading battery drains
+// faster, so the discharge rate of the first stretches over the recent one estimates the capacity left.
+// device list must be locked by caller
+void updateBatteryHealth(staterecord *record, int64_t timeMillis, uint8_t level, uint8_t charging)
+{
+    int64_t seconds = (timeMillis - record->lastStatusAtMillis) / 1000;
+    if ( ! (record->flags & STATE_HAS_BATTERY) || seconds < 0 ) {
+        return;
+    }
+    int drop = record->lastLevel - level;
+    if ( drop > 0 && ! record->lastCharging ) {
+        record->dischargedPercent += drop;
+    }
+    if ( charging || record->lastCharging || drop < 0 || seconds > HEALTH_MAX_GAP_SECONDS ) {
+        record->stretchSeconds = 0;
+        record->stretchPercent = 0;
+        return;
+    }
+    record->stretchSeconds += seconds;
+    record->stretchPercent += drop;
+    if ( record->stretchPercent < HEALTH_STRETCH_PERCENT || record->stretchSeconds == 0 ) {
+        return;
+    }
+
+    float rate = record->stretchPercent * 3600.0f / record->stretchSeconds;
+    record->stretchSeconds = 0;
+    record->stretchPercent = 0;
+    record->stretches++;
+    if ( record->baselineStretches < HEALTH_BASELINE_STRETCHES ) {
+        record->baselineRate = (record->baselineRate * record->baselineStretches + rate) / (record->baselineStretches + 1);
+        record->baselineStretches++;
+        record->recentRate = record->baselineRate;
+    } else {
+        record->recentRate += HEALTH_RECENT_WEIGHT * (rate - record->recentRate);
+    }
+    int permille = (int) (record->baselineRate / record->recentRate * 1000);
+    // 0 is taken by "not measured yet"
+    record->healthPermille = permille > 1000 ? 1000 : permille < 1 ? 1 : permille;
+}
+
+static int isWorseHealth(const staterecord *a, const staterecord *b)
+{
+    return a->healthPermille < b->healthPermille || ( a->healthPermille == b->healthPermille && a->dischargedPercent > b->dischargedPercent );
+}
+
+// copies the 'wanted' records with the least capacity left into 'worst', worst first.
+// device list must be locked by caller
+int findWorstHealth(staterecord *worst, int wanted, int *tracked)
+{
+    int count = 0;
+    *tracked = 0;
+    if ( ! stateFile ) {
+        return 0;
+    }
+    for ( uint32_t i = 0 ; i < stateFile->slotCount ; i++ )
+    {
+        staterecord *record = &stateFile->records[i];
+        if ( ! record->serial[0] || record->healthPermille == 0 ) {
+            continue;
+        }
+        (*tracked)++;
+        if ( count == wanted && ! isWorseHealth(record,&worst[count-1]) ) {
+            continue;
+        }
+        // insertion into the sorted candidates, the best one drops out once there are enough
+        int position = count < wanted ? count++ : count-1;
+        while ( position > 0 && isWorseHealth(record,&worst[position-1]) ) {
+            worst[position] = worst[position-1];
+            position--;
+        }
+        worst[position] = *record;
+    }
+    return count;
+}
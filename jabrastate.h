@@ -0,0 +1,94 @@
+#ifndef JABRASTATE_H
+#define JABRASTATE_H
+
+/*
+ * Persistent per-device state, kept in $XDG_STATE_HOME/jabrac (or
+ * ~/.local/state/jabrac): a memory-mapped hash table of records keyed by
+ * serial number, plus the CAP_* bits learnt per product ID. Protected by the
+ * device list lock.
+ */
+
+#include "jabrac.h"
+
+#define STATE_FILE_NAME "devices.state"
+#define STATE_FILE_MAGIC 0x4653424a /* "JBSF" */
+#define STATE_FILE_VERSION 5
+// slots of a new state file's table (must be a power of two)
+#define STATE_FILE_INITIAL_SLOTS 1024
+// the table doesn't grow beyond this, the least recently seen devices get evicted then
+#define STATE_FILE_MAX_SLOTS (1 << 18)
+// percentage of used slots growStateFile() doubles the table at
+#define STATE_FILE_GROW_PERCENT 50
+
+// battery health (see updateBatteryHealth()): discharge rates get measured over stretches of this many percent
+#define HEALTH_STRETCH_PERCENT 10
+// samples further apart than this (device switched off, out of range) break a stretch
+#define HEALTH_MAX_GAP_SECONDS (15*60)
+// a device's first stretches make up the baseline its later discharge rates get compared with
+#define HEALTH_BASELINE_STRETCHES 5
+// weight of the latest stretch in the recent discharge rate
+#define HEALTH_RECENT_WEIGHT 0.2f
+
+// staterecord.flags
+#define STATE_NOTIFIED     0x01
+#define STATE_HAS_BATTERY  0x02
+// answered Not_Supported when last polled, see learnNoBattery()
+#define STATE_NO_BATTERY   0x04
+
+// what we remember about a device across restarts, keyed by serial number
+typedef struct staterecord {
+    // empty if the slot is unused
+    char serial[MAX_SERIAL_LENGTH];
+    uint16_t productID;
+    uint8_t flags;
+    uint8_t lastNotifyPercentage;
+    uint8_t lastNotifyCharging;
+    uint8_t lastLevel;
+    uint8_t lastCharging;
+    uint8_t reserved;
+    int64_t lastSeenMillis;
+    int64_t lastStatusAtMillis;
+    int64_t lastNotifiedAtMillis;
+    // battery health, see updateBatteryHealth(). /100 gives equivalent full charge cycles
+    uint32_t dischargedPercent;
+    // discharge stretch in progress
+    uint32_t stretchSeconds;
+    uint8_t stretchPercent;
+    // stretches averaged into baselineRate so far, up to HEALTH_BASELINE_STRETCHES
+    uint8_t baselineStretches;
+    // capacity left relative to the baseline, 0 until the first stretch got measured
+    uint16_t healthPermille;
+    uint32_t stretches;
+    // discharge rates in percent per hour
+    float baselineRate;
+    float recentRate;
+} staterecord;
+
+typedef struct statefile {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slotCount;
+    uint32_t recordSize;
+    uint32_t usedSlots;
+    uint32_t reserved;
+    // CAP_* bits learnt per product ID, direct-indexed
+    uint8_t productCapabilities[USHRT_MAX+1];
+    // open addressing with linear probing, hashed by serial number
+    staterecord records[];
+} statefile;
+
+// NULL if there is none
+extern statefile *stateFile;
+// points into the state file if there is one
+extern uint8_t *productCapabilities;
+
+// 'path' is NULL for the default location
+void openStateFile(const char *path);
+void closeStateFile();
+staterecord *getOrCreateStateRecord(const char *serial);
+void growStateFile();
+int countNoBatteryRecords(unsigned short productID);
+void updateBatteryHealth(staterecord *record, int64_t timeMillis, uint8_t level, uint8_t charging);
+int findWorstHealth(staterecord *worst, int wanted, int *tracked);
+
+#endif
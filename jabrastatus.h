@@ -0,0 +1,120 @@
+#ifndef JABRASTATUS_H
+#define JABRASTATUS_H
+
+/*
+ * Layout of the shared memory segment jabrac publishes its device state in.
+ *
+ * The daemon creates /dev/shm/jabrac-status-<uid> (see jabrastatus_name()) and
+ * rewrites it whenever the device state changes. Any number of local readers
+ * can map it read-only and poll it without syscalls, consistency is ensured by
+ * a sequence lock: 'sequence' is odd while the daemon is writing, readers
+ * retry until they copied the data between two reads of the same even value.
+ * jabrastatus_read() does exactly that, giving up after a bounded number of
+ * attempts in case the daemon died in the middle of an update.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sched.h>
+
+#define JABRA_STATUS_MAGIC 0x5453424a /* "JBST" */
+#define JABRA_STATUS_VERSION 2
+
+// max. number of devices in the segment, further devices are left out
+#define JABRA_STATUS_MAX_DEVICES 1024
+#define JABRA_STATUS_MAX_NAME_LENGTH 64
+// one level per BatteryComponent (see Common.h)
+#define JABRA_STATUS_COMPONENTS 8
+// component level not reported by the device
+#define JABRA_STATUS_LEVEL_UNKNOWN 0xff
+// no time-to-empty/full estimate (yet)
+#define JABRA_STATUS_MINUTES_UNKNOWN 0xffff
+// jabrastatus_read() gives up after this many attempts that ran into an update
+#define JABRA_STATUS_READ_ATTEMPTS 1000
+
+// jabrastatus_device.flags
+#define JABRA_STATUS_HAS_BATTERY 0x01
+#define JABRA_STATUS_CHARGING    0x02
+
+// jabrastatus_segment.flags
+// more devices are attached than fit into the segment
+#define JABRA_STATUS_TRUNCATED 0x01
+
+typedef struct jabrastatus_device {
+    uint16_t deviceID;
+    uint8_t flags;
+    // main battery level in percent
+    uint8_t level;
+    // level per BatteryComponent, JABRA_STATUS_LEVEL_UNKNOWN if not reported
+    uint8_t componentLevels[JABRA_STATUS_COMPONENTS];
+    // bit i set: componentMinutes[i] counts down to full rather than to empty
+    uint8_t componentFilling;
+    uint8_t reserved;
+    // predicted minutes until the main battery is empty (until it is full while charging),
+    // counted from updatedAtMillis. JABRA_STATUS_MINUTES_UNKNOWN if there is no estimate.
+    uint16_t minutes;
+    // wall clock time of the last battery status (milliseconds since the epoch), 0 if none yet
+    int64_t updatedAtMillis;
+    // the same per BatteryComponent
+    uint16_t componentMinutes[JABRA_STATUS_COMPONENTS];
+    char name[JABRA_STATUS_MAX_NAME_LENGTH];
+} jabrastatus_device;
+
+typedef struct jabrastatus_segment {
+    uint32_t magic;
+    uint32_t version;
+    // PID of the daemon that owns the segment
+    int32_t pid;
+    uint32_t flags;
+    // odd while an update is in progress
+    uint64_t sequence;
+    // wall clock time of the last update (milliseconds since the epoch)
+    int64_t publishedAtMillis;
+    uint32_t deviceCount;
+    uint32_t reserved;
+    jabrastatus_device devices[JABRA_STATUS_MAX_DEVICES];
+} jabrastatus_segment;
+
+// writes the shared memory object name (as used with shm_open()) for the current user
+static inline void jabrastatus_name(char *buffer, size_t bufferSize)
+{
+    snprintf(buffer,bufferSize,"/jabrac-status-%u",(unsigned int) getuid());
+}
+
+// Copies a consistent view of the segment into 'header' and up to 'maxDevices' devices into 'devices'.
+// Returns the number of devices copied or -1 if the segment is not a (compatible) jabrac status segment
+// or stayed in the middle of an update for JABRA_STATUS_READ_ATTEMPTS attempts. The latter means the daemon
+// died while writing (or is stuck), readers should treat its state as stale then.
+static inline int jabrastatus_read(const jabrastatus_segment *segment, jabrastatus_segment *header, jabrastatus_device *devices, int maxDevices)
+{
+    if ( segment->magic != JABRA_STATUS_MAGIC || segment->version != JABRA_STATUS_VERSION ) {
+        return -1;
+    }
+    for ( int attempt = 0 ; attempt < JABRA_STATUS_READ_ATTEMPTS ; attempt++ )
+    {
+        if ( attempt > 0 ) {
+            // let the writer finish
+            sched_yield();
+        }
+        uint64_t before = __atomic_load_n(&segment->sequence,__ATOMIC_ACQUIRE);
+        if ( before & 1 ) {
+            continue;
+        }
+        memcpy(header,segment,offsetof(jabrastatus_segment,devices));
+        int count = header->deviceCount < (uint32_t) maxDevices ? (int) header->deviceCount : maxDevices;
+        if ( count > JABRA_STATUS_MAX_DEVICES ) {
+            count = JABRA_STATUS_MAX_DEVICES;
+        }
+        memcpy(devices,segment->devices,count*sizeof(jabrastatus_device));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if ( __atomic_load_n(&segment->sequence,__ATOMIC_RELAXED) == before ) {
+            return count;
+        }
+    }
+    return -1;
+}
+
+#endif
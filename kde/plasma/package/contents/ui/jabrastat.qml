@@ -5,11 +5,48 @@ import QtQuick.Layouts 1.1
 import org.kde.plasma.core 2.0 as PlasmaCore
 import org.kde.plasma.components 3.0 as PlasmaComponents
 
-RowLayout {
-  PlasmaComponents.Label {
-    text: "item 1"
+// reads the daemon's status segment, see kde/plasma/plugin
+import de.codesourcery.jabra 1.0
+
+ColumnLayout {
+
+  // devices with a battery status, same keys as in 'jabractl status'
+  property var devices: daemon.devices
+
+  function formatMinutes(minutes) {
+    if ( minutes >= 60 ) {
+      return Math.floor(minutes / 60) + " h " + (minutes % 60) + " min"
+    }
+    return minutes + " min"
+  }
+
+  function describe(device) {
+    var text = device.name + ": " + device.level + " %"
+    if ( device.minutes_to_full !== undefined ) {
+      text += " (charging, full in about " + formatMinutes(device.minutes_to_full) + ")"
+    } else if ( device.minutes_to_empty !== undefined ) {
+      text += ", about " + formatMinutes(device.minutes_to_empty) + " left"
+    } else if ( device.charging ) {
+      text += " (charging)"
+    }
+    return text
   }
+
+  // a look at shared memory, no process gets started and the daemon doesn't notice
+  JabraStatus {
+    id: daemon
+    interval: plasmoid.configuration.pollingIntervalSeconds * 1000
+  }
+
   PlasmaComponents.Label {
-    text: "item 2"
+    visible: devices.length == 0
+    text: daemon.stale ? i18n("jabrac is not running") : i18n("No Jabra devices")
+  }
+
+  Repeater {
+    model: devices
+    PlasmaComponents.Label {
+      text: describe(modelData)
+    }
   }
 }
@@ -0,0 +1,178 @@
+/*
+ * QML plugin that gives the plasmoid jabrac's device state by reading the
+ * status segment (see jabrastatus.h), without running a process or talking
+ * to the daemon at all:
+ *
+ *   import de.codesourcery.jabra 1.0
+ *   JabraStatus { interval: 5000 }
+ *
+ * 'devices' holds one object per device with a battery, with the keys of the
+ * devices in 'jabractl status' (id, name, level, charging, minutes_to_empty or
+ * minutes_to_full). 'stale' is set while there is no daemon or its segment
+ * can't be read, 'devices' is empty then.
+ */
+#include <QObject>
+#include <QQmlEngine>
+#include <QQmlExtensionPlugin>
+#include <QTimer>
+#include <QVariantList>
+#include <QVariantMap>
+#include <QDateTime>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../../../jabrastatus.h"
+
+class JabraStatus : public QObject
+{
+    Q_OBJECT
+    Q_PROPERTY(QVariantList devices READ devices NOTIFY devicesChanged)
+    Q_PROPERTY(bool stale READ stale NOTIFY staleChanged)
+    // milliseconds between looks at the segment
+    Q_PROPERTY(int interval READ interval WRITE setInterval NOTIFY intervalChanged)
+
+public:
+    explicit JabraStatus(QObject *parent = nullptr) : QObject(parent), copies(JABRA_STATUS_MAX_DEVICES)
+    {
+        timer.setInterval(5000);
+        connect(&timer, &QTimer::timeout, this, &JabraStatus::refresh);
+        timer.start();
+        refresh();
+    }
+
+    ~JabraStatus() override
+    {
+        unmapSegment();
+    }
+
+    QVariantList devices() const { return deviceList; }
+    bool stale() const { return isStale; }
+    int interval() const { return timer.interval(); }
+
+    void setInterval(int millis)
+    {
+        if ( millis > 0 && millis != timer.interval() ) {
+            timer.setInterval(millis);
+            emit intervalChanged();
+        }
+    }
+
+public slots:
+    void refresh()
+    {
+        if ( ! segment && ! mapSegment() ) {
+            setState(QVariantList(), true);
+            return;
+        }
+        // the daemon unlinks its segment on exit, the next one creates a new one
+        if ( kill(segment->pid, 0) != 0 && errno == ESRCH ) {
+            unmapSegment();
+            setState(QVariantList(), true);
+            return;
+        }
+        jabrastatus_segment header;
+        int count = jabrastatus_read(segment, &header, copies.data(), (int) copies.size());
+        if ( count < 0 ) {
+            // incompatible or stuck in the middle of an update, try a fresh mapping next time
+            unmapSegment();
+            setState(QVariantList(), true);
+            return;
+        }
+
+        qint64 now = QDateTime::currentMSecsSinceEpoch();
+        QVariantList list;
+        for ( int i = 0 ; i < count ; i++ )
+        {
+            const jabrastatus_device &device = copies[i];
+            if ( ! (device.flags & JABRA_STATUS_HAS_BATTERY) ) {
+                continue;
+            }
+            QVariantMap entry;
+            entry["id"] = QString("%1").arg(device.deviceID, 4, 16, QChar('0'));
+            entry["name"] = QString::fromUtf8(device.name, (int) strnlen(device.name, sizeof(device.name)));
+            entry["level"] = (int) device.level;
+            entry["charging"] = (device.flags & JABRA_STATUS_CHARGING) != 0;
+            if ( device.minutes != JABRA_STATUS_MINUTES_UNKNOWN ) {
+                // counted from the battery status, not from now
+                qint64 minutes = device.minutes - (now - device.updatedAtMillis) / 60000;
+                entry[(device.flags & JABRA_STATUS_CHARGING) ? "minutes_to_full" : "minutes_to_empty"] = minutes < 0 ? 0 : (int) minutes;
+            }
+            list.append(entry);
+        }
+        setState(list, false);
+    }
+
+signals:
+    void devicesChanged();
+    void staleChanged();
+    void intervalChanged();
+
+private:
+    bool mapSegment()
+    {
+        char name[64];
+        jabrastatus_name(name, sizeof(name));
+        int fd = shm_open(name, O_RDONLY, 0);
+        if ( fd < 0 ) {
+            return false;
+        }
+        struct stat info;
+        if ( fstat(fd, &info) != 0 || (size_t) info.st_size < sizeof(jabrastatus_segment) ) {
+            close(fd);
+            return false;
+        }
+        void *mapped = mmap(nullptr, sizeof(jabrastatus_segment), PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if ( mapped == MAP_FAILED ) {
+            return false;
+        }
+        segment = static_cast<const jabrastatus_segment*>(mapped);
+        return true;
+    }
+
+    void unmapSegment()
+    {
+        if ( segment ) {
+            munmap(const_cast<jabrastatus_segment*>(segment), sizeof(jabrastatus_segment));
+            segment = nullptr;
+        }
+    }
+
+    void setState(const QVariantList &list, bool staleNow)
+    {
+        if ( list != deviceList ) {
+            deviceList = list;
+            emit devicesChanged();
+        }
+        if ( staleNow != isStale ) {
+            isStale = staleNow;
+            emit staleChanged();
+        }
+    }
+
+    QTimer timer;
+    const jabrastatus_segment *segment = nullptr;
+    // jabrastatus_read() copies the devices here, allocated once
+    std::vector<jabrastatus_device> copies;
+    QVariantList deviceList;
+    bool isStale = true;
+};
+
+class JabraStatusPlugin : public QQmlExtensionPlugin
+{
+    Q_OBJECT
+    Q_PLUGIN_METADATA(IID QQmlExtensionInterface_iid)
+
+public:
+    void registerTypes(const char *uri) override
+    {
+        qmlRegisterType<JabraStatus>(uri, 1, 0, "JabraStatus");
+    }
+};
+
+#include "jabrastatusplugin.moc"
@@ -0,0 +1,711 @@
+/*
+ * Stand-in for libjabra that simulates a fleet of headsets so jabrac can be
+ * exercised without hardware. Implements the subset of Common.h the daemon uses.
+ *
+ * The fleet is described by the script file named in $JABRA_MOCK_SCRIPT, one
+ * directive per line ('#' starts a comment):
+ *
+ *   speed <factor>                 simulated time runs <factor> times faster than real time
+ *   seed <number>                  seed for latency jitter and random errors
+ *   device <id> [key=value ...]    one device with the given device ID
+ *   fleet <count> [key=value ...]  <count> devices with consecutive IDs starting at first-id (default 1)
+ *
+ * Device keys:
+ *
+ *   name="Jabra Evolve 65"   device name (fleet devices get " #<n>" appended)
+ *   serial=ABC123            serial number (fleet devices get "-<n>" appended)
+ *   product=0x2e91           product ID
+ *   dongle=1                 device reports itself as a dongle (Jabra_DeviceInfo.isDongle)
+ *   level=80                 battery level at startup, 'random' for 0..100
+ *   drain=0.5                percent lost per simulated minute while discharging
+ *   charge=2                 percent gained per simulated minute while charging
+ *   charging=1               device starts out charging
+ *   cycle=1                  start charging at 5 %, stop at 100 %
+ *   latency=20               milliseconds each SDK call takes
+ *   jitter=10                random extra milliseconds on top of latency
+ *   error=Device_BadState    return code of failing calls (any name from returncodes.inc)
+ *   error-rate=0.1           probability of a call failing with 'error' (1 = always)
+ *   hang=1                   battery queries never return (until Jabra_Uninitialize)
+ *   events=1                 push level changes via the battery status callback
+ *   remote=60                device has a remote control with the given battery level
+ *   units=LEFT:-2,RIGHT:0    extra battery units with their offset from the main level
+ *   attach-after=30          device shows up after this many (real) seconds
+ *   detach-after=120         device goes away after this many (real) seconds
+ */
+#include <Common.h>
+#include "jabramock.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <limits.h>
+
+#define MAX_UNITS 4
+// how often the simulation advances battery levels and fires hot-plug events
+#define TICK_MILLIS 100
+#define LOW_LEVEL_CHARGE_START 5
+
+typedef struct mockdevice {
+    unsigned short deviceID;
+    unsigned short productID;
+    int dongle;
+    char name[64];
+    char serial[32];
+    double level;
+    double drainPerMinute;
+    double chargePerMinute;
+    int charging;
+    int cycle;
+    int latencyMillis;
+    int jitterMillis;
+    Jabra_ReturnCode error;
+    double errorRate;
+    int hang;
+    int events;
+    int remoteLevel;
+    int unitCount;
+    BatteryComponent unitComponents[MAX_UNITS];
+    int unitOffsets[MAX_UNITS];
+    double attachAfter;
+    double detachAfter;
+    int attached;
+    int lastReportedLevel;
+} mockdevice;
+
+typedef struct namedvalue {
+    const char *name;
+    int value;
+} namedvalue;
+
+#define DEFINE_CODE(a,b) { #a, a },
+static const namedvalue returnCodes[] = {
+#include "returncodes.inc"
+    { 0, 0 }
+};
+#undef DEFINE_CODE
+
+static const namedvalue components[] = {
+    { "UNKNOWN", UNKNOWN },
+    { "MAIN", MAIN },
+    { "COMBINED", COMBINED },
+    { "RIGHT", RIGHT },
+    { "LEFT", LEFT },
+    { "CRADLE_BATTERY", CRADLE_BATTERY },
+    { "REMOTE_CONTROL", REMOTE_CONTROL },
+    { 0, 0 }
+};
+
+static pthread_mutex_t mockMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mockShutdownCondition = PTHREAD_COND_INITIALIZER;
+
+static mockdevice *mockDevices;
+static int mockDeviceCount;
+static mockdevice *mockDevicesByID[USHRT_MAX+1];
+
+static double speedFactor = 1;
+static unsigned int randomSeed = 1;
+static volatile int initialized;
+static volatile int shuttingDown;
+static pthread_t simulationThread;
+static struct timespec startTime;
+
+static void (*deviceAttachedCallback)(Jabra_DeviceInfo deviceInfo);
+static void (*deviceRemovedCallback)(unsigned short deviceID);
+static void (*firstScanDoneCallback)(void);
+static BatteryStatusUpdateCallbackV2 batteryCallback;
+
+static jabramock_stats stats;
+
+// mockMutex must be held by caller
+static double randomDouble()
+{
+    return rand_r(&randomSeed) / (double) RAND_MAX;
+}
+
+static double secondsSinceStart()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return (now.tv_sec - startTime.tv_sec) + (now.tv_nsec - startTime.tv_nsec) / 1e9;
+}
+
+static int lookupName(const namedvalue *table, const char *name, int *value)
+{
+    for ( ; table->name ; table++ ) {
+        if ( strcasecmp(table->name,name) == 0 ) {
+            *value = table->value;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int clampLevel(double level)
+{
+    return level < 0 ? 0 : level > 100 ? 100 : (int) level;
+}
+
+// splits 'line' into whitespace separated tokens in place, honoring double quotes
+static int tokenize(char *line, char **tokens, int maxTokens)
+{
+    int count = 0;
+    char *in = line;
+    while ( *in && count < maxTokens )
+    {
+        while ( *in == ' ' || *in == '\t' || *in == '\n' || *in == '\r' ) {
+            in++;
+        }
+        if ( ! *in || *in == '#' ) {
+            break;
+        }
+        tokens[count++] = in;
+        char *out = in;
+        int quoted = 0;
+        while ( *in && ( quoted || ( *in != ' ' && *in != '\t' && *in != '\n' && *in != '\r' ) ) ) {
+            if ( *in == '"' ) {
+                quoted = ! quoted;
+                in++;
+                continue;
+            }
+            *out++ = *in++;
+        }
+        if ( *in ) {
+            in++;
+        }
+        *out = 0;
+    }
+    return count;
+}
+
+static int parseUnits(mockdevice *device, char *value)
+{
+    char *saveptr;
+    for ( char *unit = strtok_r(value,",",&saveptr) ; unit ; unit = strtok_r(0,",",&saveptr) )
+    {
+        if ( device->unitCount == MAX_UNITS ) {
+            return 0;
+        }
+        char *colon = strchr(unit,':');
+        if ( colon ) {
+            *colon = 0;
+        }
+        int component;
+        if ( ! lookupName(components,unit,&component) ) {
+            return 0;
+        }
+        device->unitComponents[device->unitCount] = (BatteryComponent) component;
+        device->unitOffsets[device->unitCount] = colon ? atoi(colon+1) : 0;
+        device->unitCount++;
+    }
+    return 1;
+}
+
+static int parseDeviceOption(mockdevice *device, char *key, char *value, int *randomLevel)
+{
+    if ( strcmp(key,"name") == 0 ) {
+        snprintf(device->name,sizeof(device->name),"%s",value);
+    } else if ( strcmp(key,"serial") == 0 ) {
+        snprintf(device->serial,sizeof(device->serial),"%s",value);
+    } else if ( strcmp(key,"product") == 0 ) {
+        device->productID = strtol(value,0,0);
+    } else if ( strcmp(key,"dongle") == 0 ) {
+        device->dongle = atoi(value);
+    } else if ( strcmp(key,"level") == 0 ) {
+        *randomLevel = strcmp(value,"random") == 0;
+        device->level = atof(value);
+    } else if ( strcmp(key,"drain") == 0 ) {
+        device->drainPerMinute = atof(value);
+    } else if ( strcmp(key,"charge") == 0 ) {
+        device->chargePerMinute = atof(value);
+    } else if ( strcmp(key,"charging") == 0 ) {
+        device->charging = atoi(value);
+    } else if ( strcmp(key,"cycle") == 0 ) {
+        device->cycle = atoi(value);
+    } else if ( strcmp(key,"latency") == 0 ) {
+        device->latencyMillis = atoi(value);
+    } else if ( strcmp(key,"jitter") == 0 ) {
+        device->jitterMillis = atoi(value);
+    } else if ( strcmp(key,"error") == 0 ) {
+        int code;
+        if ( ! lookupName(returnCodes,value,&code) ) {
+            return 0;
+        }
+        device->error = (Jabra_ReturnCode) code;
+    } else if ( strcmp(key,"error-rate") == 0 ) {
+        device->errorRate = atof(value);
+    } else if ( strcmp(key,"hang") == 0 ) {
+        device->hang = atoi(value);
+    } else if ( strcmp(key,"events") == 0 ) {
+        device->events = atoi(value);
+    } else if ( strcmp(key,"remote") == 0 ) {
+        device->remoteLevel = atoi(value);
+    } else if ( strcmp(key,"units") == 0 ) {
+        return parseUnits(device,value);
+    } else if ( strcmp(key,"attach-after") == 0 ) {
+        device->attachAfter = atof(value);
+    } else if ( strcmp(key,"detach-after") == 0 ) {
+        device->detachAfter = atof(value);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static mockdevice *addMockDevice(int *capacity)
+{
+    if ( mockDeviceCount == *capacity ) {
+        *capacity = *capacity ? *capacity * 2 : 64;
+        mockDevices = realloc(mockDevices,*capacity * sizeof(mockdevice));
+    }
+    return &mockDevices[mockDeviceCount++];
+}
+
+static int loadScript(const char *path)
+{
+    FILE *in = fopen(path,"r");
+    if ( ! in ) {
+        fprintf(stderr,"jabramock: failed to open script %s: %s\n",path,strerror(errno));
+        return 0;
+    }
+
+    int capacity = 0;
+    int lineNo = 0;
+    char line[1024];
+    while ( fgets(line,sizeof(line),in) )
+    {
+        lineNo++;
+        char *tokens[32];
+        int count = tokenize(line,tokens,32);
+        if ( count == 0 ) {
+            continue;
+        }
+
+        if ( strcmp(tokens[0],"speed") == 0 && count == 2 ) {
+            speedFactor = atof(tokens[1]);
+            continue;
+        }
+        if ( strcmp(tokens[0],"seed") == 0 && count == 2 ) {
+            randomSeed = atoi(tokens[1]);
+            continue;
+        }
+
+        int isFleet = strcmp(tokens[0],"fleet") == 0;
+        if ( ( ! isFleet && strcmp(tokens[0],"device") != 0 ) || count < 2 ) {
+            fprintf(stderr,"jabramock: %s:%d: unknown directive '%s'\n",path,lineNo,tokens[0]);
+            fclose(in);
+            return 0;
+        }
+
+        mockdevice template;
+        memset(&template,0,sizeof(template));
+        snprintf(template.name,sizeof(template.name),"Jabra Mock");
+        template.level = 100;
+        template.drainPerMinute = 0.1;
+        template.chargePerMinute = 1;
+        template.remoteLevel = -1;
+        template.attachAfter = 0;
+        template.detachAfter = -1;
+        template.lastReportedLevel = -1;
+
+        int firstID = isFleet ? 1 : atoi(tokens[1]);
+        int instances = isFleet ? atoi(tokens[1]) : 1;
+        int randomLevel = 0;
+        for ( int i = 2 ; i < count ; i++ )
+        {
+            char *equals = strchr(tokens[i],'=');
+            if ( equals ) {
+                *equals = 0;
+            }
+            if ( isFleet && equals && strcmp(tokens[i],"first-id") == 0 ) {
+                firstID = atoi(equals+1);
+            } else if ( ! equals || ! parseDeviceOption(&template,tokens[i],equals+1,&randomLevel) ) {
+                fprintf(stderr,"jabramock: %s:%d: invalid option '%s'\n",path,lineNo,tokens[i]);
+                fclose(in);
+                return 0;
+            }
+        }
+        if ( firstID < 0 || instances < 0 || firstID + instances - 1 > USHRT_MAX ) {
+            fprintf(stderr,"jabramock: %s:%d: device IDs out of range\n",path,lineNo);
+            fclose(in);
+            return 0;
+        }
+
+        for ( int i = 0 ; i < instances ; i++ )
+        {
+            mockdevice *device = addMockDevice(&capacity);
+            *device = template;
+            device->deviceID = firstID + i;
+            if ( isFleet ) {
+                snprintf(device->name,sizeof(device->name),"%.50s #%d",template.name,i+1);
+                snprintf(device->serial,sizeof(device->serial),"%.20s-%d",template.serial[0] ? template.serial : "MOCK",firstID+i);
+            } else if ( ! device->serial[0] ) {
+                snprintf(device->serial,sizeof(device->serial),"MOCK-%d",device->deviceID);
+            }
+            if ( randomLevel ) {
+                device->level = randomDouble() * 100;
+            }
+        }
+    }
+    fclose(in);
+
+    for ( int i = 0 ; i < mockDeviceCount ; i++ ) {
+        mockDevicesByID[ mockDevices[i].deviceID ] = &mockDevices[i];
+    }
+    stats.deviceCount = mockDeviceCount;
+    return 1;
+}
+
+static Jabra_DeviceInfo toDeviceInfo(mockdevice *device)
+{
+    Jabra_DeviceInfo info;
+    memset(&info,0,sizeof(info));
+    info.deviceID = device->deviceID;
+    info.productID = device->productID;
+    info.vendorID = 0x0B0E;
+    info.isDongle = device->dongle != 0;
+    info.deviceName = strdup(device->name);
+    info.serialNumber = strdup(device->serial);
+    info.deviceconnection = USB;
+    return info;
+}
+
+// mockMutex must be held by caller
+static Jabra_BatteryStatus *toBatteryStatus(mockdevice *device)
+{
+    Jabra_BatteryStatus *status = calloc(1,sizeof(Jabra_BatteryStatus));
+    status->levelInPercent = clampLevel(device->level);
+    status->charging = device->charging;
+    status->batteryLow = status->levelInPercent < 10;
+    status->component = device->unitCount ? COMBINED : MAIN;
+    if ( device->unitCount )
+    {
+        status->extraUnitsCount = device->unitCount;
+        status->extraUnits = calloc(device->unitCount,sizeof(Jabra_BatteryStatusUnit));
+        for ( int i = 0 ; i < device->unitCount ; i++ ) {
+            status->extraUnits[i].levelInPercent = clampLevel(device->level + device->unitOffsets[i]);
+            status->extraUnits[i].component = device->unitComponents[i];
+        }
+    }
+    return status;
+}
+
+// mockMutex must be held by caller
+static void advanceDevice(mockdevice *device, double simulatedMinutes)
+{
+    if ( device->charging ) {
+        device->level += device->chargePerMinute * simulatedMinutes;
+        if ( device->level >= 100 ) {
+            device->level = 100;
+            if ( device->cycle ) {
+                device->charging = 0;
+            }
+        }
+    } else {
+        device->level -= device->drainPerMinute * simulatedMinutes;
+        if ( device->level <= LOW_LEVEL_CHARGE_START && device->cycle ) {
+            device->charging = 1;
+        }
+        if ( device->level < 0 ) {
+            device->level = 0;
+        }
+    }
+}
+
+typedef enum mockeventtype {
+    EVENT_ATTACH,
+    EVENT_DETACH,
+    EVENT_BATTERY
+} mockeventtype;
+
+typedef struct mockevent {
+    mockeventtype type;
+    mockdevice *device;
+    Jabra_BatteryStatus *status;
+} mockevent;
+
+static void *simulate(void *arg)
+{
+    int eventCapacity = mockDeviceCount > 0 ? mockDeviceCount : 1;
+    mockevent *events = calloc(eventCapacity,sizeof(mockevent));
+    double lastTick = 0;
+    int firstScanReported = 0;
+
+    pthread_mutex_lock(&mockMutex);
+    while ( ! shuttingDown )
+    {
+        double now = secondsSinceStart();
+        double simulatedMinutes = (now - lastTick) * speedFactor / 60;
+        lastTick = now;
+
+        int eventCount = 0;
+        for ( int i = 0 ; i < mockDeviceCount ; i++ )
+        {
+            mockdevice *device = &mockDevices[i];
+            advanceDevice(device,simulatedMinutes);
+
+            mockevent *event = &events[eventCount];
+            event->device = device;
+            event->status = 0;
+            if ( ! device->attached && now >= device->attachAfter && ( device->detachAfter < 0 || now < device->detachAfter ) ) {
+                device->attached = 1;
+                event->type = EVENT_ATTACH;
+                eventCount++;
+            } else if ( device->attached && device->detachAfter >= 0 && now >= device->detachAfter ) {
+                device->attached = 0;
+                event->type = EVENT_DETACH;
+                eventCount++;
+            } else if ( device->attached && device->events && batteryCallback && clampLevel(device->level) != device->lastReportedLevel ) {
+                device->lastReportedLevel = clampLevel(device->level);
+                event->type = EVENT_BATTERY;
+                event->status = toBatteryStatus(device);
+                stats.batteryEvents++;
+                eventCount++;
+            }
+        }
+
+        // deliver callbacks without holding the lock, receivers may call back into the SDK
+        pthread_mutex_unlock(&mockMutex);
+        for ( int i = 0 ; i < eventCount ; i++ )
+        {
+            mockdevice *device = events[i].device;
+            switch( events[i].type ) {
+                case EVENT_ATTACH:
+                    if ( deviceAttachedCallback ) {
+                        deviceAttachedCallback( toDeviceInfo(device) );
+                    }
+                    break;
+                case EVENT_DETACH:
+                    if ( deviceRemovedCallback ) {
+                        deviceRemovedCallback( device->deviceID );
+                    }
+                    break;
+                case EVENT_BATTERY:
+                    batteryCallback( device->deviceID, events[i].status );
+                    break;
+            }
+        }
+        if ( ! firstScanReported ) {
+            firstScanReported = 1;
+            if ( firstScanDoneCallback ) {
+                firstScanDoneCallback();
+            }
+        }
+        usleep(TICK_MILLIS*1000);
+        pthread_mutex_lock(&mockMutex);
+    }
+    pthread_mutex_unlock(&mockMutex);
+    free(events);
+    return 0;
+}
+
+// simulates the device round-trip, returns Return_Ok or the error the call should fail with.
+// 'device' is set to NULL if the device is unknown.
+static Jabra_ReturnCode simulateCall(unsigned short deviceID, mockdevice **device, int isBatteryQuery)
+{
+    pthread_mutex_lock(&mockMutex);
+    *device = mockDevicesByID[deviceID];
+    if ( ! *device || ! (*device)->attached ) {
+        pthread_mutex_unlock(&mockMutex);
+        *device = 0;
+        return Device_Unknown;
+    }
+    int delay = (*device)->latencyMillis;
+    if ( (*device)->jitterMillis > 0 ) {
+        delay += (int) (randomDouble() * (*device)->jitterMillis);
+    }
+    int fails = (*device)->errorRate > 0 && randomDouble() < (*device)->errorRate;
+    Jabra_ReturnCode error = (*device)->error;
+    int hang = (*device)->hang && isBatteryQuery;
+
+    if ( hang ) {
+        while ( ! shuttingDown ) {
+            pthread_cond_wait(&mockShutdownCondition,&mockMutex);
+        }
+        pthread_mutex_unlock(&mockMutex);
+        return Return_Timeout;
+    }
+    pthread_mutex_unlock(&mockMutex);
+
+    if ( delay > 0 ) {
+        usleep(delay*1000);
+    }
+    return fails ? error : Return_Ok;
+}
+
+LIBRARY_API void Jabra_SetAppID(const char* inAppID)
+{
+}
+
+LIBRARY_API bool Jabra_InitializeV2(
+    void(*FirstScanForDevicesDoneFunc)(void),
+    void(*DeviceAttachedFunc)(Jabra_DeviceInfo deviceInfo),
+    void(*DeviceRemovedFunc)(unsigned short deviceID),
+    void(*ButtonInDataRawHidFunc)(unsigned short deviceID, unsigned short usagePage, unsigned short usage, bool buttonInData),
+    void(*ButtonInDataTranslatedFunc)(unsigned short deviceID, Jabra_HidInput translatedInData, bool buttonInData),
+    bool nonJabraDeviceDectection,
+    Config_params* configParams)
+{
+    if ( initialized ) {
+        return false;
+    }
+
+    const char *script = getenv("JABRA_MOCK_SCRIPT");
+    if ( ! script ) {
+        fprintf(stderr,"jabramock: JABRA_MOCK_SCRIPT is not set\n");
+        return false;
+    }
+
+    pthread_mutex_lock(&mockMutex);
+    free(mockDevices);
+    mockDevices = 0;
+    mockDeviceCount = 0;
+    memset(mockDevicesByID,0,sizeof(mockDevicesByID));
+    memset(&stats,0,sizeof(stats));
+    int loaded = loadScript(script);
+    pthread_mutex_unlock(&mockMutex);
+    if ( ! loaded ) {
+        return false;
+    }
+
+    firstScanDoneCallback = FirstScanForDevicesDoneFunc;
+    deviceAttachedCallback = DeviceAttachedFunc;
+    deviceRemovedCallback = DeviceRemovedFunc;
+    clock_gettime(CLOCK_MONOTONIC,&startTime);
+    shuttingDown = 0;
+
+    if ( pthread_create(&simulationThread,NULL,simulate,NULL) != 0 ) {
+        return false;
+    }
+    initialized = 1;
+    return true;
+}
+
+LIBRARY_API bool Jabra_Uninitialize(void)
+{
+    if ( ! initialized ) {
+        return false;
+    }
+    pthread_mutex_lock(&mockMutex);
+    shuttingDown = 1;
+    pthread_cond_broadcast(&mockShutdownCondition);
+    pthread_mutex_unlock(&mockMutex);
+
+    pthread_join(simulationThread,NULL);
+    initialized = 0;
+    return true;
+}
+
+LIBRARY_API void Jabra_FreeDeviceInfo(Jabra_DeviceInfo info)
+{
+    free(info.deviceName);
+    free(info.usbDevicePath);
+    free(info.parentInstanceId);
+    free(info.dongleName);
+    free(info.variant);
+    free(info.serialNumber);
+}
+
+LIBRARY_API void Jabra_RegisterBatteryStatusUpdateCallbackV2(BatteryStatusUpdateCallbackV2 const callback)
+{
+    batteryCallback = callback;
+}
+
+LIBRARY_API Jabra_ReturnCode Jabra_GetBatteryStatusV2(unsigned short deviceID, Jabra_BatteryStatus** batteryStatus)
+{
+    mockdevice *device;
+    Jabra_ReturnCode rc = simulateCall(deviceID,&device,1);
+
+    pthread_mutex_lock(&mockMutex);
+    stats.batteryQueries++;
+    if ( rc == Return_Ok ) {
+        *batteryStatus = toBatteryStatus(device);
+    } else {
+        stats.batteryQueryErrors++;
+    }
+    pthread_mutex_unlock(&mockMutex);
+    return rc;
+}
+
+LIBRARY_API void Jabra_CopyJabraBatteryStatus(const Jabra_BatteryStatus* from, Jabra_BatteryStatus* to)
+{
+    *to = *from;
+    if ( from->extraUnitsCount ) {
+        to->extraUnits = calloc(from->extraUnitsCount,sizeof(Jabra_BatteryStatusUnit));
+        memcpy(to->extraUnits,from->extraUnits,from->extraUnitsCount*sizeof(Jabra_BatteryStatusUnit));
+    }
+}
+
+LIBRARY_API void Jabra_FreeBatteryStatus(Jabra_BatteryStatus* batteryStatus)
+{
+    if ( batteryStatus ) {
+        free(batteryStatus->extraUnits);
+        free(batteryStatus);
+    }
+}
+
+LIBRARY_API Jabra_ReturnCode Jabra_GetRemoteControlBatteryStatus(unsigned short deviceID, int* levelInPercent, bool* charging, bool* batteryLow)
+{
+    mockdevice *device;
+    Jabra_ReturnCode rc = simulateCall(deviceID,&device,0);
+
+    pthread_mutex_lock(&mockMutex);
+    stats.remoteControlQueries++;
+    if ( rc == Return_Ok )
+    {
+        if ( device->remoteLevel < 0 ) {
+            rc = Not_Supported;
+        } else {
+            *levelInPercent = device->remoteLevel;
+            *charging = false;
+            *batteryLow = device->remoteLevel < 10;
+        }
+    }
+    pthread_mutex_unlock(&mockMutex);
+    return rc;
+}
+
+LIBRARY_API const DeviceFeature* Jabra_GetSupportedFeatures(unsigned short deviceID, unsigned int* count)
+{
+    mockdevice *device;
+    *count = 0;
+    Jabra_ReturnCode rc = simulateCall(deviceID,&device,0);
+
+    pthread_mutex_lock(&mockMutex);
+    stats.featureQueries++;
+    DeviceFeature *features = 0;
+    if ( rc == Return_Ok && device->remoteLevel >= 0 ) {
+        features = calloc(1,sizeof(DeviceFeature));
+        features[0] = RemoteControl;
+        *count = 1;
+    }
+    pthread_mutex_unlock(&mockMutex);
+    return features;
+}
+
+LIBRARY_API void Jabra_FreeSupportedFeatures(const DeviceFeature* features)
+{
+    free((void*) features);
+}
+
+LIBRARY_API bool Jabra_IsFeatureSupported(unsigned short deviceID, DeviceFeature feature)
+{
+    unsigned int count;
+    const DeviceFeature *features = Jabra_GetSupportedFeatures(deviceID,&count);
+    bool supported = false;
+    for ( unsigned int i = 0 ; i < count ; i++ ) {
+        supported |= features[i] == feature;
+    }
+    Jabra_FreeSupportedFeatures(features);
+    return supported;
+}
+
+void JabraMock_GetStats(jabramock_stats *result)
+{
+    pthread_mutex_lock(&mockMutex);
+    *result = stats;
+    pthread_mutex_unlock(&mockMutex);
+}
@@ -0,0 +1,23 @@
+#ifndef JABRAMOCK_H
+#define JABRAMOCK_H
+
+/*
+ * Extra entry points of the mock libjabra (mock/jabramock.c) that are not
+ * part of the Jabra SDK, used by benchmarks to look behind the curtain.
+ */
+
+#include <stdint.h>
+
+typedef struct jabramock_stats {
+    // number of devices described by the script
+    int deviceCount;
+    uint64_t batteryQueries;
+    uint64_t batteryQueryErrors;
+    uint64_t batteryEvents;
+    uint64_t remoteControlQueries;
+    uint64_t featureQueries;
+} jabramock_stats;
+
+void JabraMock_GetStats(jabramock_stats *stats);
+
+#endif